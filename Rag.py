@@ -9,7 +9,8 @@ RAG over a LARGE C/C++ codebase using only business-friendly open-source pieces:
   beautifulsoup4 (MIT), pathspec (MIT). These are all business-friendly.
 
 This script targets very large repos (100k+ files) and incremental updates per commit. It uses
-code-aware line chunking, skips build/vendor folders, and supports git-aware delta indexing.
+syntax-aware C/C++ chunking (one chunk per function/class/namespace), skips build/vendor folders, and
+supports git-aware delta indexing.
 
 --------------------------------------------------------------------------------
 USAGE OVERVIEW
@@ -30,12 +31,37 @@ USAGE OVERVIEW
 # 3) Incremental update using git diff (fast during CI)
 # python rag_code_ollama.py update-git --dir /path/to/repo --db ./.rag_db --collection my_cpp_repo --git-range HEAD~1..HEAD
 
+# 3b) Or keep a long-running watcher that indexes files as they are saved (Linux inotify)
+# python rag_code_ollama.py watch --dir /path/to/repo --db ./.rag_db --collection my_cpp_repo
+
 # 4) Ask a question (Retrieval + LLM with inline [n] citations)
 # python rag_code_ollama.py query --db ./.rag_db --collection my_cpp_repo --llm mistral --embed-model bge-m3 "How does the networking layer handle reconnection?"
 
-# 5) Helpful operations
+# 4b) Big trees: one index per git repo, searched in parallel (optionally on a Qdrant server)
+# python rag_code_ollama.py ingest --dir /pool --collection pool --shard-by repo --store qdrant --qdrant-url http://nas:6333
+
+# 4c) Only search part of the index (filters run inside the vector/keyword search, not on the top-k)
+# python rag_code_ollama.py query --db ./.rag_db --collection pool --repo netlib --ext .h,.cpp --path-prefix /pool/netlib/src/ "Who owns the socket?"
+
+# 4d) Many questions in one process (agents, eval fixtures): JSONL in, JSONL answers + sources out
+# python rag_code_ollama.py query-batch questions.jsonl --db ./.rag_db --collection my_cpp_repo --concurrency 4 --output answers.jsonl
+
+# 5) Keep the index and models warm for agents (local HTTP: POST /query, POST /search)
+# python rag_code_ollama.py serve --db ./.rag_db --collection my_cpp_repo --port 8765
+
+# 5b) Share one GPU between ingest and queries: run the priority queue and point --ollama-url at it
+# python rag_code_ollama.py llm-queue --port 11435 --limit bge-m3=4 --limit mistral=2
+# python rag_code_ollama.py ingest ... --ollama-url http://127.0.0.1:11435
+
+# 5c) Benchmark the pipeline on a generated 20k-file repo (JSON report for regression tracking)
+# python rag_code_ollama.py bench --synthetic-files 20000 --embed-model bge-m3 --llm mistral --out bench.json
+
+# 6) Helpful operations
 # python rag_code_ollama.py reindex-file --db ./.rag_db --collection my_cpp_repo --path src/foo/bar.cpp
+# python rag_code_ollama.py retry-failed --db ./.rag_db --collection my_cpp_repo   # chunks that failed to embed
 # python rag_code_ollama.py vacuum --dir /path/to/repo --db ./.rag_db --collection my_cpp_repo
+# Where the time goes: scrape http://127.0.0.1:9108/metrics during a run, or keep one JSON line per run
+# python rag_code_ollama.py update --dir /path/to/repo --collection my_cpp_repo --metrics-port 9108 --metrics-json runs.jsonl
 
 DISCLAIMER
 These examples reference models that are widely used under permissive licenses (e.g., Apache-2.0/MIT).
@@ -45,20 +71,45 @@ Always verify the specific model license you deploy in production. Core librarie
 from __future__ import annotations
 
 import argparse
+import array
+import bisect
 import concurrent.futures as futures
+import contextlib
+import ctypes
+import ctypes.util
 import dataclasses
+import functools
 import hashlib
+import importlib.util
+import itertools
 import json
+import math
+import multiprocessing
+import multiprocessing.connection
 import os
+import platform
+import queue
+import random
 import re
+import select
+import shutil
+import signal
+import sqlite3
+import struct
 import subprocess
 import sys
+import tempfile
+import threading
 import time
+import uuid
+from collections import Counter, OrderedDict, deque
 from dataclasses import dataclass
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
 from pathlib import Path
-from typing import Dict, Iterable, List, Optional, Sequence, Tuple
+from typing import Callable, Dict, Iterable, Iterator, List, Optional, Sequence, Tuple
 
 import requests
+from requests.adapters import HTTPAdapter
 from tqdm import tqdm
 
 # ------------------------------
@@ -90,6 +141,22 @@ try:
 except Exception:
     BeautifulSoup = None
 
+try:
+    # Only probed here (it pulls in torch); Reranker imports it when --rerank-model is given.
+    HAVE_SENTENCE_TRANSFORMERS = importlib.util.find_spec("sentence_transformers") is not None
+except Exception:
+    HAVE_SENTENCE_TRANSFORMERS = False
+
+try:
+    import numpy as np  # contiguous float32 vectors (chromadb depends on it); array('f') otherwise
+except Exception:
+    np = None
+
+try:
+    import resource  # POSIX only: memory cap for parse workers (--parse-mem-mb)
+except Exception:
+    resource = None
+
 try:
     import pathspec  # read/merge .gitignore rules (MIT)
 except Exception:
@@ -104,6 +171,8 @@ CODE_EXTS = {
     ".ipp", ".tpp", ".ixx",
     "CMakeLists.txt", ".cmake", ".mak", ".mk",
 }
+# C/C++ sources the syntax-aware chunker understands (build files keep line windows)
+CPP_EXTS = CODE_EXTS - {"CMakeLists.txt", ".cmake", ".mak", ".mk"}
 DOC_EXTS = {".md", ".txt"}
 AUX_EXTS = {".html", ".htm", ".docx", ".pdf"}
 SUPPORTED_EXTS = CODE_EXTS | DOC_EXTS | AUX_EXTS
@@ -120,8 +189,9 @@ DEFAULT_IGNORES = [
 # ------------------------------
 
 def sha1_file(path: Path, block: int = 1024 * 1024) -> str:
-    """Compute a stable SHA-1 of the file. Used to derive chunk IDs and detect changes."""
-    h = hashlib.sha1()
+    """SHA-1 of the file in git's blob format ("blob <size>\\0" + content), i.e. what `git hash-object`
+    prints, so update-git can take content keys straight from `git diff --raw` without reading the file."""
+    h = hashlib.sha1(b"blob %d\0" % path.stat().st_size)
     with path.open("rb") as f:
         for chunk in iter(lambda: f.read(block), b""):
             h.update(chunk)
@@ -134,12 +204,220 @@ def fast_sig(path: Path) -> Tuple[int, float]:
     return (st.st_size, st.st_mtime)
 
 
+def normalize_chunk_text(text: str) -> str:
+    """Whitespace-insensitive form of a chunk used for content addressing (trailing spaces, blank-line runs)."""
+    lines = [ln.rstrip() for ln in text.strip().splitlines()]
+    return re.sub(r"\n{3,}", "\n\n", "\n".join(lines))
+
+
+def chunk_content_hash(text: str) -> str:
+    return hashlib.sha1(normalize_chunk_text(text).encode("utf-8", errors="ignore")).hexdigest()
+
+
 def slugify(text: str) -> str:
     text = text.lower()
     text = re.sub(r"[^a-z0-9-_]+", "-", text)
     text = re.sub(r"-+", "-", text).strip("-")
     return text or "collection"
 
+# ------------------------------
+# Metrics (Prometheus text + JSON run log)
+# ------------------------------
+
+class Metrics:
+    """Process-wide counters, gauges and latency histograms, keyed by (name, labels).
+
+    Every stage records into the module-level METRICS. `serve` exposes it on GET /metrics; other commands
+    do so with --metrics-port, and --metrics-json appends a per-run summary. Histograms keep fixed buckets
+    (for Prometheus) and a bounded recent-sample ring (for the percentiles in the JSON summary).
+    """
+
+    BUCKETS = (0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0, 120.0)
+    SAMPLES = 2048
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._kinds: Dict[str, Tuple[str, str]] = {}  # name -> (type, help)
+        self._counters: Dict[Tuple[str, Tuple], float] = {}
+        self._gauges: Dict[Tuple[str, Tuple], float] = {}
+        self._hists: Dict[Tuple[str, Tuple], Dict] = {}
+        self.started = time.time()
+
+    def describe(self, name: str, kind: str, help_text: str):
+        self._kinds[name] = (kind, help_text)
+
+    @staticmethod
+    def _key(name: str, labels: Dict) -> Tuple[str, Tuple]:
+        return name, tuple(sorted((k, str(v)) for k, v in labels.items()))
+
+    def inc(self, name: str, value: float = 1.0, **labels):
+        key = self._key(name, labels)
+        with self._lock:
+            self._counters[key] = self._counters.get(key, 0.0) + value
+
+    def set(self, name: str, value: float, **labels):
+        with self._lock:
+            self._gauges[self._key(name, labels)] = float(value)
+
+    def observe(self, name: str, seconds: float, **labels):
+        key = self._key(name, labels)
+        with self._lock:
+            h = self._hists.get(key)
+            if h is None:
+                h = self._hists[key] = {"buckets": [0] * len(self.BUCKETS), "sum": 0.0, "count": 0, "samples": []}
+            i = bisect.bisect_left(self.BUCKETS, seconds)
+            if i < len(self.BUCKETS):
+                h["buckets"][i] += 1
+            h["sum"] += seconds
+            h["count"] += 1
+            if len(h["samples"]) < self.SAMPLES:
+                h["samples"].append(seconds)
+            else:
+                h["samples"][h["count"] % self.SAMPLES] = seconds
+
+    @contextlib.contextmanager
+    def timer(self, name: str, **labels):
+        t0 = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.observe(name, time.perf_counter() - t0, **labels)
+
+    @staticmethod
+    def _fmt_labels(labels: Tuple, extra: str = "") -> str:
+        parts = [f"{k}={json.dumps(v, ensure_ascii=False)}" for k, v in labels]  # JSON escaping matches the exposition format
+        if extra:
+            parts.append(extra)
+        return "{" + ",".join(parts) + "}" if parts else ""
+
+    def prometheus(self) -> str:
+        """Text exposition format (version 0.0.4)."""
+        with self._lock:
+            counters = sorted(self._counters.items())
+            gauges = sorted(self._gauges.items())
+            hists = sorted((k, {**h, "buckets": list(h["buckets"])}) for k, h in self._hists.items())
+        out: List[str] = []
+        seen: set = set()
+
+        def header(name: str, default_kind: str):
+            if name not in seen:
+                seen.add(name)
+                kind, help_text = self._kinds.get(name, (default_kind, ""))
+                if help_text:
+                    out.append(f"# HELP {name} {help_text}")
+                out.append(f"# TYPE {name} {kind}")
+
+        for (name, labels), v in counters:
+            header(name, "counter")
+            out.append(f"{name}{self._fmt_labels(labels)} {v:g}")
+        for (name, labels), v in gauges:
+            header(name, "gauge")
+            out.append(f"{name}{self._fmt_labels(labels)} {v:g}")
+        for (name, labels), h in hists:
+            header(name, "histogram")
+            cum = 0
+            for le, n in zip(self.BUCKETS, h["buckets"]):
+                cum += n
+                le_label = f'le="{le:g}"'
+                out.append(f"{name}_bucket{self._fmt_labels(labels, le_label)} {cum}")
+            inf_label = 'le="+Inf"'
+            out.append(f"{name}_bucket{self._fmt_labels(labels, inf_label)} {h['count']}")
+            out.append(f"{name}_sum{self._fmt_labels(labels)} {h['sum']:.6f}")
+            out.append(f"{name}_count{self._fmt_labels(labels)} {h['count']}")
+        return "\n".join(out) + "\n"
+
+    def snapshot(self) -> Dict:
+        """JSON-friendly summary: counters and gauges as values, histograms as count/sum/percentiles."""
+        def label(name: str, labels: Tuple) -> str:
+            return name + ("{" + ",".join(f"{k}={v}" for k, v in labels) + "}" if labels else "")
+
+        with self._lock:
+            snap = {"counters": {label(*k): v for k, v in sorted(self._counters.items())},
+                    "gauges": {label(*k): v for k, v in sorted(self._gauges.items())},
+                    "timers": {}}
+            hists = [(label(*k), h["count"], h["sum"], list(h["samples"])) for k, h in sorted(self._hists.items())]
+        for name, count, total, samples in hists:
+            snap["timers"][name] = {"count": count, "sum_s": total, **_percentiles(samples)}
+        return snap
+
+
+def _percentiles(samples: Sequence[float]) -> Dict[str, float]:
+    if not samples:
+        return {}
+    xs = sorted(samples)
+
+    def pct(p: float) -> float:
+        k = (len(xs) - 1) * p
+        lo = int(k)
+        hi = min(lo + 1, len(xs) - 1)
+        return xs[lo] + (xs[hi] - xs[lo]) * (k - lo)
+
+    return {"p50": pct(0.50), "p95": pct(0.95), "p99": pct(0.99), "max": xs[-1], "mean": sum(xs) / len(xs), "n": len(xs)}
+
+
+METRICS = Metrics()
+for _name, _kind, _help in (
+    ("rag_scan_seconds", "histogram", "Directory discovery wall time per scan"),
+    ("rag_scan_files_total", "counter", "Candidate files found by discovery"),
+    ("rag_parse_seconds", "histogram", "Per-file time reading/extracting text (hash included)"),
+    ("rag_chunk_seconds", "histogram", "Per-file time splitting text into chunks"),
+    ("rag_files_total", "counter", "Files through the parse stage, by outcome"),
+    ("rag_chunks_total", "counter", "Chunks produced by the parse stage"),
+    ("rag_chunks_dropped_total", "counter", "Chunks not stored, by reason"),
+    ("rag_banners_stripped_total", "counter", "Repeated leading comment blocks (license banners) stripped before embedding"),
+    ("rag_parse_worker_restarts_total", "counter", "Parse workers killed and replaced (timeout, memory cap, crash)"),
+    ("rag_embed_seconds", "histogram", "Latency of one embedding request (one batch)"),
+    ("rag_embed_requests_total", "counter", "Embedding requests, by outcome"),
+    ("rag_embed_retries_total", "counter", "Embedding request retries after a failure"),
+    ("rag_embed_chunks_total", "counter", "Texts embedded, by source (ollama or cache)"),
+    ("rag_ratelimit_wait_seconds", "histogram", "Time an embedding request waited for the client-side rate limiter"),
+    ("rag_ratelimit_qps", "gauge", "Current client-side refill rate (drops on Ollama backpressure)"),
+    ("rag_embed_concurrency", "gauge", "Embedding requests allowed in flight (--adaptive)"),
+    ("rag_embed_batch", "gauge", "Chunks per embedding request (--adaptive)"),
+    ("rag_ollama_failovers_total", "counter", "Requests moved to another Ollama endpoint, by reason"),
+    ("rag_store_seconds", "histogram", "Vector store call latency, by op"),
+    ("rag_store_rows_total", "counter", "Vector store rows added / source paths deleted, by op"),
+    ("rag_query_seconds", "histogram", "Query latency by stage (embed, retrieve, rerank, ttft, generate, total)"),
+    ("rag_queries_total", "counter", "Questions answered or searched, by kind"),
+):
+    METRICS.describe(_name, _kind, _help)
+
+
+def start_metrics_server(host: str, port: int) -> ThreadingHTTPServer:
+    """Serve METRICS on http://host:port/metrics (Prometheus) and /metrics.json from a daemon thread."""
+    class Handler(BaseHTTPRequestHandler):
+        def do_GET(self):
+            path = self.path.split("?", 1)[0]
+            if path == "/metrics":
+                data, ctype = METRICS.prometheus().encode(), "text/plain; version=0.0.4"
+            elif path == "/metrics.json":
+                data, ctype = json.dumps(METRICS.snapshot()).encode(), "application/json"
+            else:
+                self.send_error(404)
+                return
+            self.send_response(200)
+            self.send_header("Content-Type", ctype)
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+
+        def log_message(self, fmt, *a):
+            pass
+
+    httpd = ThreadingHTTPServer((host, port), Handler)
+    httpd.daemon_threads = True
+    threading.Thread(target=httpd.serve_forever, daemon=True, name="metrics").start()
+    return httpd
+
+
+def write_metrics_json(path: str, cmd: str, args, status: str):
+    """Append one JSON line describing this run (command, knobs, outcome, every metric) to `path`."""
+    knobs = {k: v for k, v in vars(args).items() if isinstance(v, (int, float, str, bool, type(None))) and k != "question"}
+    record = {"ts": time.strftime("%Y-%m-%dT%H:%M:%S"), "cmd": cmd, "status": status,
+              "wall_s": time.time() - METRICS.started, "args": knobs, **METRICS.snapshot()}
+    with open(path, "a", encoding="utf-8") as f:
+        f.write(json.dumps(record, default=str) + "\n")
+
 # ------------------------------
 # Loading & parsing
 # ------------------------------
@@ -151,22 +429,53 @@ def read_text_utf8(path: Path) -> str:
         return path.read_text(errors="ignore")
 
 
-def load_pdf(path: Path) -> List[Tuple[str, Dict]]:
+STREAM_SEGMENT_BYTES = 4 << 20  # text files larger than this are read (and chunked) one segment at a time
+
+
+def iter_text_segments(path: Path, segment_bytes: int = STREAM_SEGMENT_BYTES) -> Iterator[Tuple[str, Dict]]:
+    """Read a large text file incrementally: (text, {"line_offset": lines before it}) per segment of about
+    `segment_bytes`, split on line boundaries (a single longer line is cut), so memory stays bounded by one
+    segment however large the file is."""
+    offset = 0
+    with path.open("rb") as f:
+        while True:
+            lines: List[bytes] = []
+            size = 0
+            while size < segment_bytes:
+                line = f.readline(segment_bytes)
+                if not line:
+                    break
+                lines.append(line)
+                size += len(line)
+            if not lines:
+                return
+            yield b"".join(lines).decode("utf-8", errors="ignore"), {"line_offset": offset}
+            offset += sum(1 for ln in lines if ln.endswith(b"\n"))
+
+
+def iter_pdf_pages(path: Path) -> Iterator[Tuple[str, Dict]]:
+    """Yield (text, {"page": n}) page by page, so a 900-page scan is chunked and embedded as it is read."""
     if PdfReader is None:
-        return []
-    texts: List[Tuple[str, Dict]] = []
+        return
     try:
         reader = PdfReader(str(path))
-        for i, page in enumerate(reader.pages):
-            try:
-                t = page.extract_text() or ""
-            except Exception:
-                t = ""
-            if t.strip():
-                texts.append((t, {"page": i + 1}))
+        pages = reader.pages
     except Exception as e:
         print(f"[WARN] Failed to read PDF {path}: {e}")
-    return texts
+        return
+    for i, page in enumerate(pages):
+        try:
+            t = page.extract_text() or ""
+        except MemoryError:
+            raise
+        except Exception:
+            t = ""
+        if t.strip():
+            yield t, {"page": i + 1}
+
+
+def load_pdf(path: Path) -> List[Tuple[str, Dict]]:
+    return list(iter_pdf_pages(path))
 
 
 def load_docx(path: Path) -> str:
@@ -196,53 +505,303 @@ def load_html(path: Path) -> str:
         return ""
 
 
-def read_file_entries(path: Path) -> List[Tuple[str, Dict]]:
-    """Return a list of (text, extra_metadata) entries for a file.
-    Code files: single entry (we chunk by lines later)
-    PDFs: per-page entries
-    Other docs: single entry
+def iter_file_entries(path: Path) -> Iterator[Tuple[str, Dict]]:
+    """Yield (text, extra_metadata) entries for a file.
+    Code files: single entry (we chunk by lines later); over STREAM_SEGMENT_BYTES, one per segment
+    PDFs: per-page entries, read lazily
+    Other docs: single entry (text docs over STREAM_SEGMENT_BYTES: one per segment)
     """
     name = path.name
     ext = path.suffix.lower()
 
     if name == "CMakeLists.txt":
-        return [(read_text_utf8(path), {})]
+        yield read_text_utf8(path), {}
+        return
 
+    if ext == ".pdf":
+        yield from iter_pdf_pages(path)
+        return
+    if (ext in CODE_EXTS or ext in DOC_EXTS) and path.stat().st_size > STREAM_SEGMENT_BYTES:
+        yield from iter_text_segments(path)
+        return
     if ext in CODE_EXTS or ext in DOC_EXTS:
         t = read_text_utf8(path)
-        return [(t, {})] if t.strip() else []
-    elif ext == ".pdf":
-        return load_pdf(path)
     elif ext == ".docx":
         t = load_docx(path)
-        return [(t, {})] if t.strip() else []
     elif ext in {".html", ".htm"}:
         t = load_html(path)
-        return [(t, {})] if t.strip() else []
     else:
-        return []
+        return
+    if t.strip():
+        yield t, {}
+
+
+def read_file_entries(path: Path) -> List[Tuple[str, Dict]]:
+    return list(iter_file_entries(path))
 
 # ------------------------------
 # Code-aware chunking (line windows)
 # ------------------------------
 
-def chunk_code_lines(text: str, max_lines: int = 120, overlap: int = 20) -> List[str]:
-    """Chunk code by line windows so functions and context stay together."""
-    lines = text.splitlines()
-    chunks: List[str] = []
-    if not lines:
-        return chunks
-
+def _line_windows(n_lines: int, max_lines: int, overlap: int) -> Iterable[Tuple[int, int]]:
+    """[start, end) line ranges of overlapping windows."""
     step = max(1, max_lines - overlap)
-    for start in range(0, len(lines), step):
-        end = min(len(lines), start + max_lines)
+    for start in range(0, n_lines, step):
+        end = min(n_lines, start + max_lines)
+        yield start, end
+        if end == n_lines:
+            break
+
+
+def chunk_code_windows(text: str, max_lines: int = 120, overlap: int = 20) -> List[Tuple[str, Dict]]:
+    """Line-window chunks with their 1-based line range."""
+    lines = text.splitlines()
+    out: List[Tuple[str, Dict]] = []
+    for start, end in _line_windows(len(lines), max_lines, overlap):
         chunk = "\n".join(lines[start:end])
         chunk = re.sub(r"\n{3,}", "\n\n", chunk)
         if chunk.strip():
-            chunks.append(chunk)
-        if end == len(lines):
-            break
-    return chunks
+            out.append((chunk, {"start_line": start + 1, "end_line": end}))
+    return out
+
+
+def chunk_code_lines(text: str, max_lines: int = 120, overlap: int = 20) -> List[str]:
+    """Chunk code by line windows so functions and context stay together."""
+    return [chunk for chunk, _ in chunk_code_windows(text, max_lines, overlap)]
+
+# ------------------------------
+# Syntax-aware C/C++ chunking (top-level blocks)
+# ------------------------------
+
+@dataclass
+class _CppUnit:
+    start: int          # char offset of the unit (including leading comments)
+    end: int            # char offset just past the unit
+    body_open: int = -1   # offset of the first top-level "{", if any
+    body_close: int = -1  # offset of its matching "}"
+    kind: str = "decl"
+    symbol: str = ""
+
+
+def _skip_literal(text: str, i: int, end: int) -> int:
+    """`text[i]` opens a string/char literal; return the offset just past it (raw strings included)."""
+    q = text[i]
+    if q == '"' and i > 0 and text[i - 1] == "R":
+        m = re.match(r'"([^()\\\s]{0,16})\(', text[i : i + 20])
+        if m:
+            close = text.find(f"){m.group(1)}\"", i)
+            return end if close < 0 else close + len(m.group(1)) + 2
+    j = i + 1
+    while j < end:
+        c = text[j]
+        if c == "\\":
+            j += 2
+            continue
+        if c == q or c == "\n":
+            return j + 1
+        j += 1
+    return end
+
+
+_CPP_SIGNIFICANT = frozenset("{};\"'#/")
+_CPP_SIGNIFICANT_RE = re.compile(r"[{};\"'#/]")
+
+
+def _cpp_units(text: str, start: int, end: int) -> List[_CppUnit]:
+    """Split text[start:end] into brace-balanced top-level units: `;`-terminated declarations,
+    `{...}` blocks (functions, classes, namespaces) and preprocessor lines. Comments attach to what follows."""
+    units: List[_CppUnit] = []
+    cur: Optional[_CppUnit] = None
+    has_code = False
+    depth = 0
+    want_semicolon = False  # after class/struct/enum bodies and brace initializers
+    i = start
+
+    def emit(stop: int):
+        nonlocal cur, has_code, want_semicolon
+        if cur is not None:
+            cur.end = stop
+            units.append(cur)
+        cur, has_code, want_semicolon = None, False, False
+
+    while i < end:
+        c = text[i]
+        if c not in _CPP_SIGNIFICANT:
+            # Jump straight to the next character that can change state.
+            m = _CPP_SIGNIFICANT_RE.search(text, i, end)
+            j = m.start() if m else end
+            seg = text[i:j]
+            if seg.strip():
+                if cur is None:
+                    cur = _CppUnit(start=i + len(seg) - len(seg.lstrip()), end=i)
+                has_code = True
+            i = j
+            continue
+        if text.startswith("//", i):
+            if cur is None:
+                cur = _CppUnit(start=i, end=i)
+            j = text.find("\n", i, end)
+            i = end if j < 0 else j + 1
+            continue
+        if text.startswith("/*", i):
+            if cur is None:
+                cur = _CppUnit(start=i, end=i)
+            j = text.find("*/", i + 2, end)
+            i = end if j < 0 else j + 2
+            continue
+        if c == "#" and depth == 0 and not has_code and text[text.rfind("\n", 0, i) + 1 : i].strip() == "":
+            j = i
+            while True:  # honour backslash continuations
+                nl = text.find("\n", j, end)
+                if nl < 0:
+                    j = end
+                    break
+                if text[nl - 1 : nl] == "\\" or text[nl - 2 : nl] == "\\\r":
+                    j = nl + 1
+                    continue
+                j = nl + 1
+                break
+            if cur is None:
+                cur = _CppUnit(start=i, end=i)
+            cur.kind = "preproc"
+            emit(j)
+            i = j
+            continue
+        if cur is None:
+            cur = _CppUnit(start=i, end=i)
+        if c in "\"'":
+            if c == "'" and i > start and text[i - 1].isdigit():  # C++14 digit separator
+                i += 1
+                continue
+            has_code = True
+            i = _skip_literal(text, i, end)
+            continue
+        if c == "{":
+            if depth == 0 and cur.body_open < 0:
+                cur.body_open = i
+            depth += 1
+        elif c == "}":
+            depth = max(0, depth - 1)
+            if depth == 0 and cur.body_open >= 0 and cur.body_close < 0:
+                cur.body_close = i
+                header = text[cur.start : cur.body_open]
+                if _is_type_header(header) or re.search(r"=\s*$", header):
+                    want_semicolon = True
+                else:
+                    emit(i + 1)
+                    i += 1
+                    continue
+        elif c == ";" and depth == 0:
+            emit(i + 1)
+            i += 1
+            continue
+        has_code = True
+        i += 1
+    if cur is not None:
+        emit(end)  # trailing code, or comments with nothing after them
+    return units
+
+
+def _strip_comments(s: str) -> str:
+    s = re.sub(r"/\*.*?\*/", " ", s, flags=re.S)
+    return re.sub(r"//[^\n]*", " ", s)
+
+
+def _is_type_header(header: str) -> bool:
+    h = _strip_comments(header)
+    m = re.search(r"\b(class|struct|union|enum)\b", h)
+    return bool(m) and "(" not in h[: m.start()] and ")" not in h[m.end():].split(":", 1)[0]
+
+
+def _cpp_describe(text: str, u: _CppUnit) -> Tuple[str, str]:
+    """(kind, symbol) of a unit from its header (the text before its body or terminating `;`)."""
+    if u.kind == "preproc":
+        return "preproc", ""
+    stop = u.body_open if u.body_open >= 0 else u.end
+    h = " ".join(_strip_comments(text[u.start : stop]).split())
+    h = re.sub(r"^template\s*<.*?>\s*", "", h)
+    m = re.match(r"(?:inline\s+)?namespace\b\s*([\w:]*)", h)
+    if m:
+        return "namespace", m.group(1) or "(anonymous)"
+    if h.startswith('extern "C'):
+        return "extern", 'extern "C"'
+    m = re.search(r"\b(class|struct|union|enum)\b", h)
+    if m and _is_type_header(h):
+        rest = re.split(r"(?<!:):(?!:)|\{", h[m.end():], 1)[0]
+        names = [w for w in re.findall(r"[A-Za-z_]\w*", rest) if w not in ("class", "struct", "final", "alignas")]
+        if u.body_open >= 0:
+            return m.group(1), names[-1] if names else "(anonymous)"
+        return "decl", names[-1] if names else ""
+    paren = h.find("(")
+    if paren > 0:
+        m = re.search(r"((?:[A-Za-z_]\w*(?:<[^<>()]*>)?::)*~?(?:operator\s*[^\s(]+|[A-Za-z_]\w*))\s*$", h[:paren])
+        if m:
+            return ("function" if u.body_open >= 0 else "decl"), m.group(1)
+    return "decl", ""
+
+
+def chunk_code_syntax(text: str, max_lines: int = 120, overlap: int = 20) -> List[Tuple[str, Dict]]:
+    """One chunk per function / class / namespace block, small siblings packed together up to `max_lines`.
+
+    Namespaces, `extern "C"` and classes that don't fit are split into their members; a single function that
+    doesn't fit falls back to line windows. Metadata carries "symbol" (comma-separated for packed chunks)
+    and the 1-based "start_line"/"end_line".
+    """
+    lines = text.splitlines()
+    if not lines:
+        return []
+    line_starts = [0]
+    for ln in lines[:-1]:
+        line_starts.append(line_starts[-1] + len(ln) + 1)
+
+    def line_of(off: int) -> int:
+        return bisect.bisect_right(line_starts, off)  # 1-based
+
+    leaves: List[Tuple[int, int, str]] = []  # (start_line, end_line, symbol)
+
+    def walk(units: List[_CppUnit], prefix: str):
+        for u in units:
+            kind, sym = _cpp_describe(text, u)
+            sl, el = line_of(u.start), line_of(max(u.start, u.end - 1))
+            qual = f"{prefix}{sym}" if sym and kind != "extern" else sym
+            if el - sl + 1 > max_lines and kind in ("namespace", "extern", "class", "struct", "union") and u.body_close > u.body_open >= 0:
+                inner = _cpp_units(text, u.body_open + 1, u.body_close)
+                if inner:
+                    first = len(leaves)
+                    walk(inner, f"{qual}::" if kind != "extern" else prefix)
+                    # The block's own opening and closing lines ("namespace net {", "}  // namespace net")
+                    # go with its first and last members, so no line of the file is left out.
+                    leaves[first] = (min(sl, leaves[first][0]),) + leaves[first][1:]
+                    leaves[-1] = (leaves[-1][0], max(el, leaves[-1][1]), leaves[-1][2])
+                    continue
+            leaves.append((sl, el, qual))
+
+    walk(_cpp_units(text, 0, len(text)), "")
+
+    out: List[Tuple[str, Dict]] = []
+
+    def emit(sl: int, el: int, symbols: List[str]):
+        body = re.sub(r"\n{3,}", "\n\n", "\n".join(lines[sl - 1 : el]))
+        if body.strip():
+            syms = list(dict.fromkeys(x for x in symbols if x))
+            out.append((body, {"symbol": ", ".join(syms)[:200], "start_line": sl, "end_line": el}))
+
+    group: List[Tuple[int, int, str]] = []
+    for sl, el, sym in leaves:
+        if el - sl + 1 > max_lines:
+            if group:
+                emit(group[0][0], group[-1][1], [g[2] for g in group])
+                group = []
+            for ws, we in _line_windows(el - sl + 1, max_lines, overlap):
+                emit(sl + ws, sl + we - 1, [sym])
+            continue
+        if group and el - group[0][0] + 1 > max_lines:
+            emit(group[0][0], group[-1][1], [g[2] for g in group])
+            group = []
+        group.append((sl, el, sym))
+    if group:
+        emit(group[0][0], group[-1][1], [g[2] for g in group])
+    return out
 
 
 def chunk_text_paragraphs(text: str, max_chars: int = 1200, overlap: int = 200) -> List[str]:
@@ -267,58 +826,1490 @@ def chunk_text_paragraphs(text: str, max_chars: int = 1200, overlap: int = 200)
             out.append(text[i : i + max_chars])
     return out
 
+# ------------------------------
+# Client-side rate limiting
+# ------------------------------
+
+class LatencyBaseline:
+    """Best recent latency per request-size class (`items` rounded down to a power of two).
+
+    Fixed per-request overhead makes a 1-text request slow per text and a full batch slow per request, so
+    neither raw nor per-text latency compares across sizes; each response is judged against its own class.
+    """
+
+    def __init__(self, window: int = 256):
+        self.window = max(1, window)
+        self._recent: Dict[int, "deque[float]"] = {}
+
+    def ratio(self, latency: float, items: int) -> float:
+        """Record a response and return its latency over the best recent one of the same size class."""
+        recent = self._recent.setdefault(max(1, items).bit_length(), deque(maxlen=self.window))
+        recent.append(latency)
+        return latency / max(1e-6, min(recent))
+
+
+class RateLimiter:
+    """Token bucket shared by all embedding workers.
+
+    Tokens refill at `rate`/sec up to `burst`; every HTTP request takes one (rate <= 0: no bucket).
+    `max_inflight` (0 = unlimited) caps concurrent requests, or `controller` sets that cap adaptively.
+    When Ollama pushes back (HTTP 429/503, or latency far above the best recent one for requests of that
+    size) the refill rate is halved; each clean response then wins back a tenth of the configured rate.
+    """
+
+    SLOW_FACTOR = 4.0
+    OVERLOAD_STATUS = (429, 500, 502, 503, 504)
+
+    def __init__(self, rate: float, burst: int = 1, max_inflight: int = 0, controller: Optional["AdaptiveConcurrency"] = None):
+        self.unlimited = rate <= 0
+        self.max_rate = max(0.1, rate)
+        self.rate = 0.0 if self.unlimited else self.max_rate
+        self.controller = controller
+        self.burst = max(1, burst)
+        self._tokens = float(self.burst)
+        self._stamp = time.monotonic()
+        self._lock = threading.Lock()
+        self._inflight = threading.BoundedSemaphore(max_inflight) if max_inflight > 0 else None
+        self._baseline = LatencyBaseline()
+
+    def _take(self):
+        if self.unlimited:
+            return
+        while True:
+            with self._lock:
+                now = time.monotonic()
+                self._tokens = min(float(self.burst), self._tokens + (now - self._stamp) * self.rate)
+                self._stamp = now
+                if self._tokens >= 1.0:
+                    self._tokens -= 1.0
+                    return
+                wait = (1.0 - self._tokens) / self.rate
+            time.sleep(wait)
+
+    def _backoff(self):
+        if self.unlimited:
+            return
+        with self._lock:
+            self.rate = max(0.1, self.rate / 2.0)
+
+    def _on_success(self, latency: float, items: int = 1):
+        if self.unlimited:
+            return
+        with self._lock:
+            if self._baseline.ratio(latency, items) > self.SLOW_FACTOR:
+                self.rate = max(0.1, self.rate / 2.0)
+            else:
+                self.rate = min(self.max_rate, self.rate + self.max_rate / 10.0)
+
+    @contextlib.contextmanager
+    def slot(self, items: int = 1):
+        """Block until a token (and an in-flight slot) is available, then time the request (`items` texts)."""
+        ctl = self.controller
+        if self._inflight:
+            self._inflight.acquire()
+        if ctl:
+            ctl.acquire()
+        try:
+            self._take()
+            t0 = time.monotonic()
+            try:
+                yield
+            except requests.HTTPError as e:
+                code = e.response.status_code if e.response is not None else None
+                if code in (429, 503):
+                    self._backoff()
+                if ctl and code in self.OVERLOAD_STATUS:
+                    ctl.on_overload()
+                raise
+            except requests.Timeout:
+                self._backoff()
+                if ctl:
+                    ctl.on_overload()
+                raise
+            except requests.ConnectionError:
+                if ctl:
+                    ctl.on_overload()
+                raise
+            latency = time.monotonic() - t0
+            self._on_success(latency, items)
+            if ctl:
+                ctl.on_success(latency, items)
+        finally:
+            if ctl:
+                ctl.release()
+            if self._inflight:
+                self._inflight.release()
+
+
+class AdaptiveConcurrency:
+    """AIMD control of embedding requests (--adaptive): how many are in flight, and how many chunks each carries.
+
+    A response is clean when its latency stays within TOLERANCE x the best of the last WINDOW responses of
+    the same size (see LatencyBaseline), so a halved batch isn't penalised for its per-request overhead. A
+    full round of clean responses (one per in-flight slot) adds one slot and grows the batch back toward its
+    ceiling. Overload (timeouts, connection errors, 429/5xx) halves both; latency past TOLERANCE
+    takes a quarter off the slots. At most one decrease per round, so requests that were already in flight
+    when the pushback started don't collapse the limit to 1.
+    """
+
+    TOLERANCE = 2.0
+    WINDOW = 256
+    LOG_EVERY = 30.0
+
+    def __init__(self, max_limit: int, max_batch: int, start: int = 2):
+        self.max_limit = max(1, max_limit)
+        self.max_batch = max(1, max_batch)
+        self.limit = min(self.max_limit, max(1, start))
+        self.batch = self.max_batch
+        self.low = self.high = self.limit
+        self._inflight = 0
+        self._cond = threading.Condition()
+        self._baseline = LatencyBaseline(self.WINDOW)
+        self._limits: "deque[int]" = deque(maxlen=self.WINDOW)  # limit at each recent response
+        self._clean = 0
+        self._since_cut = self.max_limit  # a decrease is allowed straight away
+        self._logged = (self.limit, self.batch, time.monotonic())
+        self._publish()
+
+    def acquire(self):
+        with self._cond:
+            while self._inflight >= self.limit:
+                self._cond.wait()
+            self._inflight += 1
+
+    def release(self):
+        with self._cond:
+            self._inflight -= 1
+            self._cond.notify()
+
+    def on_success(self, latency: float, items: int):
+        with self._cond:
+            self._since_cut += 1
+            self._limits.append(self.limit)
+            if self._baseline.ratio(latency, items) > self.TOLERANCE:
+                self._decrease(0.75, shrink_batch=False)
+            else:
+                self._clean += 1
+                if self._clean >= self.limit:
+                    self._clean = 0
+                    if self.limit < self.max_limit:
+                        self.limit += 1
+                        self.high = max(self.high, self.limit)
+                        self._cond.notify_all()
+                    self.batch = min(self.max_batch, self.batch + max(1, self.max_batch // 8))
+            self._publish()
+
+    def on_overload(self):
+        with self._cond:
+            self._since_cut += 1
+            self._decrease(0.5, shrink_batch=True)
+            self._publish()
+
+    def _decrease(self, factor: float, shrink_batch: bool):
+        if self._since_cut < self.limit:
+            return  # already cut this round
+        self._since_cut = self._clean = 0
+        self.limit = max(1, int(self.limit * factor))
+        self.low = min(self.low, self.limit)
+        if shrink_batch:
+            self.batch = max(1, self.batch // 2)
+
+    def _publish(self):
+        METRICS.set("rag_embed_concurrency", self.limit)
+        METRICS.set("rag_embed_batch", self.batch)
+        limit, batch, at = self._logged
+        now = time.monotonic()
+        if (limit, batch) != (self.limit, self.batch) and now - at >= self.LOG_EVERY:
+            self._logged = (self.limit, self.batch, now)
+            print(f"[INFO] Adaptive embedding: {self.limit} in flight, batch {self.batch}", file=sys.stderr)
+
+    def settled(self) -> int:
+        """Median limit over the recent responses (AIMD keeps probing around it)."""
+        limits = sorted(self._limits)
+        return limits[len(limits) // 2] if limits else self.limit
+
+    def summary(self) -> str:
+        return (f"settled at {self.settled()} in flight (range {self.low}-{self.high} of {self.max_limit}), "
+                f"batch {self.batch} of {self.max_batch}")
+
 # ------------------------------
 # Ollama client (embeddings + chat)
 # ------------------------------
 
-class OllamaClient:
-    def __init__(self, base_url: str = "http://localhost:11434", timeout: int = 120):
+PRIORITY_HEADER = "X-Rag-Priority"
+PRIORITIES = ("interactive", "batch")
+
+
+class _Endpoint:
+    """One Ollama backend in an OllamaClient pool: its own keep-alive session plus routing/health state."""
+
+    def __init__(self, base_url: str, pool_size: int, priority: Optional[str] = None):
         self.base = base_url.rstrip("/")
+        self.session = requests.Session()
+        adapter = HTTPAdapter(pool_connections=1, pool_maxsize=max(1, pool_size))
+        self.session.mount("http://", adapter)
+        self.session.mount("https://", adapter)
+        self.session.headers.update({"Connection": "keep-alive"})
+        if priority:
+            self.session.headers[PRIORITY_HEADER] = priority  # read by `llm-queue`; plain Ollama ignores it
+        self.has_embed_api = True
+        self.inflight = 0
+        self.down_until = 0.0
+        self.backoff = 0.0
+        self.probing = False
+        self.requests = 0
+        self.failures = 0
+
+
+class OllamaClient:
+    """Thin Ollama HTTP client over pooled keep-alive sessions, one per endpoint.
+
+    `base_url` may list several endpoints ("http://gpu:11434,http://cpu1:11434"). Each request goes to the
+    endpoint with the fewest requests in flight. An endpoint that refuses connections or answers 502/504 is
+    marked down with exponential back-off (5s .. 2min) and the request fails over to the next one; once its
+    back-off expires it is probed with GET /api/version in the background before taking traffic again.
+    429/503 ("busy") fail over without marking the endpoint down; if every endpoint is busy the last response
+    is returned so the caller's rate limiter can back off. Streams fail over only before the first byte.
+
+    `timeout` is the read timeout; `connect_timeout` bounds TCP/TLS setup separately so a dead host fails fast
+    while long generations are still allowed. `pool_size` (per endpoint) should be at least the number of
+    threads sharing the client, otherwise urllib3 discards and re-opens connections. `priority` tags every
+    request for an `llm-queue` proxy ("interactive" or "batch").
+    """
+
+    MIN_BACKOFF_S = 5.0
+    MAX_BACKOFF_S = 120.0
+
+    def __init__(self, base_url: str = "http://localhost:11434", timeout: float = 120, *, connect_timeout: float = 5.0, pool_size: int = 10,
+                 keep_alive: Optional[str] = None, priority: Optional[str] = None):
+        urls = [u.strip() for u in base_url.split(",") if u.strip()] or ["http://localhost:11434"]
+        self.endpoints = [_Endpoint(u, pool_size, priority) for u in dict.fromkeys(urls)]
+        self.base = self.endpoints[0].base
         self.timeout = timeout
+        self.connect_timeout = connect_timeout
+        self.keep_alive = keep_alive  # e.g. "30m" or "-1": how long Ollama keeps a model loaded after our request
+        self._lock = threading.Lock()
+        self._rr = itertools.count()
+
+    def _timeouts(self, read: Optional[float] = None) -> Tuple[float, float]:
+        return (self.connect_timeout, read or self.timeout)
+
+    def _body(self, **fields) -> Dict:
+        if self.keep_alive is not None:
+            ka = self.keep_alive
+            fields["keep_alive"] = int(ka) if re.fullmatch(r"-?\d+", ka) else ka
+        return fields
+
+    def _probe(self, ep: _Endpoint):
+        try:
+            ok = ep.session.get(f"{ep.base}/api/version", timeout=(self.connect_timeout, 5)).status_code == 200
+        except requests.RequestException:
+            ok = False
+        with self._lock:
+            ep.probing = False
+            if ok:
+                ep.down_until, ep.backoff = 0.0, 0.0
+                if len(self.endpoints) > 1:
+                    print(f"[INFO] Ollama endpoint {ep.base} is back", file=sys.stderr)
+            else:
+                self._mark_down_locked(ep)
+
+    def _mark_down_locked(self, ep: _Endpoint):
+        was_up = ep.down_until == 0.0
+        ep.backoff = min(self.MAX_BACKOFF_S, max(self.MIN_BACKOFF_S, ep.backoff * 2))
+        ep.down_until = time.monotonic() + ep.backoff
+        ep.failures += 1
+        if was_up and len(self.endpoints) > 1:
+            print(f"[WARN] Ollama endpoint {ep.base} unavailable; routing around it for {ep.backoff:.0f}s", file=sys.stderr)
+
+    def _pick(self, tried: set, eligible: Optional[Callable[[_Endpoint], bool]] = None) -> Optional[_Endpoint]:
+        """Least-outstanding up endpoint. Down endpoints whose back-off has expired get a health probe in the
+        background and rejoin once it passes; if nothing is up, the one recovering soonest is tried anyway."""
+        now = time.monotonic()
+        with self._lock:
+            cands = [ep for ep in self.endpoints if id(ep) not in tried and (eligible is None or eligible(ep))]
+            for ep in cands:
+                if 0.0 < ep.down_until <= now and not ep.probing:
+                    ep.probing = True
+                    threading.Thread(target=self._probe, args=(ep,), daemon=True).start()
+            if not cands:
+                return None
+            up = [ep for ep in cands if ep.down_until == 0.0] or [min(cands, key=lambda ep: ep.down_until)]
+            n = next(self._rr)
+            ep = min(up, key=lambda e: (e.inflight, (self.endpoints.index(e) - n) % len(self.endpoints)))
+            ep.inflight += 1
+            ep.requests += 1
+            return ep
+
+    @contextlib.contextmanager
+    def _call(self, path: str, body: Optional[Dict], *, read: Optional[float] = None, stream: bool = False,
+              eligible: Optional[Callable[[_Endpoint], bool]] = None, method: str = "POST",
+              headers: Optional[Dict] = None) -> Iterator[Tuple[_Endpoint, "requests.Response"]]:
+        """Send `body` to `path` on the best endpoint, failing over on connection errors and 5xx/429 answers.
+        Yields (endpoint, response); the endpoint counts as in flight until the block exits."""
+        tried: set = set()
+        last_err: Optional[BaseException] = None
+        busy: Optional[Tuple[_Endpoint, "requests.Response"]] = None
+        while True:
+            ep = self._pick(tried, eligible)
+            if ep is None:
+                if busy is not None:
+                    yield busy  # every endpoint was busy: hand back the last 429/503 for the caller to handle
+                    return
+                if last_err is not None:
+                    raise last_err
+                raise requests.ConnectionError("no Ollama endpoint available")
+            tried.add(id(ep))
+            try:
+                try:
+                    r = ep.session.request(method, f"{ep.base}{path}", json=body, timeout=self._timeouts(read), stream=stream,
+                                           headers=headers)
+                except requests.ConnectionError as e:  # includes ConnectTimeout; read timeouts are not retried
+                    with self._lock:
+                        self._mark_down_locked(ep)
+                    METRICS.inc("rag_ollama_failovers_total", reason="connect")
+                    last_err = e
+                    continue
+                if r.status_code in (429, 502, 503, 504):
+                    METRICS.inc("rag_ollama_failovers_total", reason=str(r.status_code))
+                    if r.status_code in (502, 504):
+                        with self._lock:
+                            self._mark_down_locked(ep)
+                    r.close()  # status and any buffered body stay readable
+                    busy, last_err = (ep, r), None
+                    continue
+                with r:
+                    yield ep, r
+                return
+            finally:
+                with self._lock:
+                    ep.inflight -= 1
+
+    def endpoint_status(self) -> List[Dict]:
+        now = time.monotonic()
+        with self._lock:
+            return [{"url": ep.base, "up": ep.down_until <= now, "inflight": ep.inflight, "requests": ep.requests,
+                     "failures": ep.failures} for ep in self.endpoints]
 
     def embed(self, model: str, text: str) -> List[float]:
-        r = requests.post(f"{self.base}/api/embeddings", json={"model": model, "prompt": text}, timeout=self.timeout)
-        r.raise_for_status()
-        data = r.json()
-        return data["embedding"]
-
-    def chat(self, model: str, messages: List[Dict], stream: bool = False, timeout: Optional[int] = None) -> str:
-        r = requests.post(
-            f"{self.base}/api/chat",
-            json={"model": model, "messages": messages, "stream": stream},
-            timeout=timeout or self.timeout,
+        with self._call("/api/embeddings", self._body(model=model, prompt=text)) as (_, r):
+            r.raise_for_status()
+            return r.json()["embedding"]
+
+    def embed_batch(self, model: str, texts: Sequence[str]) -> List[List[float]]:
+        """Embed many texts in one round trip via /api/embed (`input` array).
+        Servers that predate /api/embed answer 404; we then fall back to one /api/embeddings call per text."""
+        if not texts:
+            return []
+        if any(ep.has_embed_api for ep in self.endpoints):
+            with self._call("/api/embed", self._body(model=model, input=list(texts)), eligible=lambda ep: ep.has_embed_api) as (ep, r):
+                # A 404 also means "model not found" on new servers; only fall back when the route itself is missing.
+                if r.status_code == 404 and "model" not in r.text.lower():
+                    ep.has_embed_api = False
+                else:
+                    r.raise_for_status()
+                    vecs = r.json().get("embeddings") or []
+                    if len(vecs) != len(texts):
+                        raise ValueError(f"/api/embed returned {len(vecs)} vectors for {len(texts)} inputs")
+                    return vecs
+        return [self.embed(model, t) for t in texts]
+
+    def chat(self, model: str, messages: List[Dict], stream: bool = False, timeout: Optional[float] = None,
+             options: Optional[Dict] = None) -> str:
+        body = self._body(model=model, messages=messages, stream=stream, **({"options": options} if options else {}))
+        with self._call("/api/chat", body, read=timeout) as (_, r):
+            r.raise_for_status()
+            return r.json().get("message", {}).get("content", "")
+
+    def chat_stream(self, model: str, messages: List[Dict], timeout: Optional[float] = None,
+                    options: Optional[Dict] = None) -> Iterator[Dict]:
+        """Yield Ollama's NDJSON stream objects as they arrive; the last one has "done": true plus eval stats.
+        The read timeout applies between chunks, not to the whole generation."""
+        body = self._body(model=model, messages=messages, stream=True, **({"options": options} if options else {}))
+        with self._call("/api/chat", body, read=timeout, stream=True) as (_, r):
+            r.raise_for_status()
+            for line in r.iter_lines():
+                if not line:
+                    continue
+                obj = json.loads(line)
+                if obj.get("error"):
+                    raise RuntimeError(f"ollama: {obj['error']}")
+                yield obj
+                if obj.get("done"):
+                    return
+
+# ------------------------------
+# Embedding cache (content hash + model -> vector)
+# ------------------------------
+
+VECTOR_DTYPES = ("float32", "float16", "int8")
+
+
+def as_vector(vec: Sequence[float]):
+    """One contiguous float32 vector (numpy array, or array('f') without numpy) instead of a list of floats."""
+    return np.asarray(vec, dtype=np.float32) if np is not None else array.array("f", vec)
+
+
+def vector_list(vec) -> List[float]:
+    """Plain list for the Chroma API boundary."""
+    return vec.tolist() if hasattr(vec, "tolist") else list(vec)
+
+
+def fit_dim(vec, dim: int):
+    """Matryoshka truncation: keep the first `dim` components and renormalise to unit length."""
+    if not dim or len(vec) <= dim:
+        return as_vector(vec)
+    v = as_vector(vec[:dim])
+    norm = float(np.linalg.norm(v)) if np is not None else sum(x * x for x in v) ** 0.5
+    if not norm:
+        return v
+    return v / norm if np is not None else array.array("f", [x / norm for x in v])
+
+
+def encode_vector(vec, dtype: str = "float32") -> bytes:
+    """float32 as is, float16 (half the bytes), or int8 with one float32 scale per vector (a quarter)."""
+    if dtype == "int8":
+        if np is not None:
+            v = np.asarray(vec, dtype=np.float32)
+            scale = (float(np.abs(v).max()) if v.size else 0.0) / 127.0 or 1.0
+            return struct.pack("=f", scale) + np.clip(np.rint(v / scale), -127, 127).astype(np.int8).tobytes()
+        scale = max((abs(x) for x in vec), default=0.0) / 127.0 or 1.0
+        return struct.pack("=f", scale) + array.array("b", [max(-127, min(127, round(x / scale))) for x in vec]).tobytes()
+    if dtype == "float16":
+        if np is not None:
+            return np.asarray(vec, dtype=np.float16).tobytes()
+        return struct.pack(f"={len(vec)}e", *vec)
+    return as_vector(vec).tobytes()
+
+
+def decode_vector(blob: bytes, dim: int, dtype: str = "float32"):
+    if dtype == "int8":
+        (scale,) = struct.unpack_from("=f", blob)
+        if np is not None:
+            return np.frombuffer(blob, dtype=np.int8, offset=4).astype(np.float32) * np.float32(scale)
+        return array.array("f", [x * scale for x in array.array("b", blob[4:])])
+    if dtype == "float16":
+        if np is not None:
+            return np.frombuffer(blob, dtype=np.float16).astype(np.float32)
+        return array.array("f", struct.unpack(f"={dim}e", blob))
+    return np.frombuffer(blob, dtype=np.float32).copy() if np is not None else array.array("f", blob)
+
+
+class EmbeddingCache:
+    """On-disk cache of embeddings keyed by `model:chunk_content_hash`.
+
+    Shared by every collection under one --db (the model is part of the key), so vendored copies,
+    license headers and unchanged chunks of edited files are embedded once. SQLite in WAL mode lets
+    concurrent ingest/query processes read while one writes.
+
+    Vectors are kept at full model width (query-time rescoring of truncated collections reads them) and
+    written as `dtype` (--cache-dtype); each row records its own dtype, so mixed caches read back fine.
+    Collections ingested with --embed-dim keep a float32 cache, so rescoring runs at full precision.
+    """
+
+    def __init__(self, path: Path, dtype: str = "float32"):
+        path.parent.mkdir(parents=True, exist_ok=True)
+        self.dtype = dtype
+        self._lock = threading.Lock()
+        self._db = sqlite3.connect(str(path), check_same_thread=False, timeout=30)
+        self._db.execute("PRAGMA journal_mode=WAL")
+        self._db.execute("PRAGMA synchronous=NORMAL")
+        self._db.execute("CREATE TABLE IF NOT EXISTS embeddings (key TEXT PRIMARY KEY, dim INTEGER NOT NULL, vec BLOB NOT NULL,"
+                         " dtype TEXT NOT NULL DEFAULT 'float32')")
+        if "dtype" not in {r[1] for r in self._db.execute("PRAGMA table_info(embeddings)")}:
+            self._db.execute("ALTER TABLE embeddings ADD COLUMN dtype TEXT NOT NULL DEFAULT 'float32'")
+        self._db.commit()
+
+    @staticmethod
+    def key(model: str, text: str) -> str:
+        return f"{model}:{chunk_content_hash(text)}"
+
+    def get_many(self, keys: Sequence[str]) -> Dict[str, Sequence[float]]:
+        out: Dict[str, Sequence[float]] = {}
+        uniq = list(dict.fromkeys(keys))
+        with self._lock:
+            for i in range(0, len(uniq), 500):
+                part = uniq[i : i + 500]
+                rows = self._db.execute(
+                    f"SELECT key, dim, vec, dtype FROM embeddings WHERE key IN ({','.join('?' * len(part))})", part
+                ).fetchall()
+                for k, dim, blob, dtype in rows:
+                    out[k] = decode_vector(blob, dim, dtype)
+        return out
+
+    def put_many(self, items: Dict[str, Sequence[float]]):
+        if not items:
+            return
+        with self._lock:
+            self._db.executemany(
+                "INSERT OR REPLACE INTO embeddings (key, dim, vec, dtype) VALUES (?, ?, ?, ?)",
+                [(k, len(v), encode_vector(v, self.dtype), self.dtype) for k, v in items.items()],
+            )
+            self._db.commit()
+
+
+def _cosine(a: Sequence[float], b: Sequence[float]) -> float:
+    dot = sum(x * y for x, y in zip(a, b))
+    na = sum(x * x for x in a) ** 0.5
+    nb = sum(y * y for y in b) ** 0.5
+    return dot / (na * nb) if na and nb else 0.0
+
+
+class AnswerCache:
+    """Generated answers keyed by (llm, retrieved chunk-id set), matched on question-embedding similarity.
+
+    A hit needs the same chunks to come back for the new question, so a paraphrase that retrieves different
+    code still goes to the model. Chunk ids are content hashes, so edited code can't match an old entry;
+    the Indexer also drops every answer citing a file it rewrites (`invalidate_paths`).
+    Lives at `_state/<collection>.answers.sqlite`.
+    """
+
+    def __init__(self, path: Path, max_rows: int = 5000):
+        path.parent.mkdir(parents=True, exist_ok=True)
+        self.max_rows = max_rows
+        self._lock = threading.Lock()
+        self._db = sqlite3.connect(str(path), check_same_thread=False, timeout=30)
+        self._db.execute("PRAGMA journal_mode=WAL")
+        self._db.execute("PRAGMA synchronous=NORMAL")
+        self._db.executescript(
+            """
+            CREATE TABLE IF NOT EXISTS answers (
+                id INTEGER PRIMARY KEY, llm TEXT NOT NULL, ids_key TEXT NOT NULL, question TEXT NOT NULL,
+                qvec BLOB, answer TEXT NOT NULL, metas TEXT NOT NULL, created REAL NOT NULL);
+            CREATE INDEX IF NOT EXISTS answers_key ON answers(llm, ids_key);
+            CREATE TABLE IF NOT EXISTS answer_sources (answer_id INTEGER NOT NULL, source_path TEXT NOT NULL);
+            CREATE INDEX IF NOT EXISTS answer_sources_path ON answer_sources(source_path);
+            """
         )
-        r.raise_for_status()
-        data = r.json()
-        return data.get("message", {}).get("content", "")
+        self._db.commit()
+
+    @staticmethod
+    def path_for(db_path: str, collection: str) -> Path:
+        return Path(db_path) / "_state" / f"{collection}.answers.sqlite"
+
+    @staticmethod
+    def _ids_key(chunk_ids: Sequence[str]) -> str:
+        return hashlib.sha1("\n".join(sorted(chunk_ids)).encode()).hexdigest()
+
+    def lookup(self, llm: str, question: str, qvec: Optional[Sequence[float]], chunk_ids: Sequence[str],
+               min_sim: float) -> Optional[Tuple[str, List[Dict]]]:
+        with self._lock:
+            rows = self._db.execute(
+                "SELECT question, qvec, answer, metas FROM answers WHERE llm = ? AND ids_key = ? ORDER BY created DESC",
+                (llm, self._ids_key(chunk_ids)),
+            ).fetchall()
+        norm = " ".join(question.lower().split())
+        for q, blob, answer, metas in rows:
+            if q == norm or (qvec is not None and blob and _cosine(qvec, array.array("f", blob)) >= min_sim):
+                return answer, json.loads(metas)
+        return None
+
+    def put(self, llm: str, question: str, qvec: Optional[Sequence[float]], chunk_ids: Sequence[str], answer: str, metas: List[Dict]):
+        blob = array.array("f", qvec).tobytes() if qvec is not None else None
+        with self._lock:
+            cur = self._db.execute(
+                "INSERT INTO answers (llm, ids_key, question, qvec, answer, metas, created) VALUES (?, ?, ?, ?, ?, ?, ?)",
+                (llm, self._ids_key(chunk_ids), " ".join(question.lower().split()), blob, answer, json.dumps(metas), time.time()),
+            )
+            srcs = {m.get("source_path", "") for m in metas}
+            self._db.executemany("INSERT INTO answer_sources (answer_id, source_path) VALUES (?, ?)",
+                                 [(cur.lastrowid, p) for p in srcs])
+            (n,) = self._db.execute("SELECT COUNT(*) FROM answers").fetchone()
+            if n > self.max_rows:
+                self._db.execute("DELETE FROM answers WHERE id IN (SELECT id FROM answers ORDER BY created LIMIT ?)", (n - self.max_rows,))
+                self._db.execute("DELETE FROM answer_sources WHERE answer_id NOT IN (SELECT id FROM answers)")
+            self._db.commit()
+
+    def invalidate_paths(self, paths: Iterable[str]):
+        paths = list(dict.fromkeys(paths))
+        with self._lock:
+            for i in range(0, len(paths), 500):
+                part = paths[i : i + 500]
+                marks = ",".join("?" * len(part))
+                self._db.execute(
+                    f"DELETE FROM answers WHERE id IN (SELECT answer_id FROM answer_sources WHERE source_path IN ({marks}))", part
+                )
+                self._db.execute(f"DELETE FROM answer_sources WHERE source_path IN ({marks})", part)
+            self._db.execute("DELETE FROM answer_sources WHERE answer_id NOT IN (SELECT id FROM answers)")
+            self._db.commit()
+
+    def clear(self):
+        with self._lock:
+            self._db.execute("DELETE FROM answers")
+            self._db.execute("DELETE FROM answer_sources")
+            self._db.commit()
 
 # ------------------------------
-# Vector store wrapper (Chroma)
+# Keyword index (BM25 over identifiers)
 # ------------------------------
 
-class ChromaStore:
-    def __init__(self, db_path: str, collection: str, reset: bool = False):
-        self.client = chromadb.PersistentClient(path=db_path)
-        if reset:
-            try:
-                self.client.delete_collection(collection)
-            except Exception:
-                pass
-        self.col = self.client.get_or_create_collection(collection, metadata={"hnsw:space": "cosine"})
+_IDENT_RE = re.compile(r"~?[A-Za-z_][A-Za-z0-9_]*(?:::~?[A-Za-z_][A-Za-z0-9_]*)*")
+_CAMEL_RE = re.compile(r"[A-Z]+(?=[A-Z][a-z])|[A-Z]?[a-z]+|[A-Z]+|[0-9]+")
+_SYMBOL_RE = re.compile(r"~?[A-Za-z_][A-Za-z0-9_]*(?:::~?[A-Za-z_][A-Za-z0-9_]*)*(?:\(\))?")
+_QUERY_STOPWORDS = frozenset(
+    "a an and are as at be by can do does for from how i in is it of on or the this to what when where which who why "
+    "with work works you your there their then than that these those into about use used using".split()
+)
+
+
+def split_identifier(name: str) -> List[str]:
+    """upsert_file -> [upsert, file]; HttpClientPool -> [http, client, pool]."""
+    parts: List[str] = []
+    for piece in name.strip("~").split("_"):
+        parts.extend(p.lower() for p in _CAMEL_RE.findall(piece))
+    return [p for p in parts if len(p) > 1]
+
+
+def code_terms(text: str) -> Tuple[str, str]:
+    """Return (identifiers, identifier parts) as space-separated term strings.
+    Qualified names keep their components adjacent and in order ("Indexer::upsert_file" -> "indexer upsert_file"),
+    so they can be matched as a phrase; split parts go in a separate column with a lower weight."""
+    idents: List[str] = []
+    parts: List[str] = []
+    for m in _IDENT_RE.finditer(text):
+        for name in m.group(0).split("::"):
+            name = name.strip("~")
+            if len(name) < 2:
+                continue
+            idents.append(name.lower())
+            sp = split_identifier(name)
+            if len(sp) > 1:
+                parts.extend(sp)
+    return " ".join(idents), " ".join(parts)
+
+
+def looks_like_symbol(query: str) -> bool:
+    """True for exact-symbol lookups such as `Indexer::upsert_file`, `chunk_code_lines` or `OllamaClient`."""
+    q = query.strip().strip("`")
+    if not _SYMBOL_RE.fullmatch(q):
+        return False
+    return "::" in q or "_" in q.strip("_") or bool(re.search(r"[a-z][A-Z]", q)) or q.endswith("()")
+
+
+class KeywordIndex:
+    """BM25 keyword index over code identifiers, in SQLite FTS5 at <db>/_state/<collection>.keywords.sqlite.
+
+    Maintained by the Indexer next to every Chroma add/delete. Rows are keyed by chunk ID, so hits are resolved
+    back to documents through the vector store without a model call.
+    """
+
+    def __init__(self, path: Path):
+        path.parent.mkdir(parents=True, exist_ok=True)
+        self._lock = threading.Lock()
+        self._db = sqlite3.connect(str(path), check_same_thread=False, timeout=30)
+        self._db.execute("PRAGMA journal_mode=WAL")
+        self._db.execute("PRAGMA synchronous=NORMAL")
+        self._db.execute("CREATE TABLE IF NOT EXISTS docs (rowid INTEGER PRIMARY KEY, chunk_id TEXT UNIQUE NOT NULL, source_path TEXT NOT NULL)")
+        self._db.execute("CREATE INDEX IF NOT EXISTS docs_source ON docs (source_path)")
+        self._db.execute("CREATE VIRTUAL TABLE IF NOT EXISTS terms USING fts5(idents, parts, tokenize=\"porter unicode61 tokenchars '_'\")")
+        self._db.commit()
+
+    @staticmethod
+    def open(db_path: str, collection: str) -> Optional["KeywordIndex"]:
+        try:
+            return KeywordIndex(Path(db_path) / "_state" / f"{collection}.keywords.sqlite")
+        except sqlite3.OperationalError as e:  # no FTS5 in this SQLite build
+            print(f"[WARN] Keyword index unavailable ({e}); retrieval is vector-only")
+            return None
+
+    def count(self) -> int:
+        with self._lock:
+            return self._db.execute("SELECT COUNT(*) FROM docs").fetchone()[0]
+
+    def add(self, ids: Sequence[str], documents: Sequence[str], source_paths: Sequence[str]):
+        with self._lock:
+            cur = self._db.cursor()
+            for cid, doc, src in zip(ids, documents, source_paths):
+                old = cur.execute("SELECT rowid FROM docs WHERE chunk_id = ?", (cid,)).fetchone()
+                if old:
+                    cur.execute("DELETE FROM terms WHERE rowid = ?", old)
+                    cur.execute("DELETE FROM docs WHERE rowid = ?", old)
+                cur.execute("INSERT INTO docs (chunk_id, source_path) VALUES (?, ?)", (cid, src))
+                cur.execute("INSERT INTO terms (rowid, idents, parts) VALUES (?, ?, ?)", (cur.lastrowid, *code_terms(doc)))
+            self._db.commit()
+
+    def _delete_where(self, clause: str, values: Sequence[str]):
+        values = list(values)
+        with self._lock:
+            for i in range(0, len(values), 500):
+                part = values[i : i + 500]
+                marks = ",".join("?" * len(part))
+                self._db.execute(f"DELETE FROM terms WHERE rowid IN (SELECT rowid FROM docs WHERE {clause} IN ({marks}))", part)
+                self._db.execute(f"DELETE FROM docs WHERE {clause} IN ({marks})", part)
+            self._db.commit()
+
+    def delete_by_source_paths(self, source_paths: Sequence[str]):
+        self._delete_where("source_path", source_paths)
+
+    def delete_ids(self, ids: Sequence[str]):
+        self._delete_where("chunk_id", ids)
+
+    def clear(self):
+        with self._lock:
+            self._db.execute("DELETE FROM terms")
+            self._db.execute("DELETE FROM docs")
+            self._db.commit()
+
+    @staticmethod
+    def build_query(query: str) -> str:
+        """FTS5 MATCH expression: qualified names as phrases on `idents`, everything else OR'ed together."""
+        clauses: List[str] = []
+        for m in _IDENT_RE.finditer(query):
+            names = [n.strip("~").lower() for n in m.group(0).split("::") if len(n.strip("~")) > 1]
+            if len(names) > 1:
+                clauses.append("idents : \"" + " ".join(names) + "\"")
+            for n in names:
+                if n not in _QUERY_STOPWORDS:
+                    clauses.append(f"\"{n}\"")
+                    clauses.extend(f"\"{p}\"" for p in split_identifier(n) if p != n and p not in _QUERY_STOPWORDS)
+        return " OR ".join(dict.fromkeys(clauses[:64]))
+
+    def search(self, query: str, k: int, where: Optional["SearchFilter"] = None) -> List[Tuple[str, float]]:
+        """Return [(chunk_id, score)] best first; score = -bm25 (higher is better).
+        `where` narrows by path prefix and extension here; its repo/page parts are left to the caller."""
+        expr = self.build_query(query)
+        if not expr:
+            return []
+        sql, params = "", [expr]
+        if where and where.path_prefix:
+            sql += " AND docs.source_path >= ? AND docs.source_path < ?"
+            params += [where.path_prefix, where.path_prefix + "\U0010ffff"]
+        if where and where.exts:
+            sql += " AND (" + " OR ".join("docs.source_path LIKE ?" for _ in where.exts) + ")"
+            params += ["%" + e for e in where.exts]
+        with self._lock:
+            rows = self._db.execute(
+                "SELECT docs.chunk_id, bm25(terms, 3.0, 1.0) AS r FROM terms JOIN docs ON docs.rowid = terms.rowid "
+                f"WHERE terms MATCH ?{sql} ORDER BY r LIMIT ?",
+                (*params, k),
+            ).fetchall()
+        return [(cid, -r) for cid, r in rows]
+
+
+def rrf_fuse(rankings: Sequence[Sequence[Hit]], top_k: int, k: int = 60) -> List[Hit]:
+    """Reciprocal-rank fusion: score(d) = sum over rankings of 1 / (k + rank)."""
+    fused: Dict[str, float] = {}
+    first: Dict[str, Hit] = {}
+    for ranking in rankings:
+        for rank, h in enumerate(ranking, start=1):
+            fused[h.id] = fused.get(h.id, 0.0) + 1.0 / (k + rank)
+            first.setdefault(h.id, h)
+    order = sorted(fused, key=fused.get, reverse=True)[:top_k]
+    return [dataclasses.replace(first[i], score=fused[i]) for i in order]
+
+# ------------------------------
+# Vector stores (Chroma, Qdrant, sharded)
+# ------------------------------
+
+STORE_BACKENDS = ("chroma", "qdrant")
+SHARD_MODES = ("none", "top", "repo")
+
+
+@dataclass
+class SearchFilter:
+    """Metadata pre-filter for retrieval: a path prefix, file extensions, git repository names, a PDF page range.
+
+    Stores push it into the ANN search itself (Chroma `where`, Qdrant `filter`) and the keyword index applies it
+    in SQL, so a narrow filter searches its subset instead of post-filtering a large top-k. "ext", "repo" and
+    "page" are chunk metadata written at ingest (collections indexed before "ext"/"repo" existed need a re-ingest).
+    A path prefix becomes a `source_path` IN-list resolved through the manifest (`paths`); prefixes covering
+    more than PUSHDOWN_MAX_PATHS files are matched on the retrieved hits instead.
+    """
+
+    path_prefix: Optional[str] = None
+    exts: Tuple[str, ...] = ()
+    repos: Tuple[str, ...] = ()
+    pages: Optional[Tuple[int, Optional[int]]] = None  # inclusive; (n, None) = page n onwards
+    paths: Optional[Tuple[str, ...]] = None  # files under path_prefix, once resolved
+
+    PUSHDOWN_MAX_PATHS = 1000
+
+    @classmethod
+    def parse(cls, path_prefix: Optional[str] = None, exts: Optional[Sequence[str]] = None,
+              repos: Optional[Sequence[str]] = None, pages: Optional[str] = None) -> Optional["SearchFilter"]:
+        """Build from CLI/request values (lists may hold comma-separated items). None when nothing is set."""
+        def split(values) -> Tuple[str, ...]:
+            if isinstance(values, str):
+                values = [values]
+            return tuple(dict.fromkeys(v.strip() for item in values or () for v in str(item).split(",") if v.strip()))
+
+        prefix = None
+        if path_prefix:
+            prefix = str(Path(path_prefix).expanduser().resolve())
+            if str(path_prefix).endswith(("/", os.sep)) and not prefix.endswith("/"):
+                prefix += "/"  # "src/net/" must not match src/network
+        page_range = None
+        if pages not in (None, ""):
+            m = re.fullmatch(r"\s*(\d+)\s*(?:(-)\s*(\d*)\s*)?", str(pages))
+            if not m:
+                raise ValueError(f"bad page range {pages!r} (use N, N-M or N-)")
+            lo = int(m.group(1))
+            hi = (int(m.group(3)) if m.group(3) else None) if m.group(2) else lo
+            if hi is not None and hi < lo:
+                raise ValueError(f"bad page range {pages!r}")
+            page_range = (lo, hi)
+        flt = cls(path_prefix=prefix, exts=tuple(e.lower() if e.startswith(".") else "." + e.lower() for e in split(exts)),
+                  repos=split(repos), pages=page_range)
+        return flt if (flt.path_prefix or flt.exts or flt.repos or flt.pages) else None
+
+    @classmethod
+    def from_request(cls, body: Dict) -> Optional["SearchFilter"]:
+        """Request bodies: {"filter": {"path_prefix", "ext", "repo", "pages"}} (ext/repo: string or list)."""
+        f = body.get("filter") or {}
+        if not isinstance(f, dict):
+            raise ValueError("\"filter\" must be an object")
+        pages = f.get("pages")
+        if isinstance(pages, (list, tuple)):
+            pages = "-".join(str(p) for p in pages)
+        return cls.parse(f.get("path_prefix"), f.get("ext"), f.get("repo"), pages)
+
+    def conditions(self) -> List[Tuple[str, str, object]]:
+        """What the stores can push down: (key, "in", values) and (key, "range", (lo, hi))."""
+        out: List[Tuple[str, str, object]] = []
+        if self.paths is not None:
+            out.append(("source_path", "in", list(self.paths)))
+        if self.exts:
+            out.append(("ext", "in", list(self.exts)))
+        if self.repos:
+            out.append(("repo", "in", list(self.repos)))
+        if self.pages:
+            out.append(("page", "range", self.pages))
+        return out
+
+    @property
+    def pushed_down(self) -> bool:
+        """Whether conditions() covers the whole filter (otherwise hits still need matches())."""
+        return not self.path_prefix or self.paths is not None
+
+    def matches(self, meta: Dict) -> bool:
+        src = meta.get("source_path") or ""
+        if self.path_prefix and not src.startswith(self.path_prefix):
+            return False
+        if self.exts and meta.get("ext", Path(src).suffix.lower()) not in self.exts:
+            return False
+        if self.repos and meta.get("repo") not in self.repos:
+            return False
+        if self.pages:
+            page, (lo, hi) = meta.get("page"), self.pages
+            if not isinstance(page, int) or page < lo or (hi is not None and page > hi):
+                return False
+        return True
+
+    def describe(self) -> str:
+        parts = [f"{k}={v}" for k, v in (("path", self.path_prefix), ("ext", ",".join(self.exts)), ("repo", ",".join(self.repos)))
+                 if v]
+        if self.pages:
+            parts.append(f"pages={self.pages[0]}-{'' if self.pages[1] is None else self.pages[1]}")
+        return " ".join(parts)
+
+
+class VectorStore:
+    """What the indexer and query path need from a vector backend. Rows are (id, embedding, document, metadata);
+    every metadata carries "source_path", which is what deletes are keyed on. Search scores are cosine similarity.
+    `text_query` says whether query(query_text=...) works, i.e. the backend can embed a question itself.
+    """
+
+    text_query = False
+
+    def add(self, ids: List[str], embeddings: List[Sequence[float]], documents: List[str], metadatas: List[Dict]):
+        raise NotImplementedError
+
+    def delete_by_source_paths(self, source_paths: Sequence[str], batch: int = 500):
+        raise NotImplementedError
+
+    def delete_ids(self, ids: Sequence[str], batch: int = 500):
+        raise NotImplementedError
+
+    def get_hits(self, ids: Sequence[str]) -> List["Hit"]:
+        """Fetch stored chunks by ID, in the order given (missing IDs are skipped)."""
+        raise NotImplementedError
+
+    def dim(self) -> Optional[int]:
+        """Width of the stored vectors (None while the collection is empty)."""
+        raise NotImplementedError
+
+    def rows_for_source(self, source_path: str) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+        """Every stored row of one file, embeddings included: (ids, embeddings, documents, metadatas)."""
+        raise NotImplementedError
+
+    def iter_documents(self, page: int = 500) -> Iterable[Tuple[str, str, Dict]]:
+        raise NotImplementedError
+
+    def iter_metadata(self, page: int = 1000) -> Iterable[Tuple[str, Dict]]:
+        raise NotImplementedError
+
+    def query(self, *, query_embedding: Optional[Sequence[float]] = None, query_text: Optional[str] = None,
+              n_results: int = 5, where: Optional[SearchFilter] = None) -> List["Hit"]:
+        raise NotImplementedError
 
-    def add(self, ids: List[str], embeddings: List[List[float]], documents: List[str], metadatas: List[Dict]):
-        self.col.add(ids=ids, embeddings=embeddings, documents=documents, metadatas=metadatas)
+    def count(self) -> int:
+        raise NotImplementedError
 
-    def delete_by_file_sha(self, file_sha1: str):
-        self.col.delete(where={"file_sha1": file_sha1})
+    def reset(self):
+        """Drop every row (and the collection) and start empty."""
+        raise NotImplementedError
 
-    def query(self, *, query_embedding: Optional[List[float]] = None, query_text: Optional[str] = None, n_results: int = 5):
+    def drop(self):
+        """Remove the collection for good."""
+        raise NotImplementedError
+
+
+class ChromaStore(VectorStore):
+    text_query = True  # the collection's own embedding function
+
+    def __init__(self, db_path: str, collection: str, reset: bool = False, client=None):
+        self.client = client or chromadb.PersistentClient(path=db_path)
+        self.collection = collection
+        if reset:
+            self.drop()
+        self.col = self.client.get_or_create_collection(collection, metadata={"hnsw:space": "cosine"})
+
+    def add(self, ids: List[str], embeddings: List[Sequence[float]], documents: List[str], metadatas: List[Dict]):
+        with METRICS.timer("rag_store_seconds", op="add", store="chroma"):
+            self.col.add(ids=ids, embeddings=[vector_list(e) for e in embeddings], documents=documents, metadatas=metadatas)
+        METRICS.inc("rag_store_rows_total", len(ids), op="add", store="chroma")
+
+    def delete_by_source_paths(self, source_paths: Sequence[str], batch: int = 500):
+        """Drop every vector of the given files. Keyed by path, not SHA: identical files share a SHA,
+        and the SHA a file was indexed under is not the one it has after an edit."""
+        paths = list(dict.fromkeys(source_paths))
+        for i in range(0, len(paths), batch):
+            part = paths[i : i + batch]
+            with METRICS.timer("rag_store_seconds", op="delete", store="chroma"):
+                self.col.delete(where={"source_path": part[0]} if len(part) == 1 else {"source_path": {"$in": part}})
+        METRICS.inc("rag_store_rows_total", len(paths), op="delete", store="chroma")
+
+    def delete_ids(self, ids: Sequence[str], batch: int = 500):
+        ids = list(ids)
+        for i in range(0, len(ids), batch):
+            with METRICS.timer("rag_store_seconds", op="delete", store="chroma"):
+                self.col.delete(ids=ids[i : i + batch])
+
+    def get_hits(self, ids: Sequence[str]) -> List["Hit"]:
+        if not ids:
+            return []
+        res = self.col.get(ids=list(ids), include=["documents", "metadatas"])
+        by_id = {i: (d, m) for i, d, m in zip(res.get("ids") or [], res.get("documents") or [], res.get("metadatas") or [])}
+        return [Hit(id=i, text=by_id[i][0] or "", metadata=by_id[i][1] or {}, score=0.0) for i in ids if i in by_id]
+
+    def dim(self) -> Optional[int]:
+        embs = self.col.get(limit=1, include=["embeddings"]).get("embeddings")
+        return len(embs[0]) if embs is not None and len(embs) else None
+
+    def rows_for_source(self, source_path: str) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+        res = self.col.get(where={"source_path": source_path}, include=["embeddings", "documents", "metadatas"])
+        ids = list(res.get("ids") or [])
+        embs = res.get("embeddings")
+        return (ids, [list(e) for e in embs] if embs is not None else [], list(res.get("documents") or []),
+                list(res.get("metadatas") or []))
+
+    def iter_documents(self, page: int = 500) -> Iterable[Tuple[str, str, Dict]]:
+        """Yield (id, document, metadata) for every vector in the collection, page by page."""
+        offset = 0
+        while True:
+            res = self.col.get(include=["documents", "metadatas"], limit=page, offset=offset)
+            ids = res.get("ids") or []
+            if not ids:
+                return
+            yield from zip(ids, res.get("documents") or [""] * len(ids), res.get("metadatas") or [{}] * len(ids))
+            offset += len(ids)
+
+    def iter_metadata(self, page: int = 1000) -> Iterable[Tuple[str, Dict]]:
+        """Yield (id, metadata) for every vector in the collection, page by page."""
+        offset = 0
+        while True:
+            res = self.col.get(include=["metadatas"], limit=page, offset=offset)
+            ids = res.get("ids") or []
+            if not ids:
+                return
+            yield from zip(ids, res.get("metadatas") or [{}] * len(ids))
+            offset += len(ids)
+
+    def query(self, *, query_embedding: Optional[Sequence[float]] = None, query_text: Optional[str] = None,
+              n_results: int = 5, where: Optional[SearchFilter] = None) -> List["Hit"]:
+        kw = {"where": self._where(where)} if where and where.conditions() else {}
         if query_embedding is not None:
-            return self.col.query(query_embeddings=[query_embedding], n_results=n_results)
+            return hits_from_results(self.col.query(query_embeddings=[vector_list(query_embedding)], n_results=n_results, **kw))
         if query_text is not None:
-            return self.col.query(query_texts=[query_text], n_results=n_results)
+            return hits_from_results(self.col.query(query_texts=[query_text], n_results=n_results, **kw))
         raise ValueError("Provide query_embedding or query_text")
 
+    @staticmethod
+    def _where(flt: SearchFilter) -> Dict:
+        clauses: List[Dict] = []
+        for key, op, value in flt.conditions():
+            if op == "in":
+                clauses.append({key: value[0]} if len(value) == 1 else {key: {"$in": value}})
+            else:
+                lo, hi = value
+                clauses.append({key: {"$gte": lo}})
+                if hi is not None:
+                    clauses.append({key: {"$lte": hi}})
+        return clauses[0] if len(clauses) == 1 else {"$and": clauses}
+
+    def count(self) -> int:
+        return self.col.count()
+
+    def reset(self):
+        self.drop()
+        self.col = self.client.get_or_create_collection(self.collection, metadata={"hnsw:space": "cosine"})
+
+    def drop(self):
+        try:
+            self.client.delete_collection(self.collection)
+        except Exception:
+            pass
+
+
+class QdrantStore(VectorStore):
+    """Qdrant over its REST API (plain `requests`, no client library): server-side HNSW with on-disk payloads.
+
+    Point IDs must be integers or UUIDs, so each chunk ID maps to a UUID5 and travels in the payload as
+    "chunk_id" next to the document text. "source_path" (deletes, path filters), "ext", "repo" and "page" get
+    payload indexes so filtered searches stay on the HNSW graph. The collection is created on the first add,
+    once the vector width is known.
+
+    `dtype` (--index-dtype) compacts the index: float16 stores half-width vectors; int8 adds scalar quantisation
+    kept in RAM, with the float32 originals on disk, and searches rescore the quantised candidates against them.
+    """
+
+    _ID_NS = uuid.UUID("6f1d2c1e-5a57-4b7a-9a43-0f6cf4f3a6d2")
+    OVERSAMPLING = 2.0  # int8 index: quantised candidates fetched per result before rescoring
+
+    def __init__(self, url: str, collection: str, *, dtype: str = "float32", timeout: float = 60.0, pool_size: int = 8):
+        self.base = url.rstrip("/")
+        self.collection = collection
+        self.dtype = dtype
+        self.timeout = timeout
+        self.session = requests.Session()
+        adapter = HTTPAdapter(pool_connections=pool_size, pool_maxsize=pool_size)
+        self.session.mount("http://", adapter)
+        self.session.mount("https://", adapter)
+        self._exists: Optional[bool] = None
+        self._lock = threading.Lock()
+
+    def _req(self, method: str, path: str, body: Optional[Dict] = None, *, missing_ok: bool = False):
+        r = self.session.request(method, f"{self.base}/collections/{self.collection}{path}", json=body, timeout=self.timeout)
+        if r.status_code == 404 and missing_ok:
+            return None
+        if r.status_code >= 400:
+            raise requests.HTTPError(f"qdrant {method} {path or '/'}: {r.status_code} {r.text[:200]}", response=r)
+        return r.json().get("result")
+
+    def _point_id(self, chunk_id: str) -> str:
+        return str(uuid.uuid5(self._ID_NS, chunk_id))
+
+    def _ensure(self, dim: int):
+        with self._lock:
+            if self._exists:
+                return
+            if self._req("GET", "", missing_ok=True) is None:
+                self._req("PUT", "", self._create_body(dim))
+                for field, schema in (("source_path", "keyword"), ("ext", "keyword"), ("repo", "keyword"), ("page", "integer")):
+                    self._req("PUT", "/index?wait=true", {"field_name": field, "field_schema": schema})
+            self._exists = True
+
+    def _create_body(self, dim: int) -> Dict:
+        vectors: Dict = {"size": dim, "distance": "Cosine"}
+        body: Dict = {"vectors": vectors}
+        if self.dtype == "float16":
+            vectors["datatype"] = "float16"
+        elif self.dtype == "int8":
+            vectors["on_disk"] = True  # originals only feed the rescore step
+            body["quantization_config"] = {"scalar": {"type": "int8", "quantile": 0.99, "always_ram": True}}
+        return body
+
+    @staticmethod
+    def _split(payload: Dict) -> Tuple[str, str, Dict]:
+        meta = dict(payload or {})
+        return meta.pop("chunk_id", ""), meta.pop("document", ""), meta
+
+    def add(self, ids: List[str], embeddings: List[Sequence[float]], documents: List[str], metadatas: List[Dict]):
+        if not ids:
+            return
+        self._ensure(len(embeddings[0]))
+        points = [{"id": self._point_id(i), "vector": vector_list(e), "payload": {**m, "chunk_id": i, "document": d}}
+                  for i, e, d, m in zip(ids, embeddings, documents, metadatas)]
+        with METRICS.timer("rag_store_seconds", op="add", store="qdrant"):
+            self._req("PUT", "/points?wait=true", {"points": points})
+        METRICS.inc("rag_store_rows_total", len(ids), op="add", store="qdrant")
+
+    def delete_by_source_paths(self, source_paths: Sequence[str], batch: int = 500):
+        paths = list(dict.fromkeys(source_paths))
+        for i in range(0, len(paths), batch):
+            flt = {"must": [{"key": "source_path", "match": {"any": paths[i : i + batch]}}]}
+            with METRICS.timer("rag_store_seconds", op="delete", store="qdrant"):
+                self._req("POST", "/points/delete?wait=true", {"filter": flt}, missing_ok=True)
+        METRICS.inc("rag_store_rows_total", len(paths), op="delete", store="qdrant")
+
+    def delete_ids(self, ids: Sequence[str], batch: int = 500):
+        ids = list(ids)
+        for i in range(0, len(ids), batch):
+            with METRICS.timer("rag_store_seconds", op="delete", store="qdrant"):
+                self._req("POST", "/points/delete?wait=true", {"points": [self._point_id(c) for c in ids[i : i + batch]]},
+                          missing_ok=True)
+
+    def get_hits(self, ids: Sequence[str]) -> List["Hit"]:
+        if not ids:
+            return []
+        pts = self._req("POST", "/points", {"ids": [self._point_id(c) for c in ids], "with_payload": True}, missing_ok=True) or []
+        by_id = {}
+        for p in pts:
+            cid, doc, meta = self._split(p.get("payload"))
+            by_id[cid] = (doc, meta)
+        return [Hit(id=i, text=by_id[i][0], metadata=by_id[i][1], score=0.0) for i in ids if i in by_id]
+
+    def dim(self) -> Optional[int]:
+        info = self._req("GET", "", missing_ok=True)
+        if not info or not info.get("points_count"):
+            return None
+        vectors = info["config"]["params"]["vectors"]
+        return vectors.get("size") if isinstance(vectors, dict) else None
+
+    def _scroll(self, flt: Optional[Dict], page: int, with_vector: bool) -> Iterator[Dict]:
+        offset = None
+        while True:
+            body = {"limit": page, "with_payload": True, "with_vector": with_vector, **({"filter": flt} if flt else {}),
+                    **({"offset": offset} if offset is not None else {})}
+            res = self._req("POST", "/points/scroll", body, missing_ok=True)
+            if not res:
+                return
+            yield from res.get("points") or []
+            offset = res.get("next_page_offset")
+            if offset is None:
+                return
+
+    def rows_for_source(self, source_path: str) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+        ids, embs, docs, metas = [], [], [], []
+        for p in self._scroll({"must": [{"key": "source_path", "match": {"value": source_path}}]}, 256, True):
+            cid, doc, meta = self._split(p.get("payload"))
+            ids.append(cid)
+            embs.append(list(p.get("vector") or []))
+            docs.append(doc)
+            metas.append(meta)
+        return ids, embs, docs, metas
+
+    def iter_documents(self, page: int = 500) -> Iterable[Tuple[str, str, Dict]]:
+        for p in self._scroll(None, page, False):
+            yield self._split(p.get("payload"))
+
+    def iter_metadata(self, page: int = 1000) -> Iterable[Tuple[str, Dict]]:
+        for cid, _, meta in self.iter_documents(page):
+            yield cid, meta
+
+    def query(self, *, query_embedding: Optional[Sequence[float]] = None, query_text: Optional[str] = None,
+              n_results: int = 5, where: Optional[SearchFilter] = None) -> List["Hit"]:
+        if query_embedding is None:
+            raise ValueError("qdrant search needs a query embedding")
+        body = {"vector": vector_list(query_embedding), "limit": n_results, "with_payload": True}
+        if self.dtype == "int8":
+            body["params"] = {"quantization": {"rescore": True, "oversampling": self.OVERSAMPLING}}
+        if where and where.conditions():
+            body["filter"] = self._filter(where)
+        res = self._req("POST", "/points/search", body, missing_ok=True) or []
+        hits = []
+        for p in res:
+            cid, doc, meta = self._split(p.get("payload"))
+            hits.append(Hit(id=cid, text=doc, metadata=meta, score=float(p.get("score") or 0.0)))
+        return hits
+
+    @staticmethod
+    def _filter(flt: SearchFilter) -> Dict:
+        must: List[Dict] = []
+        for key, op, value in flt.conditions():
+            if op == "in":
+                must.append({"key": key, "match": {"any": value}})
+            else:
+                lo, hi = value
+                must.append({"key": key, "range": {"gte": lo, **({"lte": hi} if hi is not None else {})}})
+        return {"must": must}
+
+    def count(self) -> int:
+        info = self._req("GET", "", missing_ok=True)
+        return int(info.get("points_count") or 0) if info else 0
+
+    def reset(self):
+        self.drop()
+
+    def drop(self):
+        self._req("DELETE", "", missing_ok=True)
+        with self._lock:
+            self._exists = None
+
+
+class ShardedStore(VectorStore):
+    """One logical collection split over several backend collections, so each HNSW index stays small.
+
+    Rows go to the shard of their file: its top-level directory under `root` ("top") or its enclosing git
+    repository ("repo"). Shard collections are named <collection>--<shard>; the list lives in the store config
+    (_state/<collection>.store.json) so query processes find new shards. Deletes of files that still exist
+    go to their shard; deletes of vanished files, ID lookups and searches fan out to all shards concurrently
+    (search merges by score).
+    """
+
+    UNROUTED = ("_root", "_outside")  # shards for files directly under `root` / outside it
+
+    def __init__(self, config: "StoreConfig", make: Callable[[str], VectorStore], max_workers: int = 8):
+        self.config = config
+        self.make = make
+        self._shards: Dict[str, VectorStore] = {}
+        self._lock = threading.Lock()
+        self._repo_of: Dict[str, str] = {}
+        self._pool = futures.ThreadPoolExecutor(max_workers=max(1, max_workers), thread_name_prefix="shard")
+
+    def shard_for(self, source_path: str) -> str:
+        root = self.config.root
+        rel = os.path.relpath(source_path, root)
+        if rel.startswith(".."):
+            return "_outside"
+        if self.config.shard_by == "top":
+            parts = Path(rel).parts
+            return parts[0] if len(parts) > 1 else "_root"
+        d = os.path.dirname(source_path)
+        shard = self._repo_of.get(d)
+        if shard is None:
+            cur = d
+            while len(cur) > len(root) and not os.path.exists(os.path.join(cur, ".git")):
+                cur = os.path.dirname(cur)
+            shard = self._repo_of[d] = os.path.relpath(cur, root) if len(cur) > len(root) else "_root"
+        return shard
+
+    def _collection_name(self, shard: str) -> str:
+        name = f"{self.config.collection}--{slugify(shard)}"
+        return name if len(name) <= 63 else f"{name[:50]}-{hashlib.sha1(shard.encode()).hexdigest()[:12]}"
+
+    def _store(self, shard: str) -> VectorStore:
+        with self._lock:
+            st = self._shards.get(shard)
+            if st is None:
+                st = self._shards[shard] = self.make(self._collection_name(shard))
+            return st
+
+    @property
+    def text_query(self) -> bool:
+        return all(st.text_query for st in self.shards())
+
+    def shards(self) -> List[VectorStore]:
+        for shard in self.config.reload_shards():
+            self._store(shard)
+        with self._lock:
+            return list(self._shards.values())
+
+    def _shards_for(self, flt: SearchFilter) -> List[VectorStore]:
+        """Only the shards a filter can match: a shard's directory must overlap the path prefix, and with
+        --shard-by repo its repository must be one of the filter's repos."""
+        keep = []
+        for shard in self.config.reload_shards():
+            if shard not in self.UNROUTED:
+                d = os.path.join(self.config.root, shard) + "/"
+                if flt.path_prefix and not (d.startswith(flt.path_prefix) or flt.path_prefix.startswith(d)):
+                    continue
+                if flt.repos and self.config.shard_by == "repo" and Path(shard).name not in flt.repos:
+                    continue
+            keep.append(self._store(shard))
+        return keep
+
+    def _fan_out(self, fn: Callable[[VectorStore], object], stores: Optional[List[VectorStore]] = None) -> List:
+        stores = self.shards() if stores is None else stores
+        if len(stores) <= 1:
+            return [fn(st) for st in stores]
+        return list(self._pool.map(fn, stores))
+
+    def add(self, ids: List[str], embeddings: List[Sequence[float]], documents: List[str], metadatas: List[Dict]):
+        groups: Dict[str, List[int]] = {}
+        for i, m in enumerate(metadatas):
+            groups.setdefault(self.shard_for(m["source_path"]), []).append(i)
+        self.config.add_shards(groups)
+        for shard, rows in groups.items():
+            self._store(shard).add([ids[i] for i in rows], [embeddings[i] for i in rows], [documents[i] for i in rows],
+                                   [metadatas[i] for i in rows])
+
+    def delete_by_source_paths(self, source_paths: Sequence[str], batch: int = 500):
+        # Files that are gone can't be routed with --shard-by repo (their .git may be gone too), so those ask
+        # every shard; "top" routing is by path alone and always applies.
+        known = set(self.config.reload_shards())
+        routed: Dict[str, List[str]] = {}
+        unrouted: List[str] = []
+        for p in dict.fromkeys(source_paths):
+            if self.config.shard_by == "top" or os.path.exists(p):
+                routed.setdefault(self.shard_for(p), []).append(p)
+            else:
+                unrouted.append(p)
+        for shard, paths in routed.items():
+            if shard in known:  # no shard collection = nothing of this file was ever written
+                self._store(shard).delete_by_source_paths(paths, batch)
+        if unrouted:
+            self._fan_out(lambda st: st.delete_by_source_paths(unrouted, batch))
+
+    def delete_ids(self, ids: Sequence[str], batch: int = 500):
+        self._fan_out(lambda st: st.delete_ids(ids, batch))
+
+    def get_hits(self, ids: Sequence[str]) -> List["Hit"]:
+        if not ids:
+            return []
+        found = {h.id: h for hits in self._fan_out(lambda st: st.get_hits(ids)) for h in hits}
+        return [found[i] for i in ids if i in found]
+
+    def dim(self) -> Optional[int]:
+        return next((d for d in self._fan_out(lambda st: st.dim()) if d), None)
+
+    def rows_for_source(self, source_path: str) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+        out: Tuple[List, List, List, List] = ([], [], [], [])
+        for rows in self._fan_out(lambda st: st.rows_for_source(source_path)):
+            for acc, part in zip(out, rows):
+                acc.extend(part)
+        return out
+
+    def iter_documents(self, page: int = 500) -> Iterable[Tuple[str, str, Dict]]:
+        for st in self.shards():
+            yield from st.iter_documents(page)
+
+    def iter_metadata(self, page: int = 1000) -> Iterable[Tuple[str, Dict]]:
+        for st in self.shards():
+            yield from st.iter_metadata(page)
+
+    def query(self, *, query_embedding: Optional[Sequence[float]] = None, query_text: Optional[str] = None,
+              n_results: int = 5, where: Optional[SearchFilter] = None) -> List["Hit"]:
+        stores = self._shards_for(where) if where else None
+        hits = [h for part in self._fan_out(lambda st: st.query(query_embedding=query_embedding, query_text=query_text,
+                                                               n_results=n_results, where=where), stores)
+                for h in part]
+        return sorted(hits, key=lambda h: -h.score)[:n_results]
+
+    def count(self) -> int:
+        return sum(self._fan_out(lambda st: st.count()))
+
+    def reset(self):
+        self._fan_out(lambda st: st.drop())
+        with self._lock:
+            self._shards.clear()
+        self.config.set_shards([])
+
+    def drop(self):
+        self.reset()
+        self.config.remove()
+
+
+class StoreConfig:
+    """<db>/_state/<collection>.store.json: which backend and sharding a collection was created with, so later
+    commands (query, serve, update) open it the same way without repeating the flags. Absent = plain Chroma."""
+
+    DEFAULTS = {"backend": "chroma", "qdrant_url": "http://localhost:6333", "shard_by": "none", "index_dtype": "float32",
+                "root": None, "shards": []}
+
+    def __init__(self, db_path: str, collection: str):
+        self.collection = collection
+        self.path = Path(db_path) / "_state" / f"{collection}.store.json"
+        self.data = dict(self.DEFAULTS)
+        if self.path.exists():
+            self.data.update(json.loads(self.path.read_text()))
+        self._lock = threading.Lock()
+        self._mtime = 0.0
+
+    @property
+    def backend(self) -> str:
+        return self.data["backend"]
+
+    @property
+    def qdrant_url(self) -> str:
+        return self.data["qdrant_url"]
+
+    @property
+    def shard_by(self) -> str:
+        return self.data["shard_by"]
+
+    @property
+    def index_dtype(self) -> str:
+        return self.data["index_dtype"]
+
+    @property
+    def root(self) -> Optional[str]:
+        return self.data["root"]
+
+    def exists(self) -> bool:
+        return self.path.exists()
+
+    def save(self):
+        self.path.parent.mkdir(parents=True, exist_ok=True)
+        tmp = self.path.with_name(self.path.name + ".tmp")
+        tmp.write_text(json.dumps(self.data, indent=1))
+        os.replace(tmp, self.path)
+
+    def remove(self):
+        self.path.unlink(missing_ok=True)
+
+    def _read_shards(self) -> List[str]:
+        # Another process (ingest, watch) may have added shards since we last looked.
+        try:
+            mtime = self.path.stat().st_mtime
+        except FileNotFoundError:
+            return list(self.data["shards"])
+        if mtime != self._mtime:
+            self.data["shards"] = json.loads(self.path.read_text()).get("shards", [])
+            self._mtime = mtime
+        return list(self.data["shards"])
+
+    def reload_shards(self) -> List[str]:
+        with self._lock:
+            return self._read_shards()
+
+    def add_shards(self, shards: Iterable[str]):
+        with self._lock:
+            shards = list(dict.fromkeys(shards))
+            if all(s in self.data["shards"] for s in shards):
+                return
+            current = self._read_shards()
+            self.data["shards"] = current + [s for s in shards if s not in current]
+            self.save()
+
+    def set_shards(self, shards: List[str]):
+        with self._lock:
+            self.data["shards"] = list(shards)
+            if self.path.exists():
+                self.save()
+
+
+def open_store(db_path: str, collection: str, *, backend: Optional[str] = None, qdrant_url: Optional[str] = None,
+               shard_by: Optional[str] = None, index_dtype: Optional[str] = None, root: Optional[str] = None,
+               reset: bool = False) -> VectorStore:
+    """Open a collection the way it was created. `backend`/`shard_by`/`index_dtype` are only needed the first
+    time (they are saved in the store config); passing different ones later is an error unless `reset`."""
+    cfg = StoreConfig(db_path, collection)
+    want = {k: v for k, v in (("backend", backend), ("shard_by", shard_by), ("index_dtype", index_dtype)) if v is not None}
+    if cfg.exists():
+        clash = {k: v for k, v in want.items() if v != cfg.data[k]}
+        if clash and not reset:
+            saved = ", ".join(f"--{k.replace('_', '-')} {cfg.data[k]}" for k in clash)
+            raise SystemExit(f"Collection {collection} was created with {saved}; use those (or --reset to rebuild it)")
+        if clash:
+            _store_for(db_path, cfg).drop()
+            cfg = StoreConfig(db_path, collection)
+            cfg.remove()
+    if not cfg.exists():
+        cfg.data.update(want)
+        if cfg.index_dtype != "float32" and cfg.backend != "qdrant":
+            raise SystemExit(f"--index-dtype {cfg.index_dtype} needs --store qdrant (Chroma's HNSW index is float32 only)")
+        if qdrant_url:
+            cfg.data["qdrant_url"] = qdrant_url
+        if cfg.shard_by != "none":
+            if not root:
+                raise SystemExit("--shard-by needs --dir the first time (shards are relative to the tree root)")
+            cfg.data["root"] = str(Path(root).resolve())
+        if cfg.backend != "chroma" or cfg.shard_by != "none" or cfg.index_dtype != "float32":
+            cfg.save()
+    elif qdrant_url:
+        cfg.data["qdrant_url"] = qdrant_url  # the server may move; not sticky
+    return _store_for(db_path, cfg)
+
+
+def _store_for(db_path: str, cfg: StoreConfig) -> VectorStore:
+    if cfg.backend == "qdrant":
+        make: Callable[[str], VectorStore] = lambda name: QdrantStore(cfg.qdrant_url, name, dtype=cfg.index_dtype)
+    else:
+        client = chromadb.PersistentClient(path=db_path)
+        make = lambda name: ChromaStore(db_path, name, client=client)
+    return ShardedStore(cfg, make) if cfg.shard_by != "none" else make(cfg.collection)
+
 # ------------------------------
 # Manifest (tracks what we indexed)
 # ------------------------------
@@ -331,374 +2322,2736 @@ class FileRecord:
     sha1: str
     chunk_count: int
 
-@dataclass
 class Manifest:
-    version: int
-    files: Dict[str, FileRecord]
+    """Per-collection record of indexed files, kept in SQLite (WAL) at <db>/_state/<collection>.manifest.sqlite.
 
-    @staticmethod
-    def load(path: Path) -> "Manifest":
-        if not path.exists():
-            return Manifest(version=1, files={})
-        data = json.loads(path.read_text())
-        files = {k: FileRecord(**v) for k, v in data.get("files", {}).items()}
-        return Manifest(version=data.get("version", 1), files=files)
-
-    def save(self, path: Path):
-        serial = {k: dataclasses.asdict(v) for k, v in self.files.items()}
+    Records are upserted one at a time inside an open transaction; commit() makes everything so far durable,
+    so a run that commits every N files resumes where it stopped. Lookups go through the path primary key
+    (and an index on sha1), so nothing is loaded up front. A legacy <collection>.manifest.json is imported once.
+
+    Chunks that could not be embedded are kept in `failed_chunks` (text and metadata included) in the same
+    transaction as their file's record, so `retry-failed` can embed them later without re-parsing the file.
+    `banners` records which file keeps each shared license header (see ChunkFilter).
+    """
+
+    def __init__(self, path: Path):
         path.parent.mkdir(parents=True, exist_ok=True)
-        path.write_text(json.dumps({"version": self.version, "files": serial}, indent=2))
+        self.path = path
+        self._lock = threading.RLock()
+        self._db = sqlite3.connect(str(path), check_same_thread=False, timeout=30)
+        self._db.execute("PRAGMA journal_mode=WAL")
+        self._db.execute("PRAGMA synchronous=NORMAL")
+        self._db.execute(
+            "CREATE TABLE IF NOT EXISTS files ("
+            " path TEXT PRIMARY KEY, size INTEGER NOT NULL, mtime REAL NOT NULL, sha1 TEXT NOT NULL, chunk_count INTEGER NOT NULL)"
+        )
+        self._db.execute("CREATE INDEX IF NOT EXISTS files_sha1 ON files (sha1)")
+        self._db.execute(
+            "CREATE TABLE IF NOT EXISTS failed_chunks ("
+            " id TEXT PRIMARY KEY, path TEXT NOT NULL, text TEXT NOT NULL, metadata TEXT NOT NULL,"
+            " error TEXT, attempts INTEGER NOT NULL DEFAULT 1, last_attempt REAL NOT NULL)"
+        )
+        self._db.execute("CREATE INDEX IF NOT EXISTS failed_chunks_path ON failed_chunks (path)")
+        self._db.execute("CREATE TABLE IF NOT EXISTS banners (key BLOB PRIMARY KEY, path TEXT NOT NULL)")
+        self._db.execute("CREATE INDEX IF NOT EXISTS banners_path ON banners (path)")
+        self._db.commit()
+
+    @classmethod
+    def open(cls, db_path: str, collection: str) -> "Manifest":
+        state = Path(db_path) / "_state"
+        m = cls(state / f"{collection}.manifest.sqlite")
+        legacy = state / f"{collection}.manifest.json"
+        if legacy.exists():
+            m._import_json(legacy)
+        return m
+
+    def _import_json(self, legacy: Path):
+        data = json.loads(legacy.read_text())
+        with self._lock:
+            self._db.executemany(
+                "INSERT OR IGNORE INTO files (path, size, mtime, sha1, chunk_count) VALUES (?, ?, ?, ?, ?)",
+                [(k, v["size"], v["mtime"], v["sha1"], v["chunk_count"]) for k, v in data.get("files", {}).items()],
+            )
+            self._db.commit()
+        legacy.rename(legacy.with_name(legacy.name + ".migrated"))
+        print(f"[INFO] Imported {len(data.get('files', {}))} records from {legacy.name}")
+
+    def get(self, path: str) -> Optional[FileRecord]:
+        with self._lock:
+            row = self._db.execute("SELECT path, size, mtime, sha1, chunk_count FROM files WHERE path = ?", (path,)).fetchone()
+        return FileRecord(*row) if row else None
+
+    def paths_with_sha(self, sha1: str) -> List[str]:
+        with self._lock:
+            return [r[0] for r in self._db.execute("SELECT path FROM files WHERE sha1 = ?", (sha1,))]
+
+    def upsert(self, rec: FileRecord):
+        with self._lock:
+            self._db.execute(
+                "INSERT OR REPLACE INTO files (path, size, mtime, sha1, chunk_count) VALUES (?, ?, ?, ?, ?)",
+                (rec.path, rec.size, rec.mtime, rec.sha1, rec.chunk_count),
+            )
+
+    def remove(self, path: str):
+        with self._lock:
+            self._db.execute("DELETE FROM files WHERE path = ?", (path,))
+            self._db.execute("DELETE FROM failed_chunks WHERE path = ?", (path,))
+            self._db.execute("DELETE FROM banners WHERE path = ?", (path,))
+
+    def clear(self):
+        with self._lock:
+            self._db.execute("DELETE FROM files")
+            self._db.execute("DELETE FROM failed_chunks")
+            self._db.execute("DELETE FROM banners")
+            self._db.commit()
+
+    def claim_banner(self, key: bytes, path: str) -> str:
+        """The file that keeps license header `key`: its recorded owner, else `path` (now recorded)."""
+        with self._lock:
+            self._db.execute("INSERT OR IGNORE INTO banners (key, path) VALUES (?, ?)", (key, path))
+            return self._db.execute("SELECT path FROM banners WHERE key = ?", (key,)).fetchone()[0]
+
+    def release_banners(self, path: str, keep: Optional[bytes] = None):
+        """Drop the headers `path` owns except `keep` (it was re-indexed without them)."""
+        with self._lock:
+            self._db.execute("DELETE FROM banners WHERE path = ? AND key IS NOT ?", (path, keep))
+
+    def set_failed(self, path: str, failed: Sequence[Tuple[Chunk, Optional[str]]]):
+        """Replace the dead-letter entries of `path` with (chunk, error) pairs (a fresh index of the file
+        supersedes its old failures)."""
+        now = time.time()
+        with self._lock:
+            self._db.execute("DELETE FROM failed_chunks WHERE path = ?", (path,))
+            self._db.executemany(
+                "INSERT OR REPLACE INTO failed_chunks (id, path, text, metadata, error, attempts, last_attempt) VALUES (?, ?, ?, ?, ?, 1, ?)",
+                [(ch.id, path, ch.text, json.dumps(ch.metadata), error, now) for ch, error in failed],
+            )
+
+    def failed_chunks(self, limit: Optional[int] = None) -> List[Tuple[str, Chunk, int, Optional[str]]]:
+        """(manifest path, chunk, attempts, last error) for every dead-lettered chunk, oldest attempt first."""
+        sql = "SELECT path, id, text, metadata, attempts, error FROM failed_chunks ORDER BY last_attempt"
+        with self._lock:
+            rows = self._db.execute(sql + (" LIMIT ?" if limit else ""), (limit,) if limit else ()).fetchall()
+        return [(p, Chunk(id=cid, text=text, metadata=json.loads(meta)), n, err) for p, cid, text, meta, n, err in rows]
+
+    def resolve_failed(self, stored: Sequence[str], still_failing: Sequence[Tuple[str, Optional[str]]]):
+        """After a retry: drop the stored (or stale) IDs, bump the attempt count of the (id, error) rest."""
+        now = time.time()
+        with self._lock:
+            self._db.executemany("DELETE FROM failed_chunks WHERE id = ?", [(i,) for i in stored])
+            self._db.executemany(
+                "UPDATE failed_chunks SET attempts = attempts + 1, last_attempt = ?, error = COALESCE(?, error) WHERE id = ?",
+                [(now, error, i) for i, error in still_failing],
+            )
+
+    def failed_count(self, path: Optional[str] = None) -> int:
+        with self._lock:
+            if path is None:
+                return self._db.execute("SELECT COUNT(*) FROM failed_chunks").fetchone()[0]
+            return self._db.execute("SELECT COUNT(*) FROM failed_chunks WHERE path = ?", (path,)).fetchone()[0]
+
+    def records(self) -> List[FileRecord]:
+        with self._lock:
+            return [FileRecord(*r) for r in self._db.execute("SELECT path, size, mtime, sha1, chunk_count FROM files")]
+
+    def paths_with_prefix(self, prefix: str, limit: int) -> Optional[List[str]]:
+        """Recorded paths starting with `prefix` (a range scan on the primary key); None if there are more than `limit`."""
+        with self._lock:
+            rows = self._db.execute("SELECT path FROM files WHERE path >= ? AND path < ? LIMIT ?",
+                                    (prefix, prefix + "\U0010ffff", limit + 1)).fetchall()
+        return None if len(rows) > limit else [r[0] for r in rows]
+
+    def paths_under(self, directory: str) -> List[str]:
+        """Every recorded path inside `directory` (a range scan on the primary key)."""
+        lo = directory.rstrip("/") + "/"
+        with self._lock:
+            return [r[0] for r in self._db.execute("SELECT path FROM files WHERE path >= ? AND path < ?", (lo, lo[:-1] + "0"))]
+
+    def __len__(self) -> int:
+        with self._lock:
+            return self._db.execute("SELECT COUNT(*) FROM files").fetchone()[0]
+
+    def commit(self):
+        with self._lock:
+            self._db.commit()
+
+    def close(self):
+        with self._lock:
+            self._db.commit()
+            self._db.close()
 
 # ------------------------------
 # Ignore handling (.gitignore + defaults)
 # ------------------------------
 
-def build_ignore_spec(root: Path, extra_ignores: Sequence[str]):
-    patterns: List[str] = []
-    patterns.extend(DEFAULT_IGNORES)
-    patterns.extend(extra_ignores or [])
+_IGNORE_DIR_NAMES = frozenset(p.rstrip("/") for p in DEFAULT_IGNORES if p.endswith("/"))
+_IGNORE_DIR_PREFIXES = tuple(p for p in DEFAULT_IGNORES if not p.endswith("/"))  # e.g. "cmake-build-"
 
-    gi = root / ".gitignore"
-    if pathspec and gi.exists():
-        try:
-            patterns.extend(gi.read_text().splitlines())
-        except Exception:
-            pass
-    if not pathspec:
-        return None
-    return pathspec.PathSpec.from_lines("gitwildmatch", patterns)
 
+class IgnoreRules:
+    """DEFAULT_IGNORES + --ignore globs + every .gitignore from the root down.
 
-def should_ignore(path: Path, root: Path, spec) -> bool:
-    rel = str(path.relative_to(root))
-    if spec and spec.match_file(rel):
-        return True
-    for pat in DEFAULT_IGNORES:
-        if pat.rstrip("/") in rel.split(os.sep):
+    Paths are root-relative POSIX strings. Each .gitignore is matched against the path relative to its own
+    directory, the way git does; files are read lazily and cached, so the scanner only ever opens the
+    .gitignore of directories it actually descends into.
+    """
+
+    def __init__(self, root: Path, extra_ignores: Sequence[str]):
+        self.root = root
+        self._base = pathspec.PathSpec.from_lines("gitwildmatch", [*DEFAULT_IGNORES, *(extra_ignores or [])]) if pathspec else None
+        self._specs: Dict[str, object] = {}
+        self._lock = threading.Lock()
+
+    def _gitignore(self, rel_dir: str):
+        with self._lock:
+            if rel_dir in self._specs:
+                return self._specs[rel_dir]
+        spec = None
+        gi = self.root / rel_dir / ".gitignore" if rel_dir else self.root / ".gitignore"
+        if pathspec and gi.is_file():
+            try:
+                spec = pathspec.PathSpec.from_lines("gitwildmatch", gi.read_text(errors="ignore").splitlines())
+            except Exception:
+                spec = None
+        with self._lock:
+            self._specs[rel_dir] = spec
+        return spec
+
+    def ignored(self, rel: str, is_dir: bool) -> bool:
+        """Is this entry ignored, given that its parent directory is not?"""
+        name = rel.rsplit("/", 1)[-1]
+        if is_dir and (name in _IGNORE_DIR_NAMES or name.startswith(_IGNORE_DIR_PREFIXES)):
+            return True
+        probe = rel + "/" if is_dir else rel
+        if self._base is not None and self._base.match_file(probe):
             return True
-    return False
+        parts = rel.split("/")
+        for depth in range(len(parts)):
+            d = "/".join(parts[:depth])
+            spec = self._gitignore(d)
+            if spec is not None and spec.match_file(probe[len(d) + 1:] if d else probe):
+                return True
+        return False
+
+    def forget(self, rel_dir: str):
+        """Drop a cached .gitignore (watch mode calls this when one is edited)."""
+        with self._lock:
+            self._specs.pop(rel_dir, None)
+
+    def path_ignored(self, rel: str) -> bool:
+        """Full check for one file, including every ancestor directory (what the scanner gets by pruning)."""
+        parts = rel.split("/")
+        for depth in range(1, len(parts)):
+            if self.ignored("/".join(parts[:depth]), True):
+                return True
+        return self.ignored(rel, False)
+
+
+def build_ignore_spec(root: Path, extra_ignores: Sequence[str]) -> IgnoreRules:
+    return IgnoreRules(root, extra_ignores)
+
+
+def should_ignore(path: Path, root: Path, spec: IgnoreRules) -> bool:
+    return spec.path_ignored(path.relative_to(root).as_posix())
 
 # ------------------------------
 # File discovery
 # ------------------------------
 
-def iter_supported_files(root: Path, allowed_exts: Sequence[str], spec) -> Iterable[Path]:
-    allowed = set(allowed_exts)
-    for p in root.rglob("*"):
-        if not p.is_file():
-            continue
-        if should_ignore(p, root, spec):
-            continue
-        name = p.name
-        ext = p.suffix
-        if name == "CMakeLists.txt" or ext in allowed:
-            yield p
+def _scan_dir(dir_path: str, rel: str, rules: IgnoreRules, allowed: frozenset) -> Tuple[List[Path], List[Tuple[str, str]]]:
+    """List one directory. d_type from scandir tells files from dirs without an extra stat per entry
+    (symlinks still cost one); ignored directories are dropped here, so we never descend into them."""
+    files: List[Path] = []
+    subdirs: List[Tuple[str, str]] = []
+    try:
+        with os.scandir(dir_path) as it:
+            for entry in it:
+                child = f"{rel}/{entry.name}" if rel else entry.name
+                try:
+                    if entry.is_dir(follow_symlinks=False):
+                        if not rules.ignored(child, True):
+                            subdirs.append((entry.path, child))
+                        continue
+                    if not entry.is_file():
+                        continue
+                except OSError:
+                    continue
+                name = entry.name
+                dot = name.rfind(".")
+                ext = name[dot:] if dot > 0 else ""
+                if (name == "CMakeLists.txt" or ext in allowed) and not rules.ignored(child, False):
+                    files.append(Path(entry.path))
+    except OSError as e:
+        print(f"[WARN] Cannot list {dir_path}: {e}")
+    return files, subdirs
+
+
+def iter_supported_files(root: Path, allowed_exts: Sequence[str], spec: IgnoreRules, workers: int = 8,
+                         start: str = "") -> Iterable[Path]:
+    """Walk the tree with `workers` threads (scandir releases the GIL), yielding files as directories complete.
+    `start` (root-relative) walks only that directory, which the caller knows is not ignored."""
+    allowed = frozenset(allowed_exts)
+    ex = futures.ThreadPoolExecutor(max_workers=max(1, workers), thread_name_prefix="scan")
+    t0 = time.perf_counter()
+    found = 0
+    try:
+        pending = {ex.submit(_scan_dir, str(root / start) if start else str(root), start, spec, allowed)}
+        while pending:
+            done, pending = futures.wait(pending, return_when=futures.FIRST_COMPLETED)
+            for fut in done:
+                files, subdirs = fut.result()
+                for dpath, drel in subdirs:
+                    pending.add(ex.submit(_scan_dir, dpath, drel, spec, allowed))
+                found += len(files)
+                yield from files
+        METRICS.observe("rag_scan_seconds", time.perf_counter() - t0)
+    finally:
+        METRICS.inc("rag_scan_files_total", found)
+        ex.shutdown(wait=False, cancel_futures=True)
 
 # ------------------------------
-# Chunk builders
+# Filesystem watch (inotify)
 # ------------------------------
 
-@dataclass
+class Inotify:
+    """Minimal ctypes binding for Linux inotify (no third-party dependency)."""
+
+    CLOSE_WRITE = 0x00000008
+    MOVED_FROM = 0x00000040
+    MOVED_TO = 0x00000080
+    CREATE = 0x00000100
+    DELETE = 0x00000200
+    DELETE_SELF = 0x00000400
+    MOVE_SELF = 0x00000800
+    Q_OVERFLOW = 0x00004000
+    IGNORED = 0x00008000
+    ONLYDIR = 0x01000000
+    DONT_FOLLOW = 0x02000000
+    EXCL_UNLINK = 0x04000000
+    ISDIR = 0x40000000
+    DIR_MASK = CLOSE_WRITE | MOVED_FROM | MOVED_TO | CREATE | DELETE | DELETE_SELF | MOVE_SELF | ONLYDIR | DONT_FOLLOW | EXCL_UNLINK
+
+    _HEADER = struct.Struct("iIII")  # wd, mask, cookie, len
+
+    def __init__(self):
+        if not sys.platform.startswith("linux"):
+            raise RuntimeError("watch needs Linux inotify; use update/update-git elsewhere")
+        self._libc = ctypes.CDLL(ctypes.util.find_library("c") or "libc.so.6", use_errno=True)
+        self.fd = self._libc.inotify_init1(os.O_NONBLOCK | os.O_CLOEXEC)
+        if self.fd < 0:
+            raise OSError(ctypes.get_errno(), "inotify_init1 failed")
+
+    def add_watch(self, path: str, mask: int) -> int:
+        wd = self._libc.inotify_add_watch(self.fd, os.fsencode(path), ctypes.c_uint32(mask))
+        if wd < 0:
+            err = ctypes.get_errno()
+            raise OSError(err, os.strerror(err), path)
+        return wd
+
+    def rm_watch(self, wd: int):
+        self._libc.inotify_rm_watch(self.fd, wd)  # EINVAL if the kernel already dropped it: nothing to do
+
+    def read(self, timeout: Optional[float]) -> List[Tuple[int, int, int, str]]:
+        """Events as (wd, mask, cookie, name); [] on timeout."""
+        ready, _, _ = select.select([self.fd], [], [], timeout)
+        if not ready:
+            return []
+        try:
+            buf = os.read(self.fd, 1 << 16)
+        except BlockingIOError:
+            return []
+        events = []
+        off = 0
+        while off + self._HEADER.size <= len(buf):
+            wd, mask, cookie, n = self._HEADER.unpack_from(buf, off)
+            off += self._HEADER.size
+            name = os.fsdecode(buf[off : off + n].rstrip(b"\0"))
+            off += n
+            events.append((wd, mask, cookie, name))
+        return events
+
+    def close(self):
+        os.close(self.fd)
+
+
+class TreeWatcher:
+    """Recursive inotify watch over a source tree, honouring the same ignore rules as the scanner.
+
+    `poll()` turns raw events into coalesced per-path changes and returns them once the tree has been quiet
+    for `debounce` seconds (or changes have been pending for `max_delay`, so constant churn can't starve
+    indexing). Each path is reported once with no event type: the consumer decides by looking at the file
+    as it is now, which collapses create/modify/rename-over/delete bursts (editor save dances, git checkout)
+    into one upsert or one delete. A directory moved out or deleted is reported as a removed prefix (and its
+    watches removed); one moved in is walked and every file in it reported. An edited .gitignore re-walks its
+    directory's watches and asks for a rescan of that directory; on queue overflow `poll()` asks for a full one.
+    """
+
+    def __init__(self, root: Path, rules: IgnoreRules, allowed_exts: Sequence[str], debounce: float = 2.0, max_delay: float = 30.0):
+        self.root = root
+        self.rules = rules
+        self.allowed = frozenset(allowed_exts)
+        self.debounce = debounce
+        self.max_delay = max_delay
+        self.ino = Inotify()
+        self._dirs: Dict[int, str] = {}  # wd -> root-relative dir ("" = root)
+        self._wds: Dict[str, int] = {}
+        self._changed: Dict[str, None] = {}  # root-relative file paths, insertion-ordered
+        self._gone_dirs: Dict[str, None] = {}
+        self._rescan_dirs: Dict[str, None] = {}
+        self._first = 0.0
+        self._last = 0.0
+        self._overflow = False
+        self._warned_limit = False
+        self.add_tree("")
+
+    def _wanted(self, rel: str) -> bool:
+        name = rel.rsplit("/", 1)[-1]
+        dot = name.rfind(".")
+        return (name == "CMakeLists.txt" or (name[dot:] if dot > 0 else "") in self.allowed) and not self.rules.ignored(rel, False)
+
+    def add_tree(self, rel_dir: str, report_files: bool = False) -> int:
+        """Watch rel_dir and every non-ignored directory below it; returns the number of watches added."""
+        added = 0
+        todo = [rel_dir]
+        while todo:
+            rel = todo.pop()
+            path = str(self.root / rel) if rel else str(self.root)
+            try:
+                wd = self.ino.add_watch(path, Inotify.DIR_MASK)
+            except OSError as e:
+                if e.errno == 28 and not self._warned_limit:  # ENOSPC: out of watches
+                    self._warned_limit = True
+                    print("[WARN] inotify watch limit reached; raise fs.inotify.max_user_watches "
+                          "(sysctl -w fs.inotify.max_user_watches=1048576). Unwatched dirs are only seen by rescans.")
+                continue
+            self._dirs[wd] = rel
+            self._wds[rel] = wd
+            added += 1
+            try:
+                with os.scandir(path) as it:
+                    for entry in it:
+                        child = f"{rel}/{entry.name}" if rel else entry.name
+                        try:
+                            is_dir = entry.is_dir(follow_symlinks=False)
+                        except OSError:
+                            continue
+                        if is_dir:
+                            if not self.rules.ignored(child, True):
+                                todo.append(child)
+                        elif report_files and self._wanted(child):
+                            self._touch(child)
+            except OSError:
+                pass
+        return added
+
+    def _pending(self) -> bool:
+        return bool(self._changed or self._gone_dirs or self._rescan_dirs or self._overflow)
+
+    def _note(self):
+        now = time.monotonic()
+        if not self._pending():
+            self._first = now
+        self._last = now
+
+    def _touch(self, rel: str):
+        self._note()
+        self._changed[rel] = None
+
+    def _unwatch(self, rel_dir: str):
+        # A directory moved out of the tree keeps its watches (and keeps sending events) until they are removed.
+        prefix = rel_dir + "/"
+        for rel in [r for r in self._wds if r == rel_dir or r.startswith(prefix)]:
+            wd = self._wds.pop(rel)
+            self._dirs.pop(wd, None)
+            self.ino.rm_watch(wd)
+
+    def _drop_dir(self, rel_dir: str):
+        self._unwatch(rel_dir)
+        self._note()
+        self._gone_dirs[rel_dir] = None
+
+    def _gitignore_changed(self, rel_dir: str):
+        """Unwatch the directories below `rel_dir` its .gitignore now ignores, watch the ones it no longer
+        does, and ask for a rescan of `rel_dir` (files may have become ignored or visible)."""
+        self.rules.forget(rel_dir)
+        prefix = rel_dir + "/" if rel_dir else ""
+        for rel in sorted((r for r in self._wds if r != rel_dir and r.startswith(prefix)), key=len):
+            if rel in self._wds and self.rules.ignored(rel, True):
+                self._unwatch(rel)
+        self.add_tree(rel_dir)
+        self._note()
+        self._rescan_dirs[rel_dir] = None
+
+    def _handle(self, wd: int, mask: int, name: str):
+        if mask & Inotify.Q_OVERFLOW:
+            self._note()
+            self._overflow = True
+            return
+        parent = self._dirs.get(wd)
+        if parent is None:
+            return
+        if mask & (Inotify.IGNORED | Inotify.DELETE_SELF | Inotify.MOVE_SELF):
+            if mask & (Inotify.IGNORED | Inotify.DELETE_SELF) and self._wds.get(parent) == wd:
+                self._dirs.pop(self._wds.pop(parent), None)
+                if mask & Inotify.DELETE_SELF:
+                    self.ino.rm_watch(wd)
+            return
+        rel = f"{parent}/{name}" if parent else name
+        if mask & Inotify.ISDIR:
+            if self.rules.ignored(rel, True):
+                return
+            if mask & (Inotify.CREATE | Inotify.MOVED_TO):
+                self.add_tree(rel, report_files=True)
+            elif mask & (Inotify.DELETE | Inotify.MOVED_FROM):
+                self._drop_dir(rel)
+            return
+        if name == ".gitignore":
+            if not mask & Inotify.CREATE:  # CLOSE_WRITE follows
+                self._gitignore_changed(parent)
+            return
+        if mask & Inotify.CREATE:
+            return  # wait for CLOSE_WRITE; an empty new file isn't worth indexing yet
+        if self._wanted(rel):
+            self._touch(rel)
+
+    def poll(self, timeout: float = 1.0) -> Optional[Tuple[List[str], List[str], List[str], bool]]:
+        """Block up to `timeout`; returns (changed files, removed dir prefixes, dirs to rescan, needs full rescan)
+        when a batch is due. Dirs to rescan are root-relative ("" = root) and none is inside another."""
+        wait = timeout
+        if self._pending():
+            now = time.monotonic()
+            wait = max(0.0, min(timeout, self._last + self.debounce - now, self._first + self.max_delay - now))
+        for wd, mask, _cookie, name in self.ino.read(wait):
+            self._handle(wd, mask, name)
+        now = time.monotonic()
+        if not self._pending():
+            return None
+        if now - self._last < self.debounce and now - self._first < self.max_delay:
+            return None
+        rescan = sorted(self._rescan_dirs, key=len)
+        rescan = [d for i, d in enumerate(rescan) if not any(d == a or not a or d.startswith(a + "/") for a in rescan[:i])]
+        out = (list(self._changed), list(self._gone_dirs), rescan, self._overflow)
+        self._changed, self._gone_dirs, self._rescan_dirs, self._overflow = {}, {}, {}, False
+        return out
+
+    @property
+    def watch_count(self) -> int:
+        return len(self._dirs)
+
+    def close(self):
+        self.ino.close()
+
+# ------------------------------
+# Chunk builders
+# ------------------------------
+
+@dataclass
 class Chunk:
     id: str
     text: str
     metadata: Dict
 
 
-def build_chunks_for_file(path: Path, file_sha: str, code_chunk_lines: int, code_overlap: int, doc_chars: int, doc_overlap: int) -> List[Chunk]:
-    entries = read_file_entries(path)
-    chunks: List[Chunk] = []
-    is_code = (path.name == "CMakeLists.txt") or (path.suffix.lower() in CODE_EXTS)
+def chunk_path_key(path: Path) -> str:
+    """Per-file prefix of chunk IDs."""
+    return hashlib.sha1(str(path.resolve()).encode()).hexdigest()[:12]
+
+
+@functools.lru_cache(maxsize=4096)
+def git_repo_name(directory: str) -> str:
+    """Name of the innermost git work tree containing `directory` ("" outside any repository)."""
+    if os.path.exists(os.path.join(directory, ".git")):
+        return os.path.basename(directory)
+    parent = os.path.dirname(directory)
+    return "" if parent == directory else git_repo_name(parent)
+
+
+def filter_metadata(source_path: str) -> Dict[str, str]:
+    """Chunk metadata that SearchFilter matches on ("page" comes from the PDF reader)."""
+    return {"ext": Path(source_path).suffix.lower(), "repo": git_repo_name(os.path.dirname(source_path))}
 
+
+def _timed_iter(it: Iterator, timings: Dict[str, float], key: str) -> Iterator:
+    """Yield from `it`, adding the time spent producing each item to timings[key]."""
+    while True:
+        t0 = time.perf_counter()
+        try:
+            item = next(it)
+        except StopIteration:
+            return
+        finally:
+            timings[key] = timings.get(key, 0.0) + time.perf_counter() - t0
+        yield item
+
+
+def build_chunks_for_file(path: Path, file_sha: str, code_chunk_lines: int, code_overlap: int, doc_chars: int, doc_overlap: int,
+                          code_chunker: str = "syntax", max_chunks: int = 0) -> List[Chunk]:
+    return [ch for part in iter_chunks_for_file(path, file_sha, code_chunk_lines, code_overlap, doc_chars, doc_overlap, code_chunker,
+                                                max_chunks=max_chunks)
+            for ch in part]
+
+
+def chunker_for(path: Path) -> str:
+    """How a file is read and split: "syntax" (C/C++), "lines" (build files), "paragraphs" (.md/.txt), or
+    its document type. CMakeLists.txt is its own kind (always read whole). Chunks stored under one path only
+    stand for another path of the same kind."""
+    ext = path.suffix.lower()
+    if path.name == "CMakeLists.txt":
+        return "CMakeLists.txt"
+    if ext in CODE_EXTS - CPP_EXTS:
+        return "lines"
+    if ext in CPP_EXTS:
+        return "syntax"
+    if ext in DOC_EXTS:
+        return "paragraphs"
+    return ".html" if ext == ".htm" else ext
+
+
+def iter_chunks_for_file(path: Path, file_sha: str, code_chunk_lines: int, code_overlap: int, doc_chars: int, doc_overlap: int,
+                         code_chunker: str = "syntax", timings: Optional[Dict[str, float]] = None,
+                         max_chunks: int = 0) -> Iterator[List[Chunk]]:
+    """Chunks of one file, one list per entry (PDF page, or segment of a large text file), produced as the
+    entries are read. Segments are chunked with line windows (code) or paragraphs, at their absolute lines.
+    With `max_chunks`, reading stops once the file has produced that many chunks (generated sources).
+    With `timings`, reading/extraction time accumulates in "parse_s" and splitting time in "chunk_s"."""
+    is_code = (path.name == "CMakeLists.txt") or (path.suffix.lower() in CODE_EXTS)
+    use_syntax = code_chunker == "syntax" and path.name != "CMakeLists.txt" and path.suffix.lower() in CPP_EXTS
+    path_key = chunk_path_key(path)
+    source_path = str(path.resolve())
+    filter_meta = filter_metadata(source_path)
+    seen: Dict[str, int] = {}
+    produced = 0
+    truncated = False
+
+    entries = iter_file_entries(path)
+    if timings is not None:
+        entries = _timed_iter(entries, timings, "parse_s")
     for entry_idx, (text, extra) in enumerate(entries):
+        if max_chunks and produced >= max_chunks:
+            truncated = True  # more entries after the cap
+            break
         if not text.strip():
             continue
-        parts = (
-            chunk_code_lines(text, max_lines=code_chunk_lines, overlap=code_overlap)
-            if is_code else
-            chunk_text_paragraphs(text, max_chars=doc_chars, overlap=doc_overlap)
-        )
-        for i, body in enumerate(parts):
-            cid = f"{file_sha}:{entry_idx}:{i}"
+        t0 = time.perf_counter()
+        chunks: List[Chunk] = []
+        line_offset = extra.get("line_offset")
+        if line_offset is not None:
+            extra = {k: v for k, v in extra.items() if k != "line_offset"}
+        if use_syntax and line_offset is None:
+            parts = chunk_code_syntax(text, max_lines=code_chunk_lines, overlap=code_overlap)
+        elif is_code:
+            parts = chunk_code_windows(text, max_lines=code_chunk_lines, overlap=code_overlap)
+        else:
+            parts = [(p, {}) for p in chunk_text_paragraphs(text, max_chars=doc_chars, overlap=doc_overlap)]
+        if line_offset:
+            parts = [(body, {**span, "start_line": span["start_line"] + line_offset, "end_line": span["end_line"] + line_offset}
+                      if "start_line" in span else span) for body, span in parts]
+        if max_chunks and produced + len(parts) > max_chunks:
+            parts = parts[: max_chunks - produced]
+            truncated = True
+        produced += len(parts)
+        for i, (body, span) in enumerate(parts):
+            # Content-addressed ID: an edit only changes the IDs of chunks whose text changed.
+            chash = chunk_content_hash(body)
+            cid = f"{path_key}:{chash[:20]}"
+            n = seen.get(cid, 0)
+            seen[cid] = n + 1
+            if n:
+                cid = f"{cid}:{n}"  # same text twice in one file
             chunks.append(Chunk(
                 id=cid,
                 text=body,
                 metadata={
                     "file_sha1": file_sha,
-                    "source_path": str(path.resolve()),
+                    "chunk_hash": chash,
+                    "source_path": source_path,
                     "filename": path.name,
+                    **filter_meta,
                     "entry_index": entry_idx,
                     "chunk_index": i,
+                    **span,
                     **extra,
                 },
             ))
-    return chunks
+        if timings is not None:
+            timings["chunk_s"] = timings.get("chunk_s", 0.0) + time.perf_counter() - t0
+        yield chunks
+        if truncated:
+            break
+    if truncated:
+        print(f"[WARN] {path}: stopped at {max_chunks} chunks (--max-file-chunks); the rest of the file is not indexed")
+
+# ------------------------------
+# Boilerplate filter (before embedding)
+# ------------------------------
+
+_GENERATED_NAME_RE = re.compile(r"(\.pb\.(h|cc|cpp)|\.grpc\.pb\.(h|cc)|_generated\.\w+|\.generated\.\w+|^moc_.+\.cpp|^qrc_.+\.cpp|^ui_.+\.h)$")
+_GENERATED_MARKER_RE = re.compile(
+    r"@generated|do not edit|auto-?generated|automatically generated|generated by the protocol buffer compiler"
+    r"|meta object code from reading c\+\+ file|code generated by", re.I)
+_C_BANNER_RE = re.compile(r"\A\s*(?:/\*.*?\*/\s*|(?://[^\n]*(?:\n|\Z)\s*)+)", re.S)
+_HASH_BANNER_RE = re.compile(r"\A\s*(?:#[^\n]*(?:\n|\Z)\s*)+")
+# What makes a leading comment a license header, not just a comment that mentions "license" or "copyright"
+_LICENSE_MARKER_RE = re.compile(
+    r"SPDX-License-Identifier|copyright\s*(?:\(c\)|©|\d{4})|©\s*\d{4}|licensed under|permission is hereby granted"
+    r"|redistribution and use in source|all rights reserved|general public license|apache license|mozilla public license", re.I)
+_NUMBER_RE = re.compile(r"(?<![\w.])(?:0[xX][0-9a-fA-F]+|\d+(?:\.\d+)?(?:[eE][-+]?\d+)?)[uUlLfF]*\b")
+_WORD_RE = re.compile(r"(?<![\w.])[A-Za-z_]\w*")
+_BLOB_RE = re.compile(r"\S{120,}")
+_CHAR_RUN_RE = re.compile(r"(\S)\1{3,}")
+
+
+class ChunkFilter:
+    """Drops or trims chunks that cost embeddings without helping retrieval. Rules, per chunk of a code file
+    unless noted:
+
+        generated    the whole file: generated name (*.pb.cc, moc_*.cpp, ...) or a marker in its first 1 KiB
+        banner       a leading license header (comment block with a copyright/license clause) already seen in
+                     another file is stripped; the chunk is re-keyed on what is left
+        data         numeric tables (>= 70% of >= 64 tokens are literals) or long whitespace-free blobs
+        low_entropy  any file: chunks of >= 256 chars that are all fill, or under 2.5 bits/char once runs of one
+                     character are collapsed (repeated values, padding)
+
+    generated, data and low_entropy need nothing but the chunk, so prefilter() runs them in the parse workers;
+    dedup() does the banner rule in the parent. A file's first chunk that opens with a license header is left
+    whole for dedup(), which strips the header unless this file owns it and then applies the other rules.
+    The first file seen with a header owns it; with `owners` (the collection's Manifest) ownership persists,
+    so the same file keeps the license text across later runs. `counts` is reported by the caller; dropped
+    chunks also count in rag_chunks_dropped_total{reason=<rule>}.
+    """
+
+    BANNER_MIN_LINES = 3
+    BANNER_MIN_CHARS = 120
+    DATA_MIN_TOKENS = 64
+    DATA_NUMBER_SHARE = 0.7
+    MIN_ENTROPY = 2.5
+
+    def __init__(self, owners: Optional["Manifest"] = None):
+        self.counts: Counter = Counter()
+        self.owners = owners
+        self._banners: Dict[bytes, str] = {}  # header key -> owning path, when there is no `owners`
+        self._lock = threading.Lock()
+
+    @staticmethod
+    def begin() -> Dict:
+        """Per-file state for prefilter()/dedup(); one per file, shared by all its chunk lists. "banner" is
+        (key, header length) of the first chunk's license header, as found by prefilter()."""
+        return {"generated": None, "banner": None, "claimed": None}
+
+    def apply(self, state: Dict, chunks: List[Chunk]) -> List[Chunk]:
+        """Every rule, in one process."""
+        return self.dedup(state, self.prefilter(state, chunks))
+
+    def prefilter(self, state: Dict, chunks: List[Chunk]) -> List[Chunk]:
+        if not chunks:
+            return chunks
+        meta = chunks[0].metadata
+        name = meta.get("filename", "")
+        ext = Path(name).suffix.lower()
+        is_code = name == "CMakeLists.txt" or ext in CODE_EXTS
+        deferred = None
+        if state["generated"] is None:
+            state["generated"] = is_code and bool(_GENERATED_NAME_RE.search(name) or _GENERATED_MARKER_RE.search(chunks[0].text[:1024]))
+            if state["generated"]:
+                self._count("generated_files")
+            elif is_code:
+                state["banner"] = self._banner(chunks[0].text, ext)
+                if state["banner"]:
+                    deferred, chunks = chunks[0], chunks[1:]  # judged by dedup() on what is left after the header
+        if state["generated"]:
+            self._count("generated", len(chunks))
+            return []
+        out = [ch for ch in chunks if not self._drop(ch, is_code)]
+        return [deferred] + out if deferred else out
+
+    def dedup(self, state: Dict, chunks: List[Chunk]) -> List[Chunk]:
+        """Strip the first chunk's license header if another file owns it (the chunk prefilter() left whole)."""
+        banner, state["banner"] = state["banner"], None
+        if not banner or not chunks:
+            return chunks
+        key, end = banner
+        first = chunks[0]
+        path = first.metadata.get("source_path", "")
+        with self._lock:
+            owner = self.owners.claim_banner(key, path) if self.owners is not None else self._banners.setdefault(key, path)
+        if owner == path:
+            state["claimed"] = key
+        else:
+            self._count("banner")
+            first = self._cut(first, end)
+        name = chunks[0].metadata.get("filename", "")
+        if first is None or self._drop(first, name == "CMakeLists.txt" or Path(name).suffix.lower() in CODE_EXTS):
+            return chunks[1:]
+        return [first] + chunks[1:]
+
+    def finish(self, state: Dict, path: str):
+        """A file is done: release headers it owned but no longer starts with."""
+        if self.owners is not None:
+            with self._lock:
+                self.owners.release_banners(path, state["claimed"])
+
+    def merge(self, counts: Dict[str, int]):
+        """Add the counts of a prefilter() that ran in a parse worker."""
+        for rule, n in counts.items():
+            if n:
+                self._count(rule, n)
+
+    def _drop(self, ch: Chunk, is_code: bool) -> bool:
+        rule = ("data" if is_code and self._is_data(ch.text) else None) or ("low_entropy" if self._low_entropy(ch.text) else None)
+        if rule:
+            self._count(rule)
+        return bool(rule)
+
+    def _count(self, rule: str, n: int = 1):
+        with self._lock:
+            self.counts[rule] += n
+        if rule == "banner":
+            METRICS.inc("rag_banners_stripped_total", n)
+        elif rule != "generated_files":
+            METRICS.inc("rag_chunks_dropped_total", n, reason=rule)
+
+    @classmethod
+    def _banner(cls, text: str, ext: str) -> Optional[Tuple[bytes, int]]:
+        """(key, length) of a leading license header: a comment block with a copyright/license clause."""
+        m = (_C_BANNER_RE if ext in CPP_EXTS else _HASH_BANNER_RE).match(text)
+        if not m:
+            return None
+        banner = m.group(0)
+        if (banner.count("\n") < cls.BANNER_MIN_LINES or len(banner.strip()) < cls.BANNER_MIN_CHARS
+                or not _LICENSE_MARKER_RE.search(banner)):
+            return None
+        return hashlib.sha1(re.sub(r"\d+", "0", " ".join(banner.split())).encode()).digest(), m.end()  # years vary
+
+    @staticmethod
+    def _cut(ch: Chunk, end: int) -> Optional[Chunk]:
+        """The chunk without its first `end` chars of header (None if nothing is left)."""
+        rest = ch.text[end:]
+        if not rest.strip():
+            return None
+        # The ID and chunk_hash address the text that is embedded, so re-key on what is left.
+        chash = chunk_content_hash(rest)
+        path_key, _, old_key = ch.id.partition(":")
+        dup = old_key.partition(":")[2]  # same-text suffix from iter_chunks_for_file
+        meta = {**ch.metadata, "chunk_hash": chash}
+        if "start_line" in meta:
+            meta["start_line"] += ch.text.count("\n", 0, end)
+        return dataclasses.replace(ch, id=f"{path_key}:{chash[:20]}" + (f":{dup}" if dup else ""), text=rest, metadata=meta)
+
+    @classmethod
+    def _is_data(cls, text: str) -> bool:
+        blobs = sum(len(b) for b in _BLOB_RE.findall(text))
+        if blobs * 2 >= len(text) > 0:
+            return True
+        numbers = len(_NUMBER_RE.findall(text))
+        tokens = numbers + len(_WORD_RE.findall(text))
+        return tokens >= cls.DATA_MIN_TOKENS and numbers >= cls.DATA_NUMBER_SHARE * tokens
+
+    @classmethod
+    def _low_entropy(cls, text: str) -> bool:
+        if len(text) < 256:
+            return False
+        # Separator lines ("=====") collapse first, so they don't sink a chunk that also has real text.
+        text = _CHAR_RUN_RE.sub(r"\1", text)
+        n = len(text)
+        if len(text.strip()) < 32:
+            return True
+        entropy = -sum(c / n * math.log2(c / n) for c in Counter(text).values())
+        return entropy < cls.MIN_ENTROPY
+
+    def summary(self) -> str:
+        c = self.counts
+        parts = [f"generated={c['generated_files']} files/{c['generated']} chunks"] if c["generated_files"] else []
+        parts += [f"{rule}={c[rule]}" for rule in ("banner", "data", "low_entropy") if c[rule]]
+        return ", ".join(parts)
 
 # ------------------------------
 # Indexer (full + incremental + git-aware)
 # ------------------------------
 
 class Indexer:
-    def __init__(self, db_path: str, collection: str, ollama_url: str, embed_model: str, workers: int = 4, rate_limit_qps: float = 3.0):
-        self.store = ChromaStore(db_path=db_path, collection=collection, reset=False)
-        self.ollama = OllamaClient(base_url=ollama_url, timeout=180)
+    def __init__(self, db_path: str, collection: str, ollama_url: str, embed_model: str, workers: int = 4, rate_limit_qps: float = 3.0,
+                 batch_size: int = 32, batch_chars: int = 32000, burst: Optional[int] = None, max_inflight: Optional[int] = None,
+                 connect_timeout: float = 5.0, read_timeout: Optional[float] = None, embed_cache: bool = True,
+                 embed_dim: int = 0, cache_dtype: str = "float32", store: Optional[VectorStore] = None,
+                 adaptive: bool = False, chunk_filter: bool = True, manifest: Optional["Manifest"] = None):
+        if embed_dim > 0 and not embed_cache:
+            raise SystemExit("--embed-dim needs the embedding cache: queries rescore truncated candidates from it "
+                             "(drop --no-embed-cache)")
+        if embed_dim > 0 and cache_dtype != "float32":
+            raise SystemExit("--embed-dim rescoring reads the embedding cache, which must stay float32; "
+                             "compact the index with --store qdrant --index-dtype instead of --cache-dtype")
+        self.db_path = db_path
+        self.collection = collection
+        self.store = store or open_store(db_path, collection)
+        self.keywords = KeywordIndex.open(db_path, collection)
+        self.cache = EmbeddingCache(Path(db_path) / "_state" / "embed_cache.sqlite", dtype=cache_dtype) if embed_cache else None
+        self.embed_dim = max(0, embed_dim)  # store vectors truncated to this width (0 = as the model returns them)
+        self._dim_checked = False
+        self._answers: Optional[AnswerCache] = None
         self.embed_model = embed_model
         self.workers = max(1, workers)
-        self.qps = max(0.1, rate_limit_qps)
-        self._last_call_ts = 0.0
+        self.chunk_filter = ChunkFilter(owners=manifest) if chunk_filter else None
+        self.ollama = OllamaClient(base_url=ollama_url, timeout=read_timeout or 180, connect_timeout=connect_timeout, pool_size=self.workers,
+                                   priority="batch")
+        self.qps = max(0.1, rate_limit_qps) if rate_limit_qps > 0 else 0.0  # 0 = no request-rate cap
+        self.batch_size = max(1, batch_size)
+        self.batch_chars = max(1, batch_chars)
+        # --adaptive: --workers threads are the ceiling; the controller decides how many requests run at once
+        # and how big they are.
+        self.adaptive = AdaptiveConcurrency(self.workers, self.batch_size) if adaptive else None
+        # One limiter for every worker thread: one token per HTTP request (not per chunk).
+        self.limiter = RateLimiter(
+            rate=self.qps,
+            burst=burst if burst is not None else self.workers,
+            max_inflight=max_inflight if max_inflight is not None else (0 if adaptive else self.workers),
+            controller=self.adaptive,
+        )
 
-    def _embed_one(self, text: str) -> Optional[List[float]]:
+    def batch_limits(self) -> Tuple[int, int]:
+        """(chunks, chars) per embedding request right now: the configured caps, scaled down by --adaptive."""
+        if self.adaptive is None:
+            return self.batch_size, self.batch_chars
+        n = self.adaptive.batch
+        return n, max(1, self.batch_chars * n // self.batch_size)
+
+    def write(self, delete_paths: Sequence[str], ids: List[str], embs: List[List[float]], docs: List[str], metas: List[Dict]):
+        """Replace rows in the vector store and keyword index together: drop every row of `delete_paths`, then add."""
+        if ids and not self._dim_checked:
+            stored = self.store.dim()
+            if stored is not None and stored != len(embs[0]):
+                raise SystemExit(f"Collection {self.collection} holds {stored}-dim vectors, these are {len(embs[0])}-dim: "
+                                 f"pass --embed-dim {stored} (or --reset to re-index)")
+            self._dim_checked = True
+        self._invalidate_answers(list(delete_paths) + [m["source_path"] for m in metas])
+        if delete_paths:
+            self.store.delete_by_source_paths(delete_paths)
+            if self.keywords:
+                with METRICS.timer("rag_store_seconds", op="delete", store="keywords"):
+                    self.keywords.delete_by_source_paths(delete_paths)
+        if ids:
+            self.store.add(ids, embs, docs, metas)
+            if self.keywords:
+                with METRICS.timer("rag_store_seconds", op="add", store="keywords"):
+                    self.keywords.add(ids, docs, [m["source_path"] for m in metas])
+
+    @staticmethod
+    def can_move(old: Path, new: Path) -> bool:
+        """Whether `old`'s chunks are what indexing `new` would produce: same chunker, and the chunk filter
+        treats both names alike (a rename to *.pb.cc makes the file generated)."""
+        return (chunker_for(old) == chunker_for(new)
+                and bool(_GENERATED_NAME_RE.search(old.name)) == bool(_GENERATED_NAME_RE.search(new.name)))
+
+    def move_file(self, old: Path, new: Path) -> Optional[int]:
+        """Rename without re-embedding: copy the old file's rows under the new path's IDs and metadata,
+        then drop the old ones. Returns the row count, or None if nothing was stored for `old` or the new
+        name is chunked differently (see can_move; the caller re-indexes it)."""
+        if not self.can_move(old, new):
+            return None
+        old_src, new_src = str(old.resolve()), str(new.resolve())
+        ids, embs, docs, metas = self.store.rows_for_source(old_src)
+        if not ids or len(embs) != len(ids):
+            return None
+        old_key, new_key = chunk_path_key(old), chunk_path_key(new)
+        new_ids = [new_key + cid[len(old_key):] if cid.startswith(old_key) else f"{new_key}:{cid}" for cid in ids]
+        new_metas = [{**m, "source_path": new_src, "filename": new.name, **filter_metadata(new_src)} for m in metas]
+        self.write([old_src, new_src], new_ids, embs, docs, new_metas)
+        return len(new_ids)
+
+    def delete_ids(self, ids: Sequence[str]):
+        self.store.delete_ids(ids)
+        if self.keywords:
+            self.keywords.delete_ids(ids)
+
+    def reset(self):
+        self.store.reset()
+        self._dim_checked = False
+        if self.keywords:
+            self.keywords.clear()
+        if self._answer_cache():
+            self._answers.clear()
+
+    def _answer_cache(self) -> Optional[AnswerCache]:
+        # Only touch the answer cache if a query process created one; checked per write since `serve` may start later.
+        if self._answers is None and AnswerCache.path_for(self.db_path, self.collection).exists():
+            self._answers = AnswerCache(AnswerCache.path_for(self.db_path, self.collection))
+        return self._answers
+
+    def _invalidate_answers(self, paths: Sequence[str]):
+        if paths and self._answer_cache():
+            self._answers.invalidate_paths(paths)
+
+    def backfill_keywords(self):
+        """Collections indexed before the keyword index existed: build it once from the stored documents."""
+        if not self.keywords or self.keywords.count() or not self.store.count():
+            return
+        print("[INFO] Building keyword index from existing collection…")
+        ids: List[str] = []
+        docs: List[str] = []
+        srcs: List[str] = []
+        for cid, doc, meta in self.store.iter_documents():
+            ids.append(cid)
+            docs.append(doc or "")
+            srcs.append((meta or {}).get("source_path", ""))
+            if len(ids) >= 2000:
+                self.keywords.add(ids, docs, srcs)
+                ids, docs, srcs = [], [], []
+        self.keywords.add(ids, docs, srcs)
+
+    def _embed_texts(self, texts: List[str]) -> List[List[float]]:
         # throttle client-side to avoid overloading Ollama
-        wait = max(0.0, (1.0 / self.qps) - (time.time() - self._last_call_ts))
-        if wait > 0:
-            time.sleep(wait)
+        t0 = time.perf_counter()
         try:
-            vec = self.ollama.embed(self.embed_model, text)
-            self._last_call_ts = time.time()
-            return vec
-        except Exception:
+            with self.limiter.slot(len(texts)):
+                t1 = time.perf_counter()
+                METRICS.observe("rag_ratelimit_wait_seconds", t1 - t0)
+                try:
+                    vecs = [as_vector(v) for v in self.ollama.embed_batch(self.embed_model, texts)]
+                except Exception:
+                    METRICS.inc("rag_embed_requests_total", outcome="error")
+                    raise
+                METRICS.observe("rag_embed_seconds", time.perf_counter() - t1)
+        finally:
+            METRICS.set("rag_ratelimit_qps", self.limiter.rate)
+        METRICS.inc("rag_embed_requests_total", outcome="ok")
+        METRICS.inc("rag_embed_chunks_total", len(texts), source="ollama")
+        return vecs
+
+    def _embed_many(self, texts: List[str]) -> Tuple[List[Optional[Sequence[float]]], List[Optional[str]]]:
+        """Embed one batch at the stored width (--embed-dim); the cache keeps the full-width vectors.
+        Returns the vectors and, aligned with them, the error of each text that failed (its vector is None)."""
+        vecs, errors = self._embed_cached(texts)
+        if self.embed_dim:
+            vecs = [fit_dim(v, self.embed_dim) if v is not None else None for v in vecs]
+        return vecs, errors
+
+    def _embed_cached(self, texts: List[str]) -> Tuple[List[Optional[Sequence[float]]], List[Optional[str]]]:
+        """Embed one batch, serving repeats from the embedding cache and sending each distinct miss once."""
+        if self.cache is None:
+            return self._embed_uncached(texts)
+        keys = [EmbeddingCache.key(self.embed_model, t) for t in texts]
+        found = self.cache.get_many(keys)
+        todo = {k: t for k, t in zip(keys, texts) if k not in found}
+        METRICS.inc("rag_embed_chunks_total", sum(1 for k in keys if k in found), source="cache")
+        errors: Dict[str, str] = {}
+        if todo:
+            vecs, errs = self._embed_uncached(list(todo.values()))
+            fresh = dict(zip(todo, vecs))
+            errors = {k: e for k, e in zip(todo, errs) if e is not None}
+            self.cache.put_many({k: v for k, v in fresh.items() if v is not None})
+            found.update(fresh)
+        return [found.get(k) for k in keys], [errors.get(k) for k in keys]
+
+    def _embed_uncached(self, texts: List[str]) -> Tuple[List[Optional[List[float]]], List[Optional[str]]]:
+        """Embed one batch with retries. If the whole batch keeps failing, retry its texts one by one
+        so a single bad chunk (e.g. over the model's context) doesn't take the other N-1 down with it.
+        Returns (vectors, errors): a text that still fails has vector None and its error message."""
+        try:
+            return self._embed_texts(texts), [None] * len(texts)
+        except Exception as e:
+            err = e
             # retries with exponential backoff
             for i in range(3):
                 t = (2 ** i) * 0.5
                 time.sleep(t)
+                METRICS.inc("rag_embed_retries_total")
                 try:
-                    vec = self.ollama.embed(self.embed_model, text)
-                    self._last_call_ts = time.time()
-                    return vec
-                except Exception:
+                    return self._embed_texts(texts), [None] * len(texts)
+                except Exception as e2:
+                    err = e2
                     continue
-            print("[WARN] embedding failed after retries; skipping a chunk")
-            return None
+        if len(texts) > 1:
+            singles = [self._embed_uncached([t]) for t in texts]
+            return [v[0] for v, _ in singles], [e[0] for _, e in singles]
+        msg = f"{type(err).__name__}: {err}"
+        print(f"[WARN] embedding failed after retries ({msg}); chunk kept for retry-failed")
+        METRICS.inc("rag_chunks_dropped_total", reason="embed_failed")
+        return [None], [msg]
 
-    def _embed_batch_parallel(self, chunks: List[Chunk]) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+    def _embed_one(self, text: str) -> Optional[List[float]]:
+        return self._embed_many([text])[0][0]
+
+    def _iter_batches(self, chunks: List[Chunk]) -> Iterable[List[Chunk]]:
+        """Group chunks into requests of at most batch_size items and batch_chars characters."""
+        batch: List[Chunk] = []
+        chars = 0
+        for ch in chunks:
+            n = len(ch.text)
+            max_n, max_chars = self.batch_limits()
+            if batch and (len(batch) >= max_n or chars + n > max_chars):
+                yield batch
+                batch, chars = [], 0
+            batch.append(ch)
+            chars += n
+        if batch:
+            yield batch
+
+    def _embed_batch_parallel(self, chunks: List[Chunk], failed: Optional[List[Tuple[Chunk, Optional[str]]]] = None,
+                              ) -> Tuple[List[str], List[List[float]], List[str], List[Dict]]:
+        """Embed all chunks; those that still fail after retries are appended to `failed` (when given) as
+        (chunk, error) pairs."""
         ids: List[str] = []
         embs: List[List[float]] = []
         docs: List[str] = []
         metas: List[Dict] = []
         with futures.ThreadPoolExecutor(max_workers=self.workers) as ex:
-            fut_map = {ex.submit(self._embed_one, ch.text): ch for ch in chunks}
-            for fut in tqdm(futures.as_completed(fut_map), total=len(chunks), desc="Embedding", unit="chunk"):
-                ch = fut_map[fut]
-                try:
-                    emb = fut.result()
-                except Exception:
-                    emb = None
-                if emb is None:
-                    continue
-                ids.append(ch.id)
-                embs.append(emb)
-                docs.append(ch.text)
-                metas.append(ch.metadata)
+            fut_map = {ex.submit(self._embed_many, [ch.text for ch in batch]): batch for batch in self._iter_batches(chunks)}
+            with tqdm(total=len(chunks), desc="Embedding", unit="chunk") as bar:
+                for fut in futures.as_completed(fut_map):
+                    batch = fut_map[fut]
+                    try:
+                        vecs, errors = fut.result()
+                    except Exception as e:
+                        vecs, errors = [None] * len(batch), [f"{type(e).__name__}: {e}"] * len(batch)
+                        METRICS.inc("rag_chunks_dropped_total", len(batch), reason="embed_failed")
+                    bar.update(len(batch))
+                    for ch, emb, err in zip(batch, vecs, errors):
+                        if emb is None:
+                            if failed is not None:
+                                failed.append((ch, err))
+                            continue
+                        ids.append(ch.id)
+                        embs.append(emb)
+                        docs.append(ch.text)
+                        metas.append(ch.metadata)
         return ids, embs, docs, metas
 
-    def upsert_file(self, path: Path, file_sha: str, *, code_chunk_lines: int, code_overlap: int, doc_chars: int, doc_overlap: int) -> int:
+    def upsert_file(self, path: Path, file_sha: str, *, code_chunk_lines: int, code_overlap: int, doc_chars: int, doc_overlap: int,
+                    code_chunker: str = "syntax", max_chunks: int = 0,
+                    failed: Optional[List[Tuple[Chunk, Optional[str]]]] = None) -> int:
         # Build fresh chunks
-        chunks = build_chunks_for_file(path, file_sha, code_chunk_lines, code_overlap, doc_chars, doc_overlap)
-        if not chunks:
-            return 0
-        # Remove any old vectors for this file, then add new ones
-        self.store.delete_by_file_sha(file_sha)
-        ids, embs, docs, metas = self._embed_batch_parallel(chunks)
-        if ids:
-            self.store.add(ids, embs, docs, metas)
+        chunks = build_chunks_for_file(path, file_sha, code_chunk_lines, code_overlap, doc_chars, doc_overlap, code_chunker,
+                                       max_chunks)
+        if self.chunk_filter:
+            state = self.chunk_filter.begin()
+            chunks = self.chunk_filter.apply(state, chunks)
+            self.chunk_filter.finish(state, str(path.resolve()))
+        # Remove any old vectors for this file (whatever SHA they were stored under), then add new ones
+        ids, embs, docs, metas = self._embed_batch_parallel(chunks, failed) if chunks else ([], [], [], [])
+        self.write([str(path.resolve())], ids, embs, docs, metas)
         return len(ids)
 
+# ------------------------------
+# Streaming ingest pipeline (parse/chunk -> embed -> write)
+# ------------------------------
+
+@dataclass
+class FileJob:
+    path: Path
+    size: int
+    mtime: float
+    file_sha: Optional[str] = None  # filled in by the parse stage when not known up front
+
+
+def _address_space_bytes() -> int:
+    with open("/proc/self/statm") as f:
+        return int(f.read().split()[0]) * os.sysconf("SC_PAGE_SIZE")
+
+
+def _parse_worker_main(conn, opts: Dict, mem_mb: int, chunk_filter: bool = False):
+    """Parse-worker process: hash + read + chunk one file per task, streaming results back over `conn`:
+    ("sha", sha), then ("chunks", [...]) per entry (PDF page), then ("end", timings) — or ("error", msg).
+    With `chunk_filter` the stateless ChunkFilter rules run here: ("banner", (key, length)) precedes the
+    first chunks of a file whose first chunk opens with a license header, and timings["filtered"] carries
+    the drop counts; timings["chunks"] counts the chunks produced before filtering."""
+    signal.signal(signal.SIGINT, signal.SIG_IGN)  # Ctrl-C is the parent's to handle
+    if mem_mb and resource is not None:
+        try:
+            # Relative to what the worker already maps, so the cap means "room for one file".
+            soft, hard = resource.getrlimit(resource.RLIMIT_AS)
+            limit = _address_space_bytes() + (mem_mb << 20)
+            resource.setrlimit(resource.RLIMIT_AS, (limit if hard == resource.RLIM_INFINITY else min(limit, hard), hard))
+        except (OSError, ValueError):
+            pass
+    flt = ChunkFilter() if chunk_filter else None
+    while True:
+        try:
+            task = conn.recv()
+        except EOFError:
+            return
+        if task is None:
+            return
+        path, file_sha = task
+        try:
+            p = Path(path)
+            t0 = time.perf_counter()
+            sha = file_sha or sha1_file(p)
+            timings = {"parse_s": time.perf_counter() - t0, "chunk_s": 0.0}
+            conn.send(("sha", sha))
+            state = ChunkFilter.begin()
+            if flt:
+                flt.counts = Counter()
+            for part in iter_chunks_for_file(p, sha, timings=timings, **opts):
+                timings["chunks"] = timings.get("chunks", 0) + len(part)
+                if flt:
+                    part = flt.prefilter(state, part)
+                    if state["banner"]:
+                        conn.send(("banner", state["banner"]))
+                        state["banner"] = None
+                if part:
+                    conn.send(("chunks", part))
+            if flt:
+                timings["filtered"] = dict(flt.counts)
+            conn.send(("end", timings))
+        except MemoryError:
+            conn.send(("error", f"out of memory (--parse-mem-mb {mem_mb})"))
+            return  # the heap may be fragmented past use; let the supervisor start a fresh worker
+        except Exception as e:
+            conn.send(("error", f"{type(e).__name__}: {e}"))
+
+
+class _ParseWorker:
+    def __init__(self, proc, conn):
+        self.proc = proc
+        self.conn = conn
+        self.job: Optional[FileJob] = None
+        self.deadline: Optional[float] = None
+
+
+class ParsePool:
+    """Supervised parse processes, one file at a time each, with results streamed back part by part.
+
+    Unlike a ProcessPoolExecutor, a worker can be killed: if it makes no progress (no page or chunk list
+    produced) for `timeout` seconds, or dies (e.g. the `mem_mb` RLIMIT_AS cap turned into a MemoryError or
+    the OOM killer), its file is reported as failed and a fresh worker takes its place. Every worker comes
+    from a forkserver (spawn where there is none): by the time a pool starts, the parent may already run
+    threads (metrics server, endpoint probes, tqdm monitor, a previous watch batch's scan pool), and forking
+    a threaded process can copy a lock some other thread holds. The server preloads this module, so a new
+    worker is a cheap fork of a single-threaded process rather than a fresh interpreter.
+    """
+
+    def __init__(self, workers: int, opts: Dict, *, timeout: float = 0, mem_mb: int = 0, chunk_filter: bool = False):
+        self.n = max(1, workers)
+        self.opts = dict(opts)
+        self.timeout = timeout
+        self.mem_mb = mem_mb
+        self.chunk_filter = chunk_filter
+        if "forkserver" in multiprocessing.get_all_start_methods():
+            self._ctx = multiprocessing.get_context("forkserver")
+            self._ctx.set_forkserver_preload([__name__])  # no effect once the server is running
+        else:
+            self._ctx = multiprocessing.get_context("spawn")
+        self._workers: List[_ParseWorker] = []
+        self.killed = 0
+
+    def _spawn(self) -> _ParseWorker:
+        parent, child = self._ctx.Pipe()
+        proc = self._ctx.Process(target=_parse_worker_main, args=(child, self.opts, self.mem_mb, self.chunk_filter), daemon=True, name="parse")
+        proc.start()
+        child.close()
+        return _ParseWorker(proc, parent)
+
+    def start(self):
+        self._workers = [self._spawn() for _ in range(self.n)]
+
+    def _replace(self, w: _ParseWorker):
+        self.killed += 1
+        METRICS.inc("rag_parse_worker_restarts_total")
+        w.proc.kill()
+        w.proc.join(timeout=5)
+        w.conn.close()
+        self._workers[self._workers.index(w)] = self._spawn()
+
+    def results(self, jobs: Iterable[FileJob], abort: threading.Event) -> Iterator[Tuple[FileJob, str, object]]:
+        """Run every job; yield (job, kind, payload) messages as workers produce them (see _parse_worker_main).
+        "error" is also yielded for timeouts and worker deaths; every job ends with "end" or "error"."""
+        it = iter(jobs)
+        exhausted = False
+        while not abort.is_set():
+            for w in self._workers:
+                if w.job is None and not exhausted:
+                    job = next(it, None)
+                    if job is None:
+                        exhausted = True
+                        break
+                    w.job = job
+                    w.deadline = time.monotonic() + self.timeout if self.timeout else None
+                    w.conn.send((str(job.path), job.file_sha))
+            busy = [w for w in self._workers if w.job is not None]
+            if not busy:
+                return
+            now = time.monotonic()
+            wait = min([0.5] + [max(0.0, w.deadline - now) for w in busy if w.deadline])
+            ready = multiprocessing.connection.wait([w.conn for w in busy], timeout=wait)
+            for w in busy:
+                job = w.job
+                if w.conn in ready:
+                    try:
+                        kind, payload = w.conn.recv()
+                    except (EOFError, OSError):
+                        code = w.proc.exitcode
+                        self._replace(w)
+                        yield job, "error", f"parse worker died (exit code {code}; memory cap or crash)"
+                        continue
+                    if self.timeout:
+                        w.deadline = time.monotonic() + self.timeout
+                    if kind in ("end", "error"):
+                        w.job = None
+                        if not w.proc.is_alive() or kind == "error" and "out of memory" in str(payload):
+                            self._replace(w)
+                    yield job, kind, payload
+                elif w.deadline is not None and time.monotonic() > w.deadline:
+                    self._replace(w)
+                    yield job, "error", f"no progress for {self.timeout:g}s (--parse-timeout); worker killed"
+
+    def close(self):
+        for w in self._workers:
+            try:
+                w.conn.send(None)
+            except OSError:
+                pass
+        for w in self._workers:
+            w.proc.join(timeout=2)
+            if w.proc.is_alive():
+                w.proc.kill()
+                w.proc.join(timeout=2)
+            w.conn.close()
+        self._workers = []
+
+
+class IngestPipeline:
+    """Streams files through bounded stages so the embedder never waits on a single small file:
+
+        parse/chunk (supervised processes) -> batcher -> embed workers (threads) -> writer (one thread)
+
+    Embedding batches span file boundaries and the writer groups Chroma deletes/adds. A file is reported
+    through `on_file_done(job, stored_count, failed_chunks)` only once every one of its chunks has been
+    written or has failed to embed, so callers can record it (and dead-letter the failures) in the manifest.
+    Full queues block the stage upstream (backpressure).
+
+    The first Ctrl-C stops feeding new files and lets the ones in flight finish and flush, so the caller can
+    commit them; a second one aborts at once.
+    """
+
+    _DONE = object()
+
+    def __init__(self, indexer: "Indexer", chunk_opts: Dict, *, parse_workers: int = 4, queue_depth: int = 64, write_batch: int = 512,
+                 parse_timeout: float = 300, parse_mem_mb: int = 0):
+        self.indexer = indexer
+        self.chunk_opts = dict(chunk_opts)
+        self.parse_workers = max(1, parse_workers)
+        self.parse_timeout = parse_timeout
+        self.parse_mem_mb = parse_mem_mb
+        self.queue_depth = max(2, queue_depth)
+        self.write_batch = max(1, write_batch)
+        self._abort = threading.Event()
+        self._stop = threading.Event()  # graceful: no new files, drain what is in flight
+        self._errors: List[BaseException] = []
+
+    # -- queue helpers that give up when another stage has failed --
+    def _put(self, q: "queue.Queue", item):
+        while not self._abort.is_set():
+            try:
+                q.put(item, timeout=0.5)
+                return
+            except queue.Full:
+                continue
+        raise RuntimeError("pipeline aborted")
+
+    def _get(self, q: "queue.Queue", timeout: Optional[float] = None):
+        deadline = None if timeout is None else time.monotonic() + timeout
+        while not self._abort.is_set():
+            step = 0.5 if deadline is None else max(0.0, min(0.5, deadline - time.monotonic()))
+            try:
+                return q.get(timeout=step)
+            except queue.Empty:
+                if deadline is not None and time.monotonic() >= deadline:
+                    raise
+        raise RuntimeError("pipeline aborted")
+
+    def _stage(self, fn, *a):
+        def body():
+            try:
+                fn(*a)
+            except BaseException as e:  # surface the first failure and unblock every other stage
+                if not self._abort.is_set():
+                    self._errors.append(e)
+                self._abort.set()
+        t = threading.Thread(target=body, daemon=True, name=getattr(fn, "__name__", "stage"))
+        t.start()
+        return t
+
+    # -- stages --
+    def _parse_stage(self, pool: ParsePool, jobs: Iterable[FileJob], chunk_q: "queue.Queue"):
+        counts: Dict[int, int] = {}
+        states: Dict[int, Dict] = {}  # ChunkFilter state per open file
+        flt = self.indexer.chunk_filter  # the workers ran the stateless rules; banner dedup needs every file
+        feed = itertools.takewhile(lambda _: not self._stop.is_set(), jobs)
+        for job, kind, payload in pool.results(feed, self._abort):
+            if kind == "sha":
+                job.file_sha = payload
+                counts[id(job)] = 0
+                states[id(job)] = ChunkFilter.begin()
+                self._put(chunk_q, ("open", job))
+            elif kind == "banner":
+                states[id(job)]["banner"] = tuple(payload)
+            elif kind == "chunks":
+                if flt:
+                    payload = flt.dedup(states[id(job)], payload)
+                    if not payload:
+                        continue
+                counts[id(job)] += len(payload)
+                self._put(chunk_q, ("chunks", job, payload))
+            elif kind == "end":
+                METRICS.observe("rag_parse_seconds", payload["parse_s"])
+                METRICS.observe("rag_chunk_seconds", payload["chunk_s"])
+                METRICS.inc("rag_files_total", outcome="ok")
+                METRICS.inc("rag_chunks_total", payload.get("chunks", 0))
+                if flt:
+                    flt.merge(payload.get("filtered", {}))
+                    flt.finish(states[id(job)], str(job.path.resolve()))  # as in source_path
+                states.pop(id(job), None)
+                self._put(chunk_q, ("close", job, counts.pop(id(job))))
+            else:
+                METRICS.inc("rag_files_total", outcome="failed")
+                print(f"[WARN] Failed to parse {job.path}: {payload}")
+                states.pop(id(job), None)
+                if counts.pop(id(job), None) is not None:
+                    self._put(chunk_q, ("abandon", job))
+                # not reported -> not recorded in the manifest -> retried next run
+        self._put(chunk_q, self._DONE)
+
+    def _batch_stage(self, chunk_q: "queue.Queue", batch_q: "queue.Queue", write_q: "queue.Queue"):
+        ix = self.indexer
+        batch: List[Chunk] = []
+        chars = 0
+        while True:
+            item = self._get(chunk_q)
+            if item is self._DONE:
+                break
+            if item[0] != "chunks":
+                self._put(write_q, item)  # open / close / abandon go straight to the writer
+                continue
+            max_n, max_chars = ix.batch_limits()
+            for ch in item[2]:
+                if batch and (len(batch) >= max_n or chars + len(ch.text) > max_chars):
+                    self._put(batch_q, batch)
+                    batch, chars = [], 0
+                batch.append(ch)
+                chars += len(ch.text)
+        if batch:
+            self._put(batch_q, batch)
+        for _ in range(ix.workers):
+            self._put(batch_q, self._DONE)
+
+    def _embed_stage(self, batch_q: "queue.Queue", write_q: "queue.Queue"):
+        while True:
+            batch = self._get(batch_q)
+            if batch is self._DONE:
+                self._put(write_q, ("worker_done",))
+                return
+            vecs, errors = self.indexer._embed_many([ch.text for ch in batch])
+            self._put(write_q, ("chunks", batch, vecs, errors))
+
+    def _write_stage(self, write_q: "queue.Queue",
+                     on_file_done: Callable[[FileJob, int, List[Tuple[Chunk, Optional[str]]]], None], bar):
+        files: Dict[str, Dict] = {}          # source_path -> {"job", "total", "seen", "stored", "failed"}
+        ready: List[str] = []                # every chunk accounted for; reported after the next flush
+        deletes: List[str] = []
+        rows: Dict[str, Tuple[List[float], str, Dict]] = {}
+        workers_left = self.indexer.workers
+        self.stored = 0
+
+        def check(key: str):
+            f = files[key]
+            if f["total"] is not None and f["seen"] >= f["total"]:
+                ready.append(key)
+
+        def flush():
+            # One batched delete, then one add: a file's delete is always queued before any of its rows arrive,
+            # so old vectors (any SHA) go and the new ones land in the same flush.
+            ids = list(rows)
+            if deletes or ids:
+                self.indexer.write(deletes, ids, [rows[i][0] for i in ids], [rows[i][1] for i in ids], [rows[i][2] for i in ids])
+                self.stored += len(ids)
+                deletes.clear()
+                rows.clear()
+            for key in ready:
+                f = files.pop(key)
+                on_file_done(f["job"], f["stored"], f["failed"])
+                bar.update(1)
+            ready.clear()
+
+        while workers_left:
+            try:
+                msg = self._get(write_q, timeout=1.0)
+            except queue.Empty:
+                flush()  # idle: don't sit on finished files
+                continue
+            kind = msg[0]
+            if kind == "open":
+                job = msg[1]
+                key = str(job.path.resolve())
+                files[key] = {"job": job, "total": None, "seen": 0, "stored": 0, "failed": []}
+                deletes.append(key)
+            elif kind == "close":
+                key = str(msg[1].path.resolve())
+                files[key]["total"] = msg[2]
+                check(key)
+            elif kind == "abandon":
+                # Parsing failed part-way: keep the old rows if its delete hasn't been flushed yet, drop its new ones.
+                key = str(msg[1].path.resolve())
+                files.pop(key, None)
+                if key in deletes:
+                    deletes.remove(key)
+                dropped = [cid for cid, r in rows.items() if r[2]["source_path"] == key]
+                for cid in dropped:
+                    del rows[cid]
+                METRICS.inc("rag_chunks_dropped_total", len(dropped), reason="parse_failed")
+            elif kind == "chunks":
+                for ch, emb, err in zip(msg[1], msg[2], msg[3]):
+                    key = ch.metadata["source_path"]
+                    f = files.get(key)
+                    if f is None:
+                        continue  # abandoned file; chunks were already in flight
+                    f["seen"] += 1
+                    if emb is None:
+                        f["failed"].append((ch, err))
+                    elif ch.id not in rows:
+                        rows[ch.id] = (emb, ch.text, ch.metadata)
+                        f["stored"] += 1
+                    check(key)
+            elif kind == "worker_done":
+                workers_left -= 1
+            if len(rows) >= self.write_batch or len(ready) >= self.write_batch:
+                flush()
+        flush()
+
+    @staticmethod
+    def _join(threads: Sequence[threading.Thread]):
+        for t in threads:
+            while t.is_alive():
+                t.join(timeout=0.5)
+
+    def run(self, jobs: Iterable[FileJob], on_file_done: Callable[[FileJob, int, List[Tuple[Chunk, Optional[str]]]], None], *, total: Optional[int] = None,
+            desc: str = "Indexing files") -> int:
+        """Index every job; returns the number of chunks stored."""
+        chunk_q: "queue.Queue" = queue.Queue(maxsize=self.queue_depth)
+        batch_q: "queue.Queue" = queue.Queue(maxsize=self.queue_depth)
+        write_q: "queue.Queue" = queue.Queue(maxsize=self.queue_depth * 4)
+        self.stored = 0
+        pool = ParsePool(self.parse_workers, self.chunk_opts, timeout=self.parse_timeout, mem_mb=self.parse_mem_mb,
+                         chunk_filter=self.indexer.chunk_filter is not None)
+        pool.start()
+        with contextlib.closing(pool), tqdm(total=total, desc=desc, unit="file") as bar:
+            threads = [
+                self._stage(self._parse_stage, pool, jobs, chunk_q),
+                self._stage(self._batch_stage, chunk_q, batch_q, write_q),
+                *[self._stage(self._embed_stage, batch_q, write_q) for _ in range(self.indexer.workers)],
+                self._stage(self._write_stage, write_q, on_file_done, bar),
+            ]
+            try:
+                self._join(threads)
+            except KeyboardInterrupt:
+                if self._abort.is_set():
+                    raise
+                print("\n[WARN] Interrupted: finishing the files in flight, then committing (Ctrl-C again to stop now)",
+                      file=sys.stderr)
+                self._stop.set()
+                try:
+                    self._join(threads)
+                except KeyboardInterrupt:
+                    self._abort.set()
+                    raise
+                if not self._errors:
+                    raise
+        if self._errors:
+            raise self._errors[0]
+        return self.stored
+
 # ------------------------------
 # Retrieval + LLM answering
 # ------------------------------
 
-def format_context(results) -> Tuple[str, List[Dict]]:
-    docs = results.get("documents", [[]])[0]
-    metas = results.get("metadatas", [[]])[0]
+@dataclass
+class Hit:
+    id: str
+    text: str
+    metadata: Dict
+    score: float  # higher is better (1 - cosine distance for vector hits)
+
+
+def hits_from_results(results, row: int = 0) -> List[Hit]:
+    """Flatten one row of a Chroma query result into Hits."""
+    ids = (results.get("ids") or [[]])[row]
+    docs = (results.get("documents") or [[]])[row]
+    metas = (results.get("metadatas") or [[]])[row]
+    dists = (results.get("distances") or [[]])[row] or [None] * len(ids)
+    return [Hit(id=i, text=d or "", metadata=m or {}, score=(1.0 - dist) if dist is not None else 0.0)
+            for i, d, m, dist in zip(ids, docs, metas, dists)]
+
+
+class Reranker:
+    """Cross-encoder second stage: score (question, chunk) pairs jointly and keep the best few.
+
+    Runs locally through sentence-transformers (e.g. BAAI/bge-reranker-base, cross-encoder/ms-marco-MiniLM-L-6-v2),
+    on CUDA when available. One instance is shared by all collections in `serve`; predict() is serialised
+    because a single model on one GPU gains nothing from concurrent calls.
+    """
+
+    def __init__(self, model: str, batch_size: int = 32, max_chars: int = 2000, device: Optional[str] = None):
+        if not HAVE_SENTENCE_TRANSFORMERS:
+            raise RuntimeError("--rerank-model needs sentence-transformers: pip install sentence-transformers")
+        from sentence_transformers import CrossEncoder
+        if device is None:
+            try:
+                import torch
+                device = "cuda" if torch.cuda.is_available() else "cpu"
+            except Exception:
+                device = "cpu"
+        self.model_name = model
+        self.device = device
+        self.batch_size = max(1, batch_size)
+        self.max_chars = max_chars  # the model truncates to its max length anyway; don't tokenize what it drops
+        self.model = CrossEncoder(model, device=device)
+        self._lock = threading.Lock()
+
+    def rerank(self, question: str, hits: Sequence[Hit], top_k: int) -> List[Hit]:
+        if len(hits) <= 1:
+            return list(hits)[:top_k]
+        pairs = [(question, h.text[: self.max_chars]) for h in hits]
+        with self._lock:
+            scores = self.model.predict(pairs, batch_size=self.batch_size, show_progress_bar=False)
+        ranked = sorted(zip(hits, scores), key=lambda x: float(x[1]), reverse=True)[:top_k]
+        return [dataclasses.replace(h, score=float(sc)) for h, sc in ranked]
+
+
+def approx_tokens(text: str) -> int:
+    """Cheap token estimate (~3 chars/token for code-heavy text); errs on the side of a smaller prompt."""
+    return len(text) // 3 + 1
+
+
+def source_label(m: Dict) -> str:
+    page = m.get("page")
+    lines = f" L{m['start_line']}-{m['end_line']}" if m.get("start_line") else ""
+    return f"{m.get('filename', '?')}{f' p.{page}' if page else ''}{lines}"
+
+
+def _shingles(text: str, n: int = 5) -> set:
+    words = text.split()
+    return {" ".join(words[i : i + n]) for i in range(max(1, len(words) - n + 1))}
+
+
+def _merge_texts(a: str, b: str) -> Optional[str]:
+    """Join two chunks of the same file if b continues or overlaps a (longest suffix of a == prefix of b)."""
+    al, bl = a.splitlines(), b.splitlines()
+    for k in range(min(len(al), len(bl)), 0, -1):
+        if al[-k:] == bl[:k]:
+            return "\n".join(al + bl[k:])
+    return None
+
+
+def pack_context(hits: Sequence[Hit], token_budget: Optional[int] = None, near_dup: float = 0.85) -> List[Hit]:
+    """Turn ranked hits into the blocks we actually send:
+    1. chunks of the same file (and page) whose line ranges overlap or touch are merged into one block,
+       placed at the rank of its best member;
+    2. blocks that are near-duplicates (5-word shingle Jaccard >= near_dup) of a better-ranked block are dropped;
+    3. blocks are added best-first until `token_budget` is spent; the first block that doesn't fit is cut
+       at a line boundary, the rest are dropped.
+    """
+    groups: Dict[Tuple, List[int]] = {}
+    for rank, h in enumerate(hits):
+        m = h.metadata
+        groups.setdefault((m.get("source_path"), m.get("page"), m.get("entry_index")), []).append(rank)
+
+    merged: List[Tuple[int, Hit]] = []
+    for ranks in groups.values():
+        ordered = sorted(ranks, key=lambda r: (hits[r].metadata.get("start_line") or 0, r))
+        cur_rank, cur = ordered[0], hits[ordered[0]]
+        for r in ordered[1:]:
+            h = hits[r]
+            cm, hm = cur.metadata, h.metadata
+            joined = None
+            if cm.get("start_line") and hm.get("start_line") and hm["start_line"] <= cm["end_line"] + 1:
+                if hm["end_line"] <= cm["end_line"]:
+                    joined = cur.text  # fully inside the current block
+                else:
+                    joined = _merge_texts(cur.text, h.text)
+                    if joined is None and hm["start_line"] == cm["end_line"] + 1:
+                        joined = cur.text + "\n" + h.text
+            elif not cm.get("start_line"):
+                joined = _merge_texts(cur.text, h.text)
+            if joined is None:
+                merged.append((cur_rank, cur))
+                cur_rank, cur = r, h
+                continue
+            meta = dict(cm)
+            if hm.get("end_line"):
+                meta["end_line"] = max(cm.get("end_line") or 0, hm["end_line"])
+            cur = dataclasses.replace(cur, text=joined, metadata=meta, score=max(cur.score, h.score))
+            cur_rank = min(cur_rank, r)
+        merged.append((cur_rank, cur))
+    merged.sort(key=lambda x: x[0])
+
+    kept: List[Hit] = []
+    kept_sh: List[set] = []
+    for _, h in merged:
+        sh = _shingles(h.text)
+        if any(h.text in k.text or len(sh & ks) / (len(sh | ks) or 1) >= near_dup for k, ks in zip(kept, kept_sh)):
+            continue
+        kept.append(h)
+        kept_sh.append(sh)
+
+    if token_budget is None:
+        return kept
+    out: List[Hit] = []
+    left = token_budget
+    for h in kept:
+        cost = approx_tokens(h.text) + 24  # label + separators
+        if cost <= left:
+            out.append(h)
+            left -= cost
+            continue
+        if left > 128:
+            lines, acc = [], 0
+            for ln in h.text.splitlines():
+                acc += approx_tokens(ln + "\n")
+                if acc > left - 32:
+                    break
+                lines.append(ln)
+            if lines:
+                meta = dict(h.metadata)
+                if meta.get("start_line"):
+                    meta["end_line"] = meta["start_line"] + len(lines) - 1
+                out.append(dataclasses.replace(h, text="\n".join(lines) + "\n…[truncated]", metadata=meta))
+        break
+    return out
+
+
+def format_context(hits: Sequence[Hit], token_budget: Optional[int] = None) -> Tuple[str, List[Dict]]:
     blocks: List[str] = []
-    for i, (d, m) in enumerate(zip(docs, metas), start=1):
-        src = m.get("filename", "?")
-        page = m.get("page")
-        path = m.get("source_path", "")
-        label = f"[{i}] {src}{f' p.{page}' if page else ''} — {path}"
-        blocks.append(f"{label}\n---\n{d}\n")
-    return "\n\n".join(blocks), metas
+    packed = pack_context(hits, token_budget)
+    for i, h in enumerate(packed, start=1):
+        label = f"[{i}] {source_label(h.metadata)} — {h.metadata.get('source_path', '')}"
+        blocks.append(f"{label}\n---\n{h.text}\n")
+    return "\n\n".join(blocks), [h.metadata for h in packed]
 
 
-def answer_question(db_path: str, collection: str, question: str, llm_model: str, embed_model: str, ollama_url: str, top_k: int) -> Tuple[str, List[Dict]]:
-    store = ChromaStore(db_path=db_path, collection=collection, reset=False)
-    ollama = OllamaClient(base_url=ollama_url, timeout=240)
+ANSWER_SYSTEM_PROMPT = (
+    "You are a codebase assistant. Use ONLY the provided context blocks to answer. "
+    "Cite sources inline using [n] where n is the context block index. If the answer is not in the context, say you don't know."
+)
 
-    try:
-        q_emb = ollama.embed(embed_model, question)
-        results = store.query(query_embedding=q_emb, n_results=top_k)
-    except Exception:
-        results = store.query(query_text=question, n_results=top_k)
 
-    ctx, metas = format_context(results)
-    system = (
-        "You are a codebase assistant. Use ONLY the provided context blocks to answer. "
-        "Cite sources inline using [n] where n is the context block index. If the answer is not in the context, say you don't know."
-    )
+def build_answer_messages(question: str, ctx: str) -> List[Dict]:
     user = (
         f"QUESTION:\n{question}\n\nCONTEXT BLOCKS:\n{ctx}\n\n"
         "Instructions:\n- Be concise.\n- Use bullet points when listing APIs or steps.\n- Include citations like [1], [2], etc.\n"
     )
-    messages = [{"role": "system", "content": system}, {"role": "user", "content": user}]
-    answer = ollama.chat(model=llm_model, messages=messages)
-    return answer, metas
+    return [{"role": "system", "content": ANSWER_SYSTEM_PROMPT}, {"role": "user", "content": user}]
+
+
+class QueryService:
+    """Retrieval + answering over one collection, holding the Chroma handle and Ollama client between calls.
+
+    `query` builds one per process; `serve` keeps them resident so each question skips process start-up,
+    the HNSW load and (with keep_alive) the Ollama model load.
+    """
+
+    def __init__(self, db_path: str, collection: str, *, llm_model: str, embed_model: str,
+                 ollama: Optional[OllamaClient] = None, ollama_url: str = "http://localhost:11434",
+                 connect_timeout: float = 5.0, read_timeout: Optional[float] = None, retrieval: str = "hybrid",
+                 ctx_tokens: int = 3000, num_ctx: Optional[int] = None, embed_cache: bool = True,
+                 answer_cache: bool = False, answer_cache_sim: float = 0.97,
+                 reranker: Optional[Reranker] = None, rerank_candidates: int = 50, store: Optional[VectorStore] = None):
+        self.db_path = db_path
+        self.collection = collection
+        self.store = store or open_store(db_path, collection)
+        self.keywords = KeywordIndex.open(db_path, collection) if retrieval != "vector" else None
+        self._manifest: Optional[Manifest] = None
+        self.retrieval = retrieval if self.keywords else "vector"
+        self.ollama = ollama or OllamaClient(base_url=ollama_url, timeout=read_timeout or 240, connect_timeout=connect_timeout, pool_size=2,
+                                             priority="interactive")
+        self.llm_model = llm_model
+        self.embed_model = embed_model
+        self.ctx_tokens = ctx_tokens
+        self.num_ctx = num_ctx
+        self.embed_cache = EmbeddingCache(Path(db_path) / "_state" / "embed_cache.sqlite") if embed_cache else None
+        self.answers = AnswerCache(AnswerCache.path_for(db_path, collection)) if answer_cache else None
+        self.answer_cache_sim = answer_cache_sim
+        self.reranker = reranker
+        self.rerank_candidates = rerank_candidates
+        self._qvecs: "OrderedDict[str, List[float]]" = OrderedDict()
+        self._qvecs_lock = threading.Lock()
+        self._store_dim: Optional[int] = None
+        self._warned_no_rescore = False
+
+    ANSWER_RESERVE_TOKENS = 1024
+    QUERY_LRU_SIZE = 1024
+    RESCORE_FACTOR = 4  # truncated collections: ANN over-fetch before rescoring at full width
+    FILTER_FACTOR = 4  # over-fetch for filter parts matched after retrieval
+
+    def _context_budget(self, question: str) -> int:
+        """--ctx-tokens, but never more than the model window minus the prompt scaffolding and room to answer."""
+        budget = self.ctx_tokens
+        if self.num_ctx:
+            overhead = approx_tokens(ANSWER_SYSTEM_PROMPT + question) + 64
+            budget = min(budget, self.num_ctx - self.ANSWER_RESERVE_TOKENS - overhead)
+        return max(256, budget)
+
+    def _chat_options(self) -> Optional[Dict]:
+        return {"num_ctx": self.num_ctx} if self.num_ctx else None
+
+    def warm_up(self):
+        """Load the embed and chat models now (Ollama loads a model on an empty chat request)."""
+        self.ollama.embed_batch(self.embed_model, ["warm-up"])
+        self.ollama.chat(model=self.llm_model, messages=[], options=self._chat_options())
+
+    def embed_query(self, question: str) -> List[float]:
+        """Question embedding via an in-process LRU, then the shared on-disk embedding cache, then Ollama."""
+        key = EmbeddingCache.key(self.embed_model, question)
+        with self._qvecs_lock:
+            vec = self._qvecs.get(key)
+            if vec is not None:
+                self._qvecs.move_to_end(key)
+                return vec
+        vec = self.embed_cache.get_many([key]).get(key) if self.embed_cache else None
+        if vec is None:
+            with METRICS.timer("rag_query_seconds", stage="embed"):
+                vec = self.ollama.embed_batch(self.embed_model, [question])[0]
+            if self.embed_cache:
+                self.embed_cache.put_many({key: vec})
+        self._remember_qvecs({key: vec})
+        return vec
+
+    def embed_queries(self, questions: Sequence[str], batch: int = 64):
+        """Embed many questions with batched calls and keep them in the LRU, so the searches that follow
+        don't embed one at a time (query-batch). Questions answered from the keyword index alone are skipped."""
+        if self.retrieval == "keyword":
+            return
+        texts = {EmbeddingCache.key(self.embed_model, q): q for q in questions
+                 if not (self.retrieval == "hybrid" and looks_like_symbol(q))}
+        with self._qvecs_lock:
+            missing = [k for k in texts if k not in self._qvecs]
+        found = self.embed_cache.get_many(missing) if self.embed_cache and missing else {}
+        todo = [k for k in missing if k not in found]
+        for i in range(0, len(todo), batch):
+            part = todo[i : i + batch]
+            with METRICS.timer("rag_query_seconds", stage="embed"):
+                vecs = self.ollama.embed_batch(self.embed_model, [texts[k] for k in part])
+            fresh = dict(zip(part, vecs))
+            if self.embed_cache:
+                self.embed_cache.put_many(fresh)
+            found.update(fresh)
+        self._remember_qvecs(found)
+
+    def _remember_qvecs(self, vecs: Dict[str, List[float]]):
+        with self._qvecs_lock:
+            for key, vec in vecs.items():
+                self._qvecs[key] = vec
+                self._qvecs.move_to_end(key)
+            while len(self._qvecs) > self.QUERY_LRU_SIZE:
+                self._qvecs.popitem(last=False)
+
+    def _vector_hits(self, question: str, n: int, where: Optional[SearchFilter] = None) -> List[Hit]:
+        post = where is not None and not where.pushed_down
+        k = n * self.FILTER_FACTOR if post else n
+        try:
+            q_emb = self.embed_query(question)
+            if self._store_dim is None:
+                self._store_dim = self.store.dim()
+            if self._store_dim and self._store_dim < len(q_emb):
+                # Collection ingested with --embed-dim: search at its width, then rescore at full width from the cache.
+                hits = self.store.query(query_embedding=fit_dim(q_emb, self._store_dim), n_results=k * self.RESCORE_FACTOR,
+                                        where=where)
+                hits = self._rescore(q_emb, hits, len(hits))
+            else:
+                hits = self.store.query(query_embedding=q_emb, n_results=k, where=where)
+        except Exception as e:
+            if not self.store.text_query:
+                # Qdrant can't embed the question itself: hybrid still has its BM25 half, vector-only falls back to it.
+                print(f"[WARN] Query embedding failed ({e}); using keyword retrieval only", file=sys.stderr)
+                if self.retrieval == "hybrid":
+                    return []
+                if self.keywords is None:
+                    self.keywords = KeywordIndex.open(self.db_path, self.collection)
+                return self._keyword_hits(question, n, where)
+            hits = self.store.query(query_text=question, n_results=k, where=where)
+        return [h for h in hits if where.matches(h.metadata)][:n] if post else hits[:n]
+
+    def _rescore(self, q_emb: Sequence[float], hits: List[Hit], n: int) -> List[Hit]:
+        """Re-rank truncated-ANN candidates by cosine against their full-width vectors in the embedding cache
+        (candidates missing from the cache keep their ANN score)."""
+        if self.embed_cache is None:
+            if not self._warned_no_rescore:
+                self._warned_no_rescore = True
+                print(f"[WARN] {self.collection} holds truncated vectors but --no-embed-cache is set; "
+                      "ranking on the truncated ANN scores only", file=sys.stderr)
+            return hits[:n]
+        if not hits:
+            return hits[:n]
+        full = self.embed_cache.get_many([EmbeddingCache.key(self.embed_model, h.text) for h in hits])
+        rescored = []
+        for h in hits:
+            vec = full.get(EmbeddingCache.key(self.embed_model, h.text))
+            rescored.append(dataclasses.replace(h, score=_cosine(q_emb, vec)) if vec is not None else h)
+        return sorted(rescored, key=lambda h: -h.score)[:n]
+
+    def _keyword_hits(self, question: str, n: int, where: Optional[SearchFilter] = None) -> List[Hit]:
+        # The keyword index filters by path and extension itself; repo and page are checked on the stored metadata.
+        post = where is not None and bool(where.repos or where.pages)
+        ranked = self.keywords.search(question, n * self.FILTER_FACTOR if post else n, where) if self.keywords else []
+        scores = dict(ranked)
+        hits = [dataclasses.replace(h, score=scores[h.id]) for h in self.store.get_hits([cid for cid, _ in ranked])]
+        return [h for h in hits if where.matches(h.metadata)][:n] if post else hits
+
+    def resolve_filter(self, where: Optional[SearchFilter]) -> Optional[SearchFilter]:
+        """Resolve a path prefix to its indexed files (manifest range scan) so the stores can filter on source_path."""
+        if where is None or not where.path_prefix or where.paths is not None:
+            return where
+        if self._manifest is None:
+            self._manifest = Manifest.open(self.db_path, self.collection)
+        paths = self._manifest.paths_with_prefix(where.path_prefix, SearchFilter.PUSHDOWN_MAX_PATHS)
+        return where if paths is None else dataclasses.replace(where, paths=tuple(paths))
+
+    def search(self, question: str, top_k: int, where: Optional[SearchFilter] = None) -> List[Hit]:
+        """With a reranker, over-fetch `rerank_candidates` first-stage hits and let the cross-encoder pick top_k.
+        `where` restricts retrieval to matching chunks (see SearchFilter)."""
+        n = top_k if self.reranker is None else max(top_k, self.rerank_candidates)
+        where = self.resolve_filter(where)
+        if where is not None and where.paths == ():
+            return []  # nothing indexed under the prefix
+        with METRICS.timer("rag_query_seconds", stage="retrieve"):
+            hits = self._first_stage(question, n, where)
+        if self.reranker is None:
+            return hits
+        with METRICS.timer("rag_query_seconds", stage="rerank"):
+            return self.reranker.rerank(question, hits, top_k)
+
+    def _first_stage(self, question: str, top_k: int, where: Optional[SearchFilter] = None) -> List[Hit]:
+        """Hybrid retrieval: exact symbols are answered from the keyword index alone (no embedding call);
+        otherwise ANN and BM25 candidates are fused with RRF."""
+        if self.retrieval == "vector":
+            return self._vector_hits(question, top_k, where)
+        if self.retrieval == "keyword" or looks_like_symbol(question):
+            hits = self._keyword_hits(question, top_k, where)
+            if hits or self.retrieval == "keyword":
+                return hits
+        n = max(top_k * 3, 20)
+        return rrf_fuse([self._vector_hits(question, n, where), self._keyword_hits(question, n, where)], top_k)
+
+    def _cached_answer(self, question: str, hits: Sequence[Hit]) -> Optional[Tuple[str, List[Dict]]]:
+        if not self.answers or not hits:
+            return None
+        return self.answers.lookup(self.llm_model, question, self._cached_qvec(question), [h.id for h in hits], self.answer_cache_sim)
+
+    def _cached_qvec(self, question: str) -> Optional[List[float]]:
+        # Symbol lookups never embed the question; those entries match on the exact (normalised) text only.
+        with self._qvecs_lock:
+            return self._qvecs.get(EmbeddingCache.key(self.embed_model, question))
+
+    def _remember_answer(self, question: str, hits: Sequence[Hit], answer: str, metas: List[Dict]):
+        if self.answers and hits and answer.strip():
+            self.answers.put(self.llm_model, question, self._cached_qvec(question), [h.id for h in hits], answer, metas)
+
+    def answer(self, question: str, top_k: int, timings: Optional["AnswerTimings"] = None,
+               where: Optional[SearchFilter] = None) -> Tuple[str, List[Dict]]:
+        t = timings or AnswerTimings()
+        t0 = time.perf_counter()
+        hits = self.search(question, top_k, where)
+        t.retrieve_s = time.perf_counter() - t0
+        cached = self._cached_answer(question, hits)
+        if cached:
+            t.cached = True
+            t.total_s = time.perf_counter() - t0
+            METRICS.inc("rag_queries_total", kind="cached")
+            return cached
+        ctx, metas = format_context(hits, self._context_budget(question))
+        answer = self.ollama.chat(model=self.llm_model, messages=build_answer_messages(question, ctx), options=self._chat_options())
+        t.total_s = time.perf_counter() - t0
+        t.generate_s = t.total_s - t.retrieve_s
+        t.record()
+        self._remember_answer(question, hits, answer, metas)
+        return answer, metas
+
+    def answer_stream(self, question: str, top_k: int, timings: Optional["AnswerTimings"] = None,
+                      where: Optional[SearchFilter] = None) -> Tuple[Iterator[str], List[Dict]]:
+        """Retrieve now, then return (token iterator, sources). Timings are filled in as the iterator is consumed."""
+        t = timings or AnswerTimings()
+        t0 = time.perf_counter()
+        hits = self.search(question, top_k, where)
+        t.retrieve_s = time.perf_counter() - t0
+        cached = self._cached_answer(question, hits)
+        if cached:
+            t.cached = True
+            t.total_s = time.perf_counter() - t0
+            METRICS.inc("rag_queries_total", kind="cached")
+            return iter([cached[0]]), cached[1]
+        ctx, metas = format_context(hits, self._context_budget(question))
+        messages = build_answer_messages(question, ctx)
+
+        def tokens() -> Iterator[str]:
+            g0 = time.perf_counter()
+            parts: List[str] = []
+            for obj in self.ollama.chat_stream(model=self.llm_model, messages=messages, options=self._chat_options()):
+                piece = obj.get("message", {}).get("content", "")
+                if piece and t.ttft_s is None:
+                    t.ttft_s = time.perf_counter() - g0
+                if obj.get("done"):
+                    t.tokens = obj.get("eval_count", 0)
+                if piece:
+                    parts.append(piece)
+                    yield piece
+            t.generate_s = time.perf_counter() - g0
+            t.total_s = time.perf_counter() - t0
+            t.record()
+            self._remember_answer(question, hits, "".join(parts), metas)
+
+        return tokens(), metas
+
+
+@dataclass
+class AnswerTimings:
+    retrieve_s: float = 0.0
+    ttft_s: Optional[float] = None  # time to first token, measured from the start of generation (streaming only)
+    generate_s: float = 0.0
+    total_s: float = 0.0
+    tokens: int = 0
+    cached: bool = False  # served from the answer cache
+
+    def record(self):
+        """Add a generated (not cached) answer to the query metrics."""
+        METRICS.inc("rag_queries_total", kind="answer")
+        METRICS.observe("rag_query_seconds", self.generate_s, stage="generate")
+        METRICS.observe("rag_query_seconds", self.total_s, stage="total")
+        if self.ttft_s is not None:
+            METRICS.observe("rag_query_seconds", self.ttft_s, stage="ttft")
+
+    def summary(self) -> str:
+        if self.cached:
+            return f"retrieve={self.retrieve_s:.3f}s total={self.total_s:.3f}s (cached answer)"
+        ttft = f" ttft={self.ttft_s:.2f}s" if self.ttft_s is not None else ""
+        toks = f" tokens={self.tokens}" if self.tokens else ""
+        return f"retrieve={self.retrieve_s:.2f}s{ttft} generate={self.generate_s:.2f}s total={self.total_s:.2f}s{toks}"
+
+
+def answer_question(db_path: str, collection: str, question: str, llm_model: str, embed_model: str, ollama_url: str, top_k: int,
+                    connect_timeout: float = 5.0, read_timeout: Optional[float] = None,
+                    where: Optional[SearchFilter] = None) -> Tuple[str, List[Dict]]:
+    svc = QueryService(db_path, collection, llm_model=llm_model, embed_model=embed_model, ollama_url=ollama_url,
+                       connect_timeout=connect_timeout, read_timeout=read_timeout)
+    return svc.answer(question, top_k, where=where)
+
+# ------------------------------
+# Query daemon (serve)
+# ------------------------------
+
+class QueryServer:
+    """Local HTTP front end over resident QueryServices (one per collection, created on first use).
+
+        GET  /health                       -> {"ok": true, "collections": {...: vector_count}, "ollama": [endpoint status]}
+        GET  /metrics, /metrics.json       -> Prometheus text / JSON summary of METRICS
+        POST /search {"question", "top_k"?, "collection"?, "filter"?}  -> {"hits": [...]}
+        POST /query  {"question", "top_k"?, "collection"?, "filter"?}  -> {"answer", "sources", "timings"}
+        POST /query  {..., "stream": true} -> NDJSON: {"sources"}, then {"token"}..., then {"done": true, "timings"}
+
+    "filter" is {"path_prefix"?, "ext"?, "repo"?, "pages"?} (see SearchFilter), e.g. {"repo": "net", "ext": [".h"]}.
+    """
+
+    def __init__(self, args):
+        self.args = args
+        self.ollama = OllamaClient(base_url=args.ollama_url, timeout=args.read_timeout or 240, connect_timeout=args.connect_timeout,
+                                   pool_size=max(4, args.workers), keep_alive=args.keep_alive, priority="interactive")
+        self.reranker = _reranker_from_args(args)
+        self._services: Dict[str, QueryService] = {}
+        self._lock = threading.Lock()
+
+    def service(self, collection: Optional[str]) -> QueryService:
+        name = collection or self.args.collection
+        if not name:
+            raise ValueError("no collection given (set --collection or pass \"collection\")")
+        with self._lock:
+            svc = self._services.get(name)
+            if svc is None:
+                svc = QueryService(self.args.db, name, llm_model=self.args.llm, embed_model=self.args.embed_model, ollama=self.ollama,
+                                   retrieval=self.args.retrieval, ctx_tokens=self.args.ctx_tokens, num_ctx=self.args.num_ctx,
+                                   embed_cache=not self.args.no_embed_cache, answer_cache=self.args.answer_cache,
+                                   answer_cache_sim=self.args.answer_cache_sim, reranker=self.reranker,
+                                   rerank_candidates=self.args.rerank_candidates, store=_store_from_args(self.args, name))
+                self._services[name] = svc
+            return svc
+
+    def handle(self, path: str, body: Dict) -> Dict:
+        if path == "/health":
+            with self._lock:
+                return {"ok": True, "collections": {k: v.store.count() for k, v in self._services.items()},
+                        "ollama": self.ollama.endpoint_status()}
+        if path == "/metrics.json":
+            return METRICS.snapshot()
+        question = body.get("question") or body.get("query")
+        if not question:
+            raise ValueError("missing \"question\"")
+        svc = self.service(body.get("collection"))
+        top_k = int(body.get("top_k") or self.args.top_k)
+        where = SearchFilter.from_request(body)
+        t0 = time.perf_counter()
+        if path == "/search":
+            hits = svc.search(question, top_k, where)
+            METRICS.inc("rag_queries_total", kind="search")
+            return {"hits": [dataclasses.asdict(h) for h in hits], "timings": {"total_s": time.perf_counter() - t0}}
+        if path == "/query":
+            timings = AnswerTimings()
+            answer, metas = svc.answer(question, top_k, timings, where)
+            return {"answer": answer, "sources": metas, "timings": dataclasses.asdict(timings)}
+        raise KeyError(path)
+
+    def stream_query(self, body: Dict) -> Iterator[Dict]:
+        question = body.get("question") or body.get("query")
+        if not question:
+            raise ValueError("missing \"question\"")
+        svc = self.service(body.get("collection"))
+        timings = AnswerTimings()
+        tokens, metas = svc.answer_stream(question, int(body.get("top_k") or self.args.top_k), timings,
+                                          SearchFilter.from_request(body))
+        yield {"sources": metas}
+        for piece in tokens:
+            yield {"token": piece}
+        yield {"done": True, "timings": dataclasses.asdict(timings)}
+
+    def make_handler(self):
+        server = self
+
+        class Handler(BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def _send(self, code: int, obj: Dict):
+                data = json.dumps(obj).encode()
+                self.send_response(code)
+                self.send_header("Content-Type", "application/json")
+                self.send_header("Content-Length", str(len(data)))
+                self.end_headers()
+                self.wfile.write(data)
+
+            def _chunk(self, ev: Dict):
+                data = json.dumps(ev).encode() + b"\n"
+                self.wfile.write(f"{len(data):X}\r\n".encode() + data + b"\r\n")
+                self.wfile.flush()
+
+            def _stream(self, events: Iterator[Dict]):
+                first = next(events)  # retrieval errors surface here, before any headers go out
+                self.send_response(200)
+                self.send_header("Content-Type", "application/x-ndjson")
+                self.send_header("Transfer-Encoding", "chunked")
+                self.end_headers()
+                # From here on the status is sent: failures become a final NDJSON event, never a second response.
+                try:
+                    for ev in itertools.chain([first], events):
+                        self._chunk(ev)
+                except (BrokenPipeError, ConnectionResetError):
+                    self.close_connection = True  # the client went away
+                    return
+                except Exception as e:
+                    try:
+                        self._chunk({"error": f"{type(e).__name__}: {e}", "done": True})
+                    except OSError:
+                        self.close_connection = True
+                        return
+                try:
+                    self.wfile.write(b"0\r\n\r\n")
+                except OSError:
+                    self.close_connection = True
+
+            def _dispatch(self, body: Dict):
+                try:
+                    if body.get("stream") and self.path.split("?", 1)[0] == "/query":
+                        return self._stream(server.stream_query(body))
+                    self._send(200, server.handle(self.path.split("?", 1)[0], body))
+                except KeyError:
+                    self._send(404, {"error": f"unknown endpoint {self.path}"})
+                except ValueError as e:
+                    self._send(400, {"error": str(e)})
+                except Exception as e:
+                    self._send(500, {"error": f"{type(e).__name__}: {e}"})
+
+            def do_GET(self):
+                if self.path.split("?", 1)[0] == "/metrics":
+                    data = METRICS.prometheus().encode()
+                    self.send_response(200)
+                    self.send_header("Content-Type", "text/plain; version=0.0.4")
+                    self.send_header("Content-Length", str(len(data)))
+                    self.end_headers()
+                    self.wfile.write(data)
+                    return
+                self._dispatch({})
+
+            def do_POST(self):
+                n = int(self.headers.get("Content-Length") or 0)
+                try:
+                    body = json.loads(self.rfile.read(n) or b"{}")
+                except json.JSONDecodeError:
+                    return self._send(400, {"error": "body must be JSON"})
+                self._dispatch(body)
+
+            def log_message(self, fmt, *a):
+                pass
+
+        return Handler
+
+# ------------------------------
+# LLM request queue (llm-queue)
+# ------------------------------
+
+class LLMScheduler:
+    """Admission control for one GPU box: per-model concurrency limits plus two priority classes.
+
+    Waiters are admitted in (priority, arrival) order, per model, so a saturated model doesn't hold up
+    another one. While an interactive request for a model is waiting, no batch request for that model is
+    admitted ("preemption" at request boundaries: running batch requests finish, queued ones wait; with
+    `max_total` this applies across models), and `interactive_reserve` slots per
+    model are never given to batch work, so a query never queues behind a full ingest.
+    """
+
+    def __init__(self, default_limit: int = 2, limits: Optional[Dict[str, int]] = None, interactive_reserve: int = 1,
+                 max_total: int = 0):
+        self.default_limit = max(1, default_limit)
+        self.limits = dict(limits or {})
+        self.interactive_reserve = max(0, interactive_reserve)
+        self.max_total = max(0, max_total)  # 0 = no cap across models
+        self._cond = threading.Condition()
+        self._running: Dict[str, int] = {}
+        self._total = 0
+        self._waiting: List[Tuple[int, int, str]] = []  # (priority rank, seq, model), sorted
+        self._seq = itertools.count()
+        self.admitted = {p: 0 for p in PRIORITIES}
+        self.wait_s = {p: 0.0 for p in PRIORITIES}
+
+    def limit(self, model: str) -> int:
+        return max(1, self.limits.get(model, self.limits.get(model.split(":", 1)[0], self.default_limit)))
+
+    def _can_run(self, ticket: Tuple[int, int, str]) -> bool:
+        rank, _, model = ticket
+        cap = self.limit(model)
+        if rank > 0:
+            # Interactive waiters only compete with batch work for the same model, unless a global cap is
+            # set: then every admitted batch request takes a slot an interactive one could have used.
+            if any(w[0] == 0 and (w[2] == model or self.max_total) for w in self._waiting):
+                return False
+            cap = max(1, cap - self.interactive_reserve) if cap > 1 else cap
+        if self._running.get(model, 0) >= cap:
+            return False
+        if self.max_total and self._total >= (self.max_total if rank == 0 else max(1, self.max_total - self.interactive_reserve)):
+            return False
+        return not any(w < ticket and w[2] == model for w in self._waiting)
+
+    @contextlib.contextmanager
+    def slot(self, model: str, priority: str):
+        rank = PRIORITIES.index(priority) if priority in PRIORITIES else 0
+        ticket = (rank, next(self._seq), model)
+        t0 = time.monotonic()
+        with self._cond:
+            bisect.insort(self._waiting, ticket)
+            try:
+                while not self._can_run(ticket):
+                    self._cond.wait()
+            finally:
+                self._waiting.remove(ticket)
+            self._running[model] = self._running.get(model, 0) + 1
+            self._total += 1
+            self.admitted[PRIORITIES[rank]] += 1
+            self.wait_s[PRIORITIES[rank]] += time.monotonic() - t0
+            self._cond.notify_all()  # a later waiter for another model may be admissible now
+        try:
+            yield
+        finally:
+            with self._cond:
+                self._running[model] -= 1
+                self._total -= 1
+                self._cond.notify_all()
+
+    def stats(self) -> Dict:
+        with self._cond:
+            return {
+                "running": {m: n for m, n in self._running.items() if n},
+                "waiting": {p: sum(1 for w in self._waiting if w[0] == i) for i, p in enumerate(PRIORITIES)},
+                "admitted": dict(self.admitted),
+                "avg_wait_s": {p: (self.wait_s[p] / self.admitted[p]) if self.admitted[p] else 0.0 for p in PRIORITIES},
+            }
+
+
+class LLMQueueProxy:
+    """Ollama-compatible HTTP proxy that runs every model call through an LLMScheduler.
+
+    Point `--ollama-url` of ingest/serve/query at it. Requests carry X-Rag-Priority (the Indexer sends
+    "batch", query/serve send "interactive"; untagged requests count as interactive). Model calls are
+    forwarded to the upstream endpoint pool (`--ollama-url` of the proxy itself, with the usual failover);
+    streamed responses are passed through line by line. GET /rag/queue reports scheduler state; other GETs
+    (/api/tags, /api/version, ...) go straight upstream.
+    """
+
+    STREAMING_DEFAULT = ("/api/chat", "/api/generate")  # Ollama streams these unless "stream": false
+
+    def __init__(self, upstream: OllamaClient, scheduler: LLMScheduler):
+        self.upstream = upstream
+        self.scheduler = scheduler
+
+    def make_handler(self):
+        proxy = self
+
+        class Handler(BaseHTTPRequestHandler):
+            protocol_version = "HTTP/1.1"
+
+            def _send(self, code: int, data: bytes, ctype: str = "application/json"):
+                self.send_response(code)
+                self.send_header("Content-Type", ctype)
+                self.send_header("Content-Length", str(len(data)))
+                self.end_headers()
+                self.wfile.write(data)
+
+            def _relay(self, method: str, body: Optional[Dict], stream: bool):
+                with proxy.upstream._call(self.path, body, method=method, stream=stream) as (_, r):
+                    ctype = r.headers.get("Content-Type", "application/json")
+                    if not stream or r.status_code != 200:
+                        return self._send(r.status_code, r.content, ctype)
+                    self.send_response(200)
+                    self.send_header("Content-Type", ctype)
+                    self.send_header("Transfer-Encoding", "chunked")
+                    self.end_headers()
+                    self._chunked = True
+                    for line in r.iter_lines():
+                        if line:
+                            self._chunk(line + b"\n")
+                    self.wfile.write(b"0\r\n\r\n")
+
+            def _chunk(self, data: bytes):
+                self.wfile.write(f"{len(data):X}\r\n".encode() + data + b"\r\n")
+                self.wfile.flush()
+
+            def _guard(self, fn):
+                self._chunked = False  # set once _relay has sent a streaming 200
+                try:
+                    fn()
+                except (BrokenPipeError, ConnectionResetError):
+                    self.close_connection = True  # client went away mid-stream; the slot is released by the context managers
+                except Exception as e:
+                    err = json.dumps({"error": f"llm-queue: {type(e).__name__}: {e}"}).encode()
+                    if not self._chunked:
+                        return self._send(502, err)
+                    # Mid-stream: end the body the way Ollama reports stream errors (an {"error"} line).
+                    try:
+                        self._chunk(err + b"\n")
+                        self.wfile.write(b"0\r\n\r\n")
+                    except OSError:
+                        self.close_connection = True
+
+            def do_GET(self):
+                if self.path.split("?", 1)[0] == "/rag/queue":
+                    return self._send(200, json.dumps(proxy.scheduler.stats()).encode())
+                self._guard(lambda: self._relay("GET", None, False))
+
+            def do_HEAD(self):
+                self._send(200, b"")
+
+            def do_POST(self):
+                n = int(self.headers.get("Content-Length") or 0)
+                try:
+                    body = json.loads(self.rfile.read(n) or b"{}")
+                except json.JSONDecodeError:
+                    return self._send(400, b'{"error": "body must be JSON"}')
+                path = self.path.split("?", 1)[0]
+                stream = bool(body.get("stream", path in LLMQueueProxy.STREAMING_DEFAULT))
+                model = str(body.get("model") or body.get("name") or "")
+                priority = (self.headers.get(PRIORITY_HEADER) or "interactive").strip().lower()
+
+                def run():
+                    if not model:
+                        return self._relay("POST", body, stream)
+                    with proxy.scheduler.slot(model, priority):
+                        self._relay("POST", body, stream)
+
+                self._guard(run)
+
+            def log_message(self, fmt, *a):
+                pass
+
+        return Handler
 
 # ------------------------------
 # CLI commands
 # ------------------------------
 
-def cmd_ingest(args):
-    root = Path(args.dir).resolve()
-    collection = args.collection or slugify(root.name)
-    manifest_path = Path(args.db) / "_state" / f"{collection}.manifest.json"
-    manifest = Manifest.load(manifest_path)
+def _store_from_args(args, collection: str) -> VectorStore:
+    return open_store(args.db, collection, backend=args.store, qdrant_url=args.qdrant_url, shard_by=args.shard_by,
+                      index_dtype=args.index_dtype, root=getattr(args, "dir", None), reset=getattr(args, "reset", False))
 
-    spec = build_ignore_spec(root, args.ignore or [])
-    exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
 
-    indexer = Indexer(
+def _qps_from_args(args) -> float:
+    """--qps, defaulting to 3/s; with --adaptive and no explicit --qps there is no rate cap (the controller
+    limits concurrency instead)."""
+    if args.qps is not None:
+        return args.qps
+    return 0.0 if args.adaptive else 3.0
+
+
+def _indexer_from_args(args, collection: str, manifest: Optional[Manifest] = None) -> Indexer:
+    """`manifest` lets the chunk filter remember which file keeps each license header across runs."""
+    return Indexer(
         db_path=args.db,
         collection=collection,
         ollama_url=args.ollama_url,
         embed_model=args.embed_model,
         workers=args.workers,
-        rate_limit_qps=args.qps,
+        rate_limit_qps=_qps_from_args(args),
+        batch_size=args.embed_batch,
+        batch_chars=args.embed_batch_chars,
+        burst=args.burst,
+        max_inflight=args.max_inflight,
+        connect_timeout=args.connect_timeout,
+        read_timeout=args.read_timeout,
+        embed_cache=not args.no_embed_cache,
+        embed_dim=args.embed_dim,
+        adaptive=args.adaptive,
+        chunk_filter=not args.no_filter,
+        manifest=manifest,
+        cache_dtype=args.cache_dtype,
+        store=_store_from_args(args, collection),
     )
 
-    if args.reset:
-        indexer.store = ChromaStore(db_path=args.db, collection=collection, reset=True)
 
-    paths = list(iter_supported_files(root, exts, spec))
-    print(f"[INFO] Found {len(paths)} candidate files")
+def _max_file_bytes(args) -> int:
+    return int(args.max_file_mb * (1 << 20)) if args.max_file_mb else 0
 
-    total_new = 0
-    for p in tqdm(paths, desc="Indexing files", unit="file"):
-        size, mtime = fast_sig(p)
-        rec = manifest.files.get(str(p))
-        need = (rec is None) or (rec.size != size or abs(rec.mtime - mtime) > 1e-6)
-        if not need:
-            continue
-        file_sha = sha1_file(p)
-        count = indexer.upsert_file(
-            p, file_sha,
-            code_chunk_lines=args.code_lines,
-            code_overlap=args.code_overlap,
-            doc_chars=args.doc_chars,
-            doc_overlap=args.doc_overlap,
-        )
-        manifest.files[str(p)] = FileRecord(path=str(p), size=size, mtime=mtime, sha1=file_sha, chunk_count=count)
-        total_new += count
 
-    manifest.save(manifest_path)
-    print(f"[OK] Ingest complete. Added/updated {total_new} chunks. DB: {args.db}, collection: {collection}")
+def _over_size_cap(path: Path, size: int, max_bytes: int) -> bool:
+    """--max-file-mb only applies to code/text: PDFs and other documents are parsed page by page and a big
+    scanned manual is exactly what should be indexed."""
+    return bool(max_bytes) and size > max_bytes and path.suffix.lower() not in AUX_EXTS
+
+
+def _chunk_opts(args) -> Dict:
+    return dict(
+        code_chunk_lines=args.code_lines,
+        code_overlap=args.code_overlap,
+        doc_chars=args.doc_chars,
+        doc_overlap=args.doc_overlap,
+        code_chunker=args.code_chunker,
+        max_chunks=args.max_file_chunks,
+    )
+
 
+def _run_pipeline(args, indexer: Indexer, manifest: Manifest, jobs: Iterable[FileJob], desc: str, total: Optional[int] = None) -> int:
+    indexer.backfill_keywords()
+    pipeline = IngestPipeline(
+        indexer, _chunk_opts(args),
+        parse_workers=args.parse_workers,
+        queue_depth=args.queue_depth,
+        write_batch=args.write_batch,
+        parse_timeout=args.parse_timeout,
+        parse_mem_mb=args.parse_mem_mb,
+    )
+    pending = 0
+    last_commit = time.monotonic()
+    failed_before = manifest.failed_count()
+
+    def done(job: FileJob, count: int, failed: List[Tuple[Chunk, Optional[str]]]):
+        nonlocal pending, last_commit
+        manifest.upsert(FileRecord(path=str(job.path), size=job.size, mtime=job.mtime, sha1=job.file_sha, chunk_count=count))
+        if failed or manifest.failed_count(str(job.path)):
+            manifest.set_failed(str(job.path), failed)
+        pending += 1
+        if pending >= args.commit_every or (args.checkpoint_seconds and time.monotonic() - last_commit >= args.checkpoint_seconds):
+            manifest.commit()  # a killed run resumes from here: committed files match on size/mtime
+            pending, last_commit = 0, time.monotonic()
 
-def _iter_git_changed(root: Path, git_range: str) -> List[Path]:
     try:
-        out = subprocess.check_output(["git", "-C", str(root), "diff", "--name-only", git_range], text=True)
-    except Exception:
-        print("[WARN] git diff failed; falling back to full scan")
-        return []
-    files = []
-    for line in out.splitlines():
-        p = (root / line).resolve()
-        if p.exists() and p.is_file():
-            files.append(p)
-    return files
+        return pipeline.run(jobs, done, total=total, desc=desc)
+    finally:
+        manifest.commit()
+        if indexer.adaptive:
+            print(f"[INFO] Adaptive embedding {indexer.adaptive.summary()}")
+        if indexer.chunk_filter and indexer.chunk_filter.summary():
+            print(f"[INFO] Filtered before embedding: {indexer.chunk_filter.summary()} (--no-filter keeps everything)")
+        failed_now = manifest.failed_count()
+        if failed_now > failed_before:
+            print(f"[WARN] {failed_now} chunks could not be embedded ({failed_now - failed_before} new); "
+                  f"run `retry-failed --collection {indexer.collection}` once Ollama is healthy")
+
+
+def _jobs_needing_update(paths: Iterable[Path], manifest: Manifest, max_bytes: int = 0,
+                         stats: Optional[Counter] = None, dropped: Optional[List[str]] = None) -> Iterator[FileJob]:
+    """Files whose size/mtime differ from the manifest (or that it doesn't know), yielded as `paths` produces
+    them so a scan feeds the pipeline without a file list in memory. Code/text over `max_bytes` (--max-file-mb)
+    is skipped; skipped files the manifest already knows are appended to `dropped` so the caller can remove
+    their old chunks. `stats` counts "files", "changed" and "too_big"."""
+    stats = Counter() if stats is None else stats
+    for p in paths:
+        stats["files"] += 1
+        try:
+            size, mtime = fast_sig(p)
+        except OSError:
+            continue  # vanished since it was listed
+        if _over_size_cap(p, size, max_bytes):
+            stats["too_big"] += 1
+            if dropped is not None and manifest.get(str(p)):
+                dropped.append(str(p))
+            continue
+        rec = manifest.get(str(p))
+        if rec is None or rec.size != size or abs(rec.mtime - mtime) > 1e-6:
+            stats["changed"] += 1
+            yield FileJob(path=p, size=size, mtime=mtime)
 
 
-def cmd_update_git(args):
+def _report_scan(args, stats: Counter, dropped: Sequence[str] = ()):
+    if stats["too_big"]:
+        print(f"[INFO] Skipped {stats['too_big']} files over --max-file-mb {args.max_file_mb:g}"
+              + (f", removed {len(dropped)} previously indexed" if dropped else ""))
+
+
+def _remove_files(indexer: Indexer, manifest: Manifest, paths: Sequence[str]):
+    """Drop deleted files from the index and the manifest."""
+    if not paths:
+        return
+    indexer.write([str(Path(p).resolve()) for p in paths], [], [], [], [])
+    for p in paths:
+        manifest.remove(p)
+    manifest.commit()
+
+
+def cmd_ingest(args):
     root = Path(args.dir).resolve()
     collection = args.collection or slugify(root.name)
-    manifest_path = Path(args.db) / "_state" / f"{collection}.manifest.json"
-    manifest = Manifest.load(manifest_path)
+    manifest = Manifest.open(args.db, collection)
 
     spec = build_ignore_spec(root, args.ignore or [])
     exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
 
-    indexer = Indexer(
-        db_path=args.db,
-        collection=collection,
-        ollama_url=args.ollama_url,
-        embed_model=args.embed_model,
-        workers=args.workers,
-        rate_limit_qps=args.qps,
-    )
+    indexer = _indexer_from_args(args, collection, manifest)
+
+    if args.reset:
+        indexer.reset()
+        manifest.clear()  # otherwise unchanged files would be skipped and never re-enter the fresh collection
+
+    # The scan runs inside the pipeline (driven by the parse stage), so indexing starts with the first files found.
+    stats: Counter = Counter()
+    dropped: List[str] = []
+    jobs = _jobs_needing_update(iter_supported_files(root, exts, spec, workers=args.scan_workers), manifest,
+                                _max_file_bytes(args), stats, dropped)
+
+    total_new = _run_pipeline(args, indexer, manifest, jobs, "Indexing files")
+    _remove_files(indexer, manifest, dropped)
+
+    print(f"[INFO] Found {stats['files']} candidate files, {stats['changed']} new or changed")
+    _report_scan(args, stats, dropped)
+    print(f"[OK] Ingest complete. Added/updated {total_new} chunks. DB: {args.db}, collection: {collection}")
+
+
+@dataclass
+class GitChange:
+    status: str  # A, M, D, R, C or T (type change)
+    path: Path  # new path (old path for D)
+    blob: Optional[str]  # new blob id; None when git doesn't know it (worktree side of the diff)
+    old_path: Optional[Path] = None  # R / C only
+    score: int = 100  # rename/copy similarity
+
 
-    changed = _iter_git_changed(root, args.git_range or "HEAD~1..HEAD")
-    if not changed:
-        print("[INFO] No git changes detected or git not available.")
+_NULL_BLOB = "0" * 40
+
+
+def _git(root: Path, *argv: str) -> str:
+    return subprocess.check_output(["git", "-C", str(root), *argv], text=True, stderr=subprocess.PIPE)
+
+
+def _iter_git_changes(root: Path, git_range: str) -> Optional[List[GitChange]]:
+    """Parse `git diff --raw -z -M` for the range; None if git can't answer (caller does a full scan)."""
+    try:
+        out = _git(root, "diff", "--raw", "-z", "-M", "--no-abbrev", "--no-ext-diff", git_range)
+    except (OSError, subprocess.CalledProcessError) as e:
+        err = getattr(e, "stderr", "") or str(e)
+        print(f"[WARN] git diff {git_range} failed: {err.strip().splitlines()[0] if err.strip() else e}")
+        return None
+    fields = out.split("\0")
+    changes: List[GitChange] = []
+    i = 0
+    while i < len(fields) and fields[i].startswith(":"):
+        _old_mode, _new_mode, _old_blob, new_blob, status = fields[i][1:].split(" ")
+        kind = status[0]
+        if kind in "RC":
+            old_rel, new_rel = fields[i + 1], fields[i + 2]
+            i += 3
+            changes.append(GitChange(kind, root / new_rel, None if new_blob == _NULL_BLOB else new_blob, root / old_rel,
+                                     int(status[1:] or 100)))
+        else:
+            rel = fields[i + 1]
+            i += 2
+            if kind in "AMTD":
+                changes.append(GitChange(kind, root / rel, None if new_blob == _NULL_BLOB or kind == "D" else new_blob))
+    return changes
+
+
+def _git_dirty_paths(root: Path, git_range: str) -> Optional[set]:
+    """Blob ids from the diff describe the worktree only when the range ends at HEAD; then every path except
+    the ones dirty in the worktree can skip hashing. Returns those dirty paths, or None if no blob id can be
+    trusted (range ends elsewhere; a single-rev diff against the worktree reports null blobs anyway)."""
+    try:
+        end = git_range.split("..")[-1].lstrip(".") or "HEAD"
+        if _git(root, "rev-parse", end).strip() != _git(root, "rev-parse", "HEAD").strip():
+            return None
+        return {str(root / p) for p in _git(root, "diff", "--name-only", "-z", "HEAD").split("\0") if p}
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def cmd_update_git(args):
+    root = Path(args.dir).resolve()
+    collection = args.collection or slugify(root.name)
+    git_range = args.git_range or "HEAD~1..HEAD"
+
+    changes = _iter_git_changes(root, git_range)
+    if changes is None:
+        print("[WARN] Falling back to a full size/mtime scan")
+        return cmd_update(args)
+    if not changes:
+        print("[INFO] No git changes in range.")
         return
 
-    targets = [p for p in changed if not should_ignore(p, root, spec) and (p.name == "CMakeLists.txt" or p.suffix in exts)]
-    print(f"[INFO] Changed files matched: {len(targets)}")
-
-    total = 0
-    for p in tqdm(targets, desc="Updating changed files", unit="file"):
-        size, mtime = fast_sig(p)
-        file_sha = sha1_file(p)
-        count = indexer.upsert_file(
-            p, file_sha,
-            code_chunk_lines=args.code_lines,
-            code_overlap=args.code_overlap,
-            doc_chars=args.doc_chars,
-            doc_overlap=args.doc_overlap,
-        )
-        manifest.files[str(p)] = FileRecord(path=str(p), size=size, mtime=mtime, sha1=file_sha, chunk_count=count)
-        total += count
+    manifest = Manifest.open(args.db, collection)
+    spec = build_ignore_spec(root, args.ignore or [])
+    exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
+    indexer = _indexer_from_args(args, collection, manifest)
+
+    dirty = _git_dirty_paths(root, git_range)
+
+    def wanted(p: Path) -> bool:
+        return (p.name == "CMakeLists.txt" or p.suffix in exts) and not should_ignore(p, root, spec) and p.is_file()
+
+    def known_blob(ch: GitChange) -> Optional[str]:
+        return ch.blob if ch.blob and dirty is not None and str(ch.path) not in dirty else None
+
+    deletes: List[str] = []
+    jobs: List[FileJob] = []
+    moved = too_big = 0
+    max_bytes = _max_file_bytes(args)
+    for ch in changes:
+        if ch.old_path is not None and ch.status == "R" and manifest.get(str(ch.old_path)):
+            deletes.append(str(ch.old_path))
+        if ch.status == "D":
+            if manifest.get(str(ch.path)):
+                deletes.append(str(ch.path))
+            continue
+        if not wanted(ch.path):
+            if manifest.get(str(ch.path)):
+                deletes.append(str(ch.path))  # now ignored, or gone from the worktree
+            continue
+        blob = known_blob(ch)
+        size, mtime = fast_sig(ch.path)
+        if _over_size_cap(ch.path, size, max_bytes):
+            too_big += 1
+            if manifest.get(str(ch.path)):
+                deletes.append(str(ch.path))  # grew past the cap: its old chunks would otherwise linger
+            continue
+        old = manifest.get(str(ch.old_path)) if ch.status == "R" and ch.old_path is not None else None
+        if (old is not None and ch.score == 100 and blob and old.sha1 == blob and not manifest.failed_count(old.path)
+                and indexer.can_move(ch.old_path, ch.path)):
+            # Pure rename of content we already indexed under the same blob id: move rows, no embedding.
+            count = indexer.move_file(ch.old_path, ch.path)
+            if count is not None:
+                manifest.upsert(FileRecord(path=str(ch.path), size=size, mtime=mtime, sha1=blob, chunk_count=count))
+                deletes.remove(str(ch.old_path))
+                manifest.remove(str(ch.old_path))
+                moved += 1
+                continue
+        rec = manifest.get(str(ch.path))
+        if rec is not None and blob and rec.sha1 == blob:
+            manifest.upsert(dataclasses.replace(rec, size=size, mtime=mtime))  # mode change / touched only
+            continue
+        jobs.append(FileJob(path=ch.path, size=size, mtime=mtime, file_sha=blob))
+    manifest.commit()
+
+    n_changed = sum(1 for ch in changes if ch.status != "D")
+    print(f"[INFO] {len(changes)} git changes: {len(jobs)} to index, {moved} renamed in place, {len(deletes)} to remove "
+          f"({len(changes) - n_changed} deleted upstream)")
+    _report_scan(args, Counter(too_big=too_big))
+    _remove_files(indexer, manifest, deletes)
+    total = _run_pipeline(args, indexer, manifest, jobs, "Updating changed files", len(jobs)) if jobs else 0
 
-    manifest.save(manifest_path)
-    print(f"[OK] Git update complete. Upserted {total} chunks.")
+    print(f"[OK] Git update complete. Upserted {total} chunks, moved {moved} files, removed {len(deletes)}.")
 
 
 def cmd_update(args):
     root = Path(args.dir).resolve()
     collection = args.collection or slugify(root.name)
-    manifest_path = Path(args.db) / "_state" / f"{collection}.manifest.json"
-    manifest = Manifest.load(manifest_path)
+    manifest = Manifest.open(args.db, collection)
 
     spec = build_ignore_spec(root, args.ignore or [])
     exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
 
-    indexer = Indexer(
-        db_path=args.db,
-        collection=collection,
-        ollama_url=args.ollama_url,
-        embed_model=args.embed_model,
-        workers=args.workers,
-        rate_limit_qps=args.qps,
-    )
+    indexer = _indexer_from_args(args, collection, manifest)
 
-    paths = list(iter_supported_files(root, exts, spec))
-    print(f"[INFO] Scanning {len(paths)} files for changes…")
+    stats: Counter = Counter()
+    dropped: List[str] = []
+    jobs = _jobs_needing_update(iter_supported_files(root, exts, spec, workers=args.scan_workers), manifest,
+                                _max_file_bytes(args), stats, dropped)
 
-    changed: List[Path] = []
-    for p in paths:
-        size, mtime = fast_sig(p)
-        rec = manifest.files.get(str(p))
-        if rec is None or rec.size != size or abs(rec.mtime - mtime) > 1e-6:
-            changed.append(p)
+    total = _run_pipeline(args, indexer, manifest, jobs, "Reindexing changed files")
+    _remove_files(indexer, manifest, dropped)
 
-    if not changed:
+    print(f"[INFO] Scanned {stats['files']} files, {stats['changed']} changed")
+    _report_scan(args, stats, dropped)
+    if not stats["changed"] and not dropped:
         print("[INFO] No changes detected.")
         return
+    print(f"[OK] Update complete. Upserted {total} chunks.")
 
-    total = 0
-    for p in tqdm(changed, desc="Reindexing changed files", unit="file"):
-        size, mtime = fast_sig(p)
-        file_sha = sha1_file(p)
-        count = indexer.upsert_file(
-            p, file_sha,
-            code_chunk_lines=args.code_lines,
-            code_overlap=args.code_overlap,
-            doc_chars=args.doc_chars,
-            doc_overlap=args.doc_overlap,
-        )
-        manifest.files[str(p)] = FileRecord(path=str(p), size=size, mtime=mtime, sha1=file_sha, chunk_count=count)
-        total += count
 
-    manifest.save(manifest_path)
-    print(f"[OK] Update complete. Upserted {total} chunks.")
+def _watch_rescan(args, root: Path, spec: IgnoreRules, exts: Sequence[str], indexer: Indexer, manifest: Manifest,
+                  rel_dir: str = ""):
+    """Catch-up pass for watch mode over the tree (or just `rel_dir`): upsert changed files and drop ones that
+    vanished (or became ignored)."""
+    present = set(iter_supported_files(root, exts, spec, workers=args.scan_workers, start=rel_dir))
+    gone = [p for p in manifest.paths_under(str(root / rel_dir) if rel_dir else str(root)) if Path(p) not in present]
+    jobs = list(_jobs_needing_update(sorted(present), manifest, _max_file_bytes(args), dropped=gone))
+    _remove_files(indexer, manifest, gone)
+    total = _run_pipeline(args, indexer, manifest, jobs, "Catching up", len(jobs)) if jobs else 0
+    print(f"[INFO] Rescan: {len(jobs)} changed, {len(gone)} removed, {total} chunks upserted")
+
+
+def cmd_watch(args):
+    root = Path(args.dir).resolve()
+    collection = args.collection or slugify(root.name)
+    manifest = Manifest.open(args.db, collection)
+
+    spec = build_ignore_spec(root, args.ignore or [])
+    exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
+
+    indexer = _indexer_from_args(args, collection, manifest)
+    watcher = TreeWatcher(root, spec, exts, debounce=args.debounce, max_delay=args.max_delay)
+    print(f"[INFO] Watching {watcher.watch_count} directories under {root}")
+    if not args.no_initial_scan:
+        _watch_rescan(args, root, spec, exts, indexer, manifest)
+
+    rescan_every = args.rescan_minutes * 60
+    next_rescan = time.monotonic() + rescan_every if rescan_every else None
+    print("[OK] Watching for changes (Ctrl-C to stop)")
+    try:
+        while True:
+            batch = watcher.poll(timeout=1.0)
+            if next_rescan is not None and time.monotonic() >= next_rescan:
+                # inotify doesn't see writes made by other NFS/SMB clients; a slow periodic scan covers those.
+                _watch_rescan(args, root, spec, exts, indexer, manifest)
+                next_rescan = time.monotonic() + rescan_every
+            if batch is None:
+                continue
+            changed, gone_dirs, rescan_dirs, overflow = batch
+            if overflow:
+                print("[WARN] inotify queue overflowed; rescanning the tree")
+                _watch_rescan(args, root, spec, exts, indexer, manifest)
+                continue
+            for rel_dir in rescan_dirs:
+                print(f"[INFO] .gitignore changed in {rel_dir or '.'}; rescanning it")
+                _watch_rescan(args, root, spec, exts, indexer, manifest, rel_dir)
+            live = [root / rel for rel in changed if (root / rel).is_file()]
+            gone = [str(root / rel) for rel in changed if not (root / rel).is_file() and manifest.get(str(root / rel))]
+            for rel_dir in gone_dirs:
+                gone.extend(manifest.paths_under(str(root / rel_dir)))
+            jobs = list(_jobs_needing_update(live, manifest, _max_file_bytes(args), dropped=gone))
+            gone = list(dict.fromkeys(gone))
+            _remove_files(indexer, manifest, gone)
+            total = _run_pipeline(args, indexer, manifest, jobs, "Updating", len(jobs)) if jobs else 0
+            if jobs or gone:
+                print(f"[INFO] {time.strftime('%H:%M:%S')} {len(jobs)} files updated ({total} chunks), {len(gone)} removed")
+    except KeyboardInterrupt:
+        print("\n[INFO] Stopping watch")
+    finally:
+        watcher.close()
+        manifest.commit()
 
 
 def cmd_reindex_file(args):
@@ -708,75 +5061,459 @@ def cmd_reindex_file(args):
     p = Path(args.path).resolve()
     if not p.exists():
         raise SystemExit(f"File not found: {p}")
-    manifest_path = Path(args.db) / "_state" / f"{collection}.manifest.json"
-    manifest = Manifest.load(manifest_path)
+    manifest = Manifest.open(args.db, collection)
 
-    indexer = Indexer(
-        db_path=args.db,
-        collection=collection,
-        ollama_url=args.ollama_url,
-        embed_model=args.embed_model,
-        workers=args.workers,
-        rate_limit_qps=args.qps,
-    )
+    indexer = _indexer_from_args(args, collection, manifest)
 
     size, mtime = fast_sig(p)
     file_sha = sha1_file(p)
-    count = indexer.upsert_file(
-        p, file_sha,
-        code_chunk_lines=args.code_lines,
-        code_overlap=args.code_overlap,
-        doc_chars=args.doc_chars,
-        doc_overlap=args.doc_overlap,
-    )
+    failed: List[Tuple[Chunk, Optional[str]]] = []
+    count = indexer.upsert_file(p, file_sha, failed=failed, **_chunk_opts(args))
 
-    manifest.files[str(p)] = FileRecord(path=str(p), size=size, mtime=mtime, sha1=file_sha, chunk_count=count)
-    manifest.save(manifest_path)
-    print(f"[OK] Reindexed {p.name}: {count} chunks.")
+    manifest.upsert(FileRecord(path=str(p), size=size, mtime=mtime, sha1=file_sha, chunk_count=count))
+    manifest.set_failed(str(p), failed)
+    manifest.commit()
+    print(f"[OK] Reindexed {p.name}: {count} chunks." + (f" {len(failed)} failed to embed (see retry-failed)." if failed else ""))
+
+
+def cmd_retry_failed(args):
+    """Embed dead-lettered chunks again and add the ones that now succeed; stale entries are dropped."""
+    collection = args.collection
+    if not collection:
+        raise SystemExit("--collection is required")
+    manifest = Manifest.open(args.db, collection)
+    entries = manifest.failed_chunks(limit=args.limit or None)
+    if not entries:
+        print("[OK] No failed chunks.")
+        return
+    if args.list:
+        for path, ch, attempts, err in entries:
+            print(f"{source_label(ch.metadata)}\t{path}\tattempts={attempts}\t{err or ''}")
+        print(f"[INFO] {len(entries)} failed chunks", file=sys.stderr)
+        return
+
+    # A chunk is only worth adding if its file is still indexed at the content it was cut from.
+    live: List[Tuple[str, Chunk]] = []
+    stale: List[str] = []
+    for path, ch, _, _ in entries:
+        rec = manifest.get(path)
+        if rec is not None and rec.sha1 == ch.metadata.get("file_sha1"):
+            live.append((path, ch))
+        else:
+            stale.append(ch.id)
+
+    indexer = _indexer_from_args(args, collection)
+    failed: List[Tuple[Chunk, Optional[str]]] = []
+    ids, embs, docs, metas = indexer._embed_batch_parallel([ch for _, ch in live], failed) if live else ([], [], [], [])
+    indexer.write([], ids, embs, docs, metas)
+
+    path_of = {ch.id: path for path, ch in live}
+    for path, n in Counter(path_of[i] for i in ids).items():
+        rec = manifest.get(path)
+        manifest.upsert(dataclasses.replace(rec, chunk_count=rec.chunk_count + n))
+    manifest.resolve_failed(ids + stale, [(ch.id, err) for ch, err in failed])
+    manifest.commit()
+    print(f"[OK] Retried {len(live)} chunks: {len(ids)} stored, {len(failed)} still failing, "
+          f"{len(stale)} stale entries dropped (file changed or removed).")
+
+
+def find_orphans(store: VectorStore, manifest: Manifest) -> Dict[str, List[Tuple[str, str]]]:
+    """Vectors the manifest doesn't account for, grouped by reason:
+    - "stale-sha": stored under a SHA other than the file's current manifest SHA (left behind by an edit)
+    - "untracked": the source path isn't in the manifest at all (deleted file, aborted run, ...)
+    """
+    current = {str(Path(rec.path).resolve()): rec.sha1 for rec in manifest.records()}
+    out: Dict[str, List[Tuple[str, str]]] = {"stale-sha": [], "untracked": []}
+    for vid, meta in store.iter_metadata():
+        src = (meta or {}).get("source_path", "")
+        sha = current.get(src)
+        if sha is None:
+            out["untracked"].append((vid, src))
+        elif meta.get("file_sha1") != sha:
+            out["stale-sha"].append((vid, src))
+    return out
 
 
 def cmd_vacuum(args):
     root = Path(args.dir).resolve()
     collection = args.collection or slugify(root.name)
-    manifest_path = Path(args.db) / "_state" / f"{collection}.manifest.json"
-    manifest = Manifest.load(manifest_path)
+    manifest = Manifest.open(args.db, collection)
 
-    indexer = Indexer(
-        db_path=args.db,
-        collection=collection,
-        ollama_url=args.ollama_url,
-        embed_model=args.embed_model,
-        workers=max(1, args.workers),
-        rate_limit_qps=args.qps,
-    )
+    indexer = _indexer_from_args(args, collection)
+
+    gone = [rec.path for rec in manifest.records() if not Path(rec.path).exists()]
+
+    orphans = find_orphans(indexer.store, manifest)
+    for reason, items in orphans.items():
+        paths = sorted({src for _, src in items})
+        print(f"[INFO] Orphaned vectors ({reason}): {len(items)} across {len(paths)} files")
+        for src in paths[:20]:
+            print(f"    {src}")
+        if len(paths) > 20:
+            print(f"    … {len(paths) - 20} more")
+
+    if args.dry_run:
+        for abspath in gone:
+            print(f"    deleted: {abspath}")
+        print(f"[OK] Dry run: {len(gone)} deleted files, {sum(len(v) for v in orphans.values())} orphaned vectors; nothing removed.")
+        return
+
+    _remove_files(indexer, manifest, gone)
+    stale_ids = [vid for items in orphans.values() for vid, _ in items]
+    indexer.delete_ids(stale_ids)
+    print(f"[OK] Vacuum complete. Removed {len(gone)} stale files and {len(stale_ids)} orphaned vectors.")
 
-    removed = 0
-    for abspath, rec in list(manifest.files.items()):
-        if not Path(abspath).exists():
-            indexer.store.delete_by_file_sha(rec.sha1)
-            manifest.files.pop(abspath, None)
-            removed += 1
-    manifest.save(manifest_path)
-    print(f"[OK] Vacuum complete. Removed {removed} stale files.")
+
+def _reranker_from_args(args) -> Optional[Reranker]:
+    if not args.rerank_model:
+        return None
+    rr = Reranker(args.rerank_model, batch_size=args.rerank_batch)
+    print(f"[INFO] Reranking {args.rerank_candidates} candidates with {rr.model_name} on {rr.device}", file=sys.stderr)
+    return rr
+
+
+def _filter_from_args(args) -> Optional[SearchFilter]:
+    try:
+        where = SearchFilter.parse(args.path_prefix, args.ext, args.repo, args.pages)
+    except ValueError as e:
+        raise SystemExit(f"--pages: {e}")
+    if where:
+        print(f"[INFO] Filter: {where.describe()}", file=sys.stderr)
+    return where
 
 
 def cmd_query(args):
-    answer, metas = answer_question(
-        db_path=args.db,
-        collection=args.collection,
-        question=args.question,
-        llm_model=args.llm,
-        embed_model=args.embed_model,
-        ollama_url=args.ollama_url,
-        top_k=args.top_k,
-    )
+    svc = QueryService(args.db, args.collection, llm_model=args.llm, embed_model=args.embed_model, ollama_url=args.ollama_url,
+                       connect_timeout=args.connect_timeout, read_timeout=args.read_timeout, retrieval=args.retrieval,
+                       ctx_tokens=args.ctx_tokens, num_ctx=args.num_ctx, embed_cache=not args.no_embed_cache,
+                       answer_cache=args.answer_cache, answer_cache_sim=args.answer_cache_sim,
+                       reranker=_reranker_from_args(args), rerank_candidates=args.rerank_candidates,
+                       store=_store_from_args(args, args.collection))
+    where = _filter_from_args(args)
+    timings = AnswerTimings()
     print("\n==== Answer ====\n")
-    print(answer.strip())
+    if args.stream:
+        tokens, metas = svc.answer_stream(args.question, args.top_k, timings, where)
+        for piece in tokens:
+            sys.stdout.write(piece)
+            sys.stdout.flush()
+        print()
+    else:
+        answer, metas = svc.answer(args.question, args.top_k, timings, where)
+        print(answer.strip())
     print("\n==== Sources ====\n")
     for i, m in enumerate(metas, start=1):
-        p = m.get("source_path", "")
-        pg = f" p.{m['page']}" if m.get("page") else ""
-        print(f"[{i}] {m.get('filename', '?')}{pg} — {p}")
+        print(f"[{i}] {source_label(m)} — {m.get('source_path', '')}")
+    print(f"\n[INFO] {timings.summary()}", file=sys.stderr)
+
+
+def read_batch_questions(path: str) -> List[Dict]:
+    """query-batch input: one JSON object per line, {"question", "id"?, "top_k"?, "filter"?}, or a bare JSON string.
+    Lines without an "id" get their line number."""
+    items: List[Dict] = []
+    with (contextlib.nullcontext(sys.stdin) if path == "-" else open(path, encoding="utf-8")) as fh:
+        for n, line in enumerate(fh, start=1):
+            if not line.strip():
+                continue
+            try:
+                obj = json.loads(line)
+            except json.JSONDecodeError as e:
+                raise SystemExit(f"{path}:{n}: not JSON ({e})")
+            if isinstance(obj, str):
+                obj = {"question": obj}
+            if not isinstance(obj, dict) or not (obj.get("question") or obj.get("query")):
+                raise SystemExit(f"{path}:{n}: missing \"question\"")
+            obj.setdefault("id", n)
+            items.append(obj)
+    return items
+
+
+def cmd_query_batch(args):
+    """Answer a JSONL file of questions in one process: the collection and models load once, question
+    embeddings go out in batches, and retrieval + generation for --concurrency questions run at a time.
+    Results are written in input order, one JSON object per line, as they complete."""
+    items = read_batch_questions(args.input)
+    default_where = _filter_from_args(args)
+    ollama = OllamaClient(base_url=args.ollama_url, timeout=args.read_timeout or 240, connect_timeout=args.connect_timeout,
+                          pool_size=max(2, args.concurrency), priority="batch")
+    svc = QueryService(args.db, args.collection, llm_model=args.llm, embed_model=args.embed_model, ollama=ollama,
+                       retrieval=args.retrieval, ctx_tokens=args.ctx_tokens, num_ctx=args.num_ctx,
+                       embed_cache=not args.no_embed_cache, answer_cache=args.answer_cache,
+                       answer_cache_sim=args.answer_cache_sim, reranker=_reranker_from_args(args),
+                       rerank_candidates=args.rerank_candidates, store=_store_from_args(args, args.collection))
+    print(f"[INFO] {len(items)} questions against {args.collection} ({svc.store.count()} vectors), "
+          f"{args.concurrency} at a time", file=sys.stderr)
+
+    def run_one(item: Dict) -> Dict:
+        question = item.get("question") or item.get("query")
+        out = {"id": item["id"], "question": question}
+        try:
+            where = SearchFilter.from_request(item) if item.get("filter") else default_where
+            top_k = int(item.get("top_k") or args.top_k)
+            if args.no_generate:
+                t0 = time.perf_counter()
+                out["hits"] = [dataclasses.asdict(h) for h in svc.search(question, top_k, where)]
+                out["timings"] = {"total_s": time.perf_counter() - t0}
+                METRICS.inc("rag_queries_total", kind="search")
+            else:
+                timings = AnswerTimings()
+                out["answer"], out["sources"] = svc.answer(question, top_k, timings, where)
+                out["timings"] = dataclasses.asdict(timings)
+        except Exception as e:
+            out["error"] = f"{type(e).__name__}: {e}"
+        return out
+
+    t0 = time.perf_counter()
+    failed = 0
+    # Windows keep a window's question vectors inside the query LRU until its searches have run.
+    window = max(args.concurrency, QueryService.QUERY_LRU_SIZE // 2)
+    with (contextlib.nullcontext(sys.stdout) if args.output == "-" else open(args.output, "w", encoding="utf-8")) as out_fh, \
+            futures.ThreadPoolExecutor(max_workers=max(1, args.concurrency), thread_name_prefix="query") as ex, \
+            tqdm(total=len(items), desc="Questions", unit="q", file=sys.stderr) as bar:
+        for i in range(0, len(items), window):
+            part = items[i : i + window]
+            try:
+                svc.embed_queries([it.get("question") or it.get("query") for it in part])
+            except Exception as e:
+                print(f"[WARN] Batched question embedding failed ({e}); embedding one at a time", file=sys.stderr)
+            for res in ex.map(run_one, part):
+                failed += "error" in res
+                out_fh.write(json.dumps(res, ensure_ascii=False) + "\n")
+                out_fh.flush()
+                bar.update(1)
+    elapsed = time.perf_counter() - t0
+    print(f"[OK] {len(items) - failed}/{len(items)} questions in {elapsed:.1f}s "
+          f"({len(items) / max(elapsed, 1e-9):.1f}/s){f', {failed} failed' if failed else ''} → {args.output}", file=sys.stderr)
+    if failed:
+        raise SystemExit(1)
+
+
+def cmd_serve(args):
+    server = QueryServer(args)
+    if args.collection:
+        svc = server.service(args.collection)
+        print(f"[INFO] Loaded collection {args.collection} ({svc.store.count()} vectors)")
+        try:
+            svc.warm_up()
+            print(f"[INFO] Warmed {args.embed_model} + {args.llm} (keep_alive={args.keep_alive})")
+        except Exception as e:
+            print(f"[WARN] Model warm-up failed: {e}")
+    httpd = ThreadingHTTPServer((args.host, args.port), server.make_handler())
+    httpd.daemon_threads = True
+    print(f"[OK] Serving on http://{args.host}:{args.port} (POST /query, POST /search, GET /health, GET /metrics)")
+    try:
+        httpd.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        httpd.server_close()
+
+
+def cmd_llm_queue(args):
+    limits: Dict[str, int] = {}
+    for spec in args.limit or []:
+        model, _, n = spec.rpartition("=")
+        if not model or not n.isdigit():
+            raise SystemExit(f"--limit expects MODEL=N, got {spec!r}")
+        limits[model] = int(n)
+    scheduler = LLMScheduler(default_limit=args.default_limit, limits=limits, interactive_reserve=args.interactive_reserve,
+                             max_total=args.max_total)
+    upstream = OllamaClient(base_url=args.ollama_url, timeout=args.read_timeout or 600, connect_timeout=args.connect_timeout,
+                            pool_size=max(8, args.default_limit * 4))
+    httpd = ThreadingHTTPServer((args.host, args.port), LLMQueueProxy(upstream, scheduler).make_handler())
+    httpd.daemon_threads = True
+    per_model = ", ".join(f"{m}={n}" for m, n in limits.items()) or "none"
+    print(f"[OK] LLM queue on http://{args.host}:{args.port} -> {args.ollama_url} "
+          f"(default limit {args.default_limit}, per-model {per_model}, interactive reserve {args.interactive_reserve})")
+    try:
+        httpd.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        httpd.server_close()
+
+# ------------------------------
+# Benchmarks (bench)
+# ------------------------------
+
+_BENCH_VERBS = ("process", "flush", "reset", "parse", "encode", "resolve", "schedule", "retry", "connect", "drain")
+_BENCH_NOUNS = ("Packet", "Session", "Buffer", "Codec", "Router", "Channel", "Cache", "Frame", "Socket", "Queue")
+
+
+def generate_synthetic_repo(root: Path, n_files: int, seed: int = 7, functions: int = 8) -> Dict:
+    """Write a deterministic C++-shaped tree (headers, sources, a few docs, an ignored build/ dir) under root.
+
+    Files are spread ~20 per directory, three levels deep, so discovery exercises directory fan-out; every
+    source has a namespace, a class and free functions with bodies, so the syntax chunker does real work.
+    """
+    rng = random.Random(seed)
+    root.mkdir(parents=True, exist_ok=True)
+    (root / ".gitignore").write_text("gen/\n*.o\n")
+    symbols: List[str] = []
+    total_bytes = 0
+    for i in range(n_files):
+        d = root / "src" / f"mod{i // 400:03d}" / f"part{(i // 20) % 20:02d}"
+        d.mkdir(parents=True, exist_ok=True)
+        cls = f"{rng.choice(_BENCH_NOUNS)}{i}"
+        if i % 50 == 49:
+            path = d / f"NOTES_{i}.md"
+            text = "\n\n".join(f"## {cls} design note {k}\n" + " ".join(rng.choice(_BENCH_VERBS) for _ in range(60))
+                               for k in range(4))
+        else:
+            ext = ".h" if i % 3 == 0 else ".cpp"
+            path = d / f"{cls.lower()}{ext}"
+            lines = [f"// {cls}: synthetic benchmark source", "#include <vector>", "#include <string>", "",
+                     f"namespace bench{i % 17} {{", "", f"class {cls} {{", "public:"]
+            methods = [f"{rng.choice(_BENCH_VERBS)}_{k}" for k in range(functions)]
+            lines += [f"    int {m}(int x);" for m in methods] + ["};", ""]
+            for m in methods:
+                symbols.append(f"{cls}::{m}")
+                body = [f"    int acc_{j} = x * {rng.randint(1, 97)} + {j};" for j in range(rng.randint(4, 24))]
+                lines += [f"int {cls}::{m}(int x) {{", *body, "    if (x < 0) { return -1; }", "    return acc_0;", "}", ""]
+            lines.append(f"}}  // namespace bench{i % 17}")
+            text = "\n".join(lines) + "\n"
+        path.write_text(text)
+        total_bytes += len(text)
+    junk = root / "build" / "obj"
+    junk.mkdir(parents=True, exist_ok=True)
+    for j in range(max(1, n_files // 20)):
+        (junk / f"gen_{j}.cpp").write_text("int generated() { return 0; }\n")
+    return {"files": n_files, "bytes": total_bytes, "symbols": symbols}
+
+
+def cmd_bench(args):
+    """Measure each stage separately and print one JSON document (also written to --out)."""
+    if args.work_dir:
+        return _bench(args, Path(args.work_dir))
+    work = Path(tempfile.mkdtemp(prefix="rag-bench-"))
+    try:
+        return _bench(args, work)
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+
+def _bench(args, work: Path):
+    report: Dict = {
+        "version": 1,
+        "started": time.strftime("%Y-%m-%dT%H:%M:%S"),
+        "host": {"python": platform.python_version(), "platform": platform.platform(), "cpus": os.cpu_count(),
+                 "chromadb": getattr(chromadb, "__version__", "?")},
+        "params": {k: v for k, v in vars(args).items() if isinstance(v, (int, float, str, bool, type(None)))},
+    }
+    if args.dir:
+        root = Path(args.dir).resolve()
+        symbols: List[str] = []
+    else:
+        root = work / "repo"
+        t0 = time.perf_counter()
+        gen = generate_synthetic_repo(root, args.synthetic_files, seed=args.seed)
+        symbols = gen["symbols"]
+        report["generate"] = {"files": gen["files"], "bytes": gen["bytes"], "seconds": time.perf_counter() - t0}
+    print(f"[INFO] Benchmarking {root}", file=sys.stderr)
+
+    # 1) discovery
+    spec = build_ignore_spec(root, args.ignore or [])
+    exts = list(SUPPORTED_EXTS | set(args.extra_ext or []))
+    t0 = time.perf_counter()
+    paths = list(iter_supported_files(root, exts, spec, workers=args.scan_workers))
+    dt = time.perf_counter() - t0
+    report["discovery"] = {"files": len(paths), "seconds": dt, "files_per_s": len(paths) / dt if dt else None}
+
+    # 2) chunking, in this process (a per-core number; ingest runs --parse-workers of these)
+    sample = paths[: args.chunk_sample] if args.chunk_sample else paths
+    opts = _chunk_opts(args)
+    chunks: List[Chunk] = []
+    nbytes = 0
+    t0 = time.perf_counter()
+    for p in sample:
+        try:
+            chunks.extend(build_chunks_for_file(p, sha1_file(p), **opts))
+            nbytes += p.stat().st_size
+        except Exception as e:
+            print(f"[WARN] bench: failed to chunk {p}: {e}", file=sys.stderr)
+    dt = time.perf_counter() - t0
+    report["chunking"] = {"files": len(sample), "chunks": len(chunks), "mb": nbytes / 1e6, "seconds": dt,
+                          "files_per_s": len(sample) / dt if dt else None, "mb_per_s": nbytes / 1e6 / dt if dt else None,
+                          "chunks_per_s": len(chunks) / dt if dt else None}
+
+    # 3) embedding through the real batching/limiter path, cache off so every chunk goes to Ollama
+    db = args.db or str(work / "db")
+    collection = f"bench_{os.getpid()}"
+    indexer = Indexer(db_path=db, collection=collection, ollama_url=args.ollama_url, embed_model=args.embed_model,
+                      workers=args.workers, rate_limit_qps=_qps_from_args(args), batch_size=args.embed_batch,
+                      batch_chars=args.embed_batch_chars, burst=args.burst, max_inflight=args.max_inflight,
+                      connect_timeout=args.connect_timeout, read_timeout=args.read_timeout, embed_cache=False, adaptive=args.adaptive,
+                      store=open_store(db, collection, backend=args.store, qdrant_url=args.qdrant_url, shard_by=args.shard_by,
+                                       index_dtype=args.index_dtype, root=str(root)))
+    to_embed = chunks[: args.embed_chunks]
+    t0 = time.perf_counter()
+    ids, embs, docs, metas = indexer._embed_batch_parallel(to_embed)
+    dt = time.perf_counter() - t0
+    report["embedding"] = {"chunks": len(to_embed), "embedded": len(embs), "seconds": dt,
+                           "chunks_per_s": len(embs) / dt if dt else None, "dim": len(embs[0]) if embs else None,
+                           "workers": args.workers, "batch": args.embed_batch}
+    if indexer.adaptive:
+        report["embedding"]["adaptive"] = {"concurrency": indexer.adaptive.settled(), "batch": indexer.adaptive.batch,
+                                           "range": [indexer.adaptive.low, indexer.adaptive.high]}
+
+    try:
+        if embs:
+            # 4) vector store + keyword index writes: cycle the vectors we have up to --write-rows
+            rows = max(args.write_rows, len(embs))
+            w_ids = [f"bench:{i}" for i in range(rows)]
+            w_embs = [embs[i % len(embs)] for i in range(rows)]
+            w_docs = [docs[i % len(docs)] for i in range(rows)]
+            w_metas = [{**metas[i % len(metas)], "source_path": f"{metas[i % len(metas)]['source_path']}#{i // len(metas)}"}
+                       for i in range(rows)]
+            step = max(1, args.write_batch)
+            t0 = time.perf_counter()
+            for i in range(0, rows, step):
+                indexer.write([], w_ids[i : i + step], w_embs[i : i + step], w_docs[i : i + step], w_metas[i : i + step])
+            dt = time.perf_counter() - t0
+            report["store_write"] = {"rows": rows, "batch": step, "seconds": dt, "rows_per_s": rows / dt if dt else None}
+
+            # 5) queries: retrieval only, or retrieval + generation like `query`
+            svc = QueryService(db, collection, llm_model=args.llm, embed_model=args.embed_model, ollama_url=args.ollama_url,
+                               connect_timeout=args.connect_timeout, read_timeout=args.read_timeout, retrieval=args.retrieval,
+                               embed_cache=False, store=indexer.store)
+            rng = random.Random(args.seed)
+            pool = symbols or sorted({m.get("symbol") or m.get("filename", "") for m in metas} - {""})
+            questions = [f"How does {rng.choice(pool)} handle negative input?" if pool else "How are errors handled?"
+                         for _ in range(args.queries)]
+            retrieve: List[float] = []
+            total: List[float] = []
+            for q in questions:
+                t = AnswerTimings()
+                if args.no_generate:
+                    t0 = time.perf_counter()
+                    svc.search(q, args.top_k)
+                    t.retrieve_s = t.total_s = time.perf_counter() - t0
+                else:
+                    svc.answer(q, args.top_k, t)
+                retrieve.append(t.retrieve_s)
+                total.append(t.total_s)
+            report["query"] = {"queries": len(questions), "mode": "search" if args.no_generate else "answer",
+                               "retrieval": args.retrieval, "retrieve_s": _percentiles(retrieve), "total_s": _percentiles(total)}
+
+            t0 = time.perf_counter()
+            indexer.delete_ids(w_ids)
+            dt = time.perf_counter() - t0
+            report["store_delete"] = {"rows": rows, "seconds": dt, "rows_per_s": rows / dt if dt else None}
+    finally:
+        # The bench collection is throwaway even when --db points at a real store.
+        try:
+            indexer.store.drop()
+        except Exception:
+            pass
+        StoreConfig(db, collection).remove()
+        for suffix in (".keywords.sqlite", ".keywords.sqlite-wal", ".keywords.sqlite-shm"):
+            (Path(db) / "_state" / f"{collection}{suffix}").unlink(missing_ok=True)
+
+    out = json.dumps(report, indent=2, default=str)
+    if args.out:
+        Path(args.out).write_text(out + "\n")
+        print(f"[OK] Benchmark written to {args.out}", file=sys.stderr)
+    print(out)
 
 # ------------------------------
 # Main / CLI setup
@@ -789,17 +5526,88 @@ def main():
     def add_shared(p):
         p.add_argument("--db", default=".rag_db", help="Chroma persistence dir")
         p.add_argument("--collection", default=None, help="Collection name (default: slug of dir)")
-        p.add_argument("--ollama-url", default="http://localhost:11434", help="Ollama base URL")
+        p.add_argument("--ollama-url", default="http://localhost:11434", help="Ollama base URL; comma-separate several to load-balance with failover")
+        p.add_argument("--connect-timeout", type=float, default=5.0, help="Seconds to establish a connection to Ollama")
+        p.add_argument("--read-timeout", type=float, default=None, help="Seconds to wait for an Ollama response (default: 180 ingest, 240 query)")
         p.add_argument("--embed-model", default="bge-m3", help="Embedding model (business-friendly: bge-m3 MIT)")
         p.add_argument("--llm", default="mistral", help="LLM for answering (Apache-2.0)")
         p.add_argument("--workers", type=int, default=4, help="Parallel embedding workers")
-        p.add_argument("--qps", type=float, default=3.0, help="Client-side rate-limit (queries/sec)")
-        p.add_argument("--code-lines", type=int, default=120, help="Lines per code chunk")
-        p.add_argument("--code-overlap", type=int, default=20, help="Overlapped lines between code chunks")
+        p.add_argument("--qps", type=float, default=None,
+                       help="Client-side rate-limit (embedding requests/sec; default 3, or none with --adaptive; 0 = none)")
+        p.add_argument("--adaptive", action="store_true",
+                       help="Tune embedding concurrency (up to --workers) and batch size (up to --embed-batch) from "
+                            "Ollama latency and errors, AIMD-style")
+        p.add_argument("--burst", type=int, default=None, help="Rate-limiter burst capacity in requests (default: --workers)")
+        p.add_argument("--max-inflight", type=int, default=None, help="Max concurrent embedding requests (default: --workers, 0 = unlimited)")
+        p.add_argument("--embed-batch", type=int, default=32, help="Max chunks per embedding request (/api/embed)")
+        p.add_argument("--embed-batch-chars", type=int, default=32000, help="Max total chars per embedding request")
+        p.add_argument("--no-embed-cache", action="store_true", help="Don't read/write the content-addressed embedding cache")
+        p.add_argument("--store", choices=STORE_BACKENDS, default=None,
+                       help="Vector backend when creating a collection: chroma (embedded, default) or qdrant (server-side ANN); "
+                            "remembered in _state/<collection>.store.json")
+        p.add_argument("--qdrant-url", default=None, help="Qdrant REST URL (default http://localhost:6333)")
+        p.add_argument("--shard-by", choices=SHARD_MODES, default=None,
+                       help="Split a new collection into one index per top-level directory (top) or per git repo (repo); "
+                            "searches fan out to every shard in parallel")
+        p.add_argument("--embed-dim", type=int, default=0,
+                       help="Store vectors truncated to N dims and renormalised (Matryoshka-trained models only); queries "
+                            "rescore candidates at full width and float32 from the embedding cache, so it needs the "
+                            "cache (0 = full width)")
+        p.add_argument("--index-dtype", choices=VECTOR_DTYPES, default=None,
+                       help="Element type of a new Qdrant collection: float16 halves the index, int8 adds in-RAM scalar "
+                            "quantisation with float32 originals on disk for rescoring (default float32; remembered)")
+        p.add_argument("--cache-dtype", choices=VECTOR_DTYPES, default="float32",
+                       help="Element type of new embedding-cache rows: float16 halves the cache, int8 quarters it. "
+                            "Must stay float32 with --embed-dim, whose rescoring reads the cache")
+        p.add_argument("--scan-workers", type=int, default=8, help="Threads walking the directory tree")
+        p.add_argument("--parse-workers", type=int, default=min(8, os.cpu_count() or 1), help="Processes reading/chunking files")
+        p.add_argument("--parse-timeout", type=float, default=300,
+                       help="Abandon a file whose parser makes no progress (page/chunks) for this many seconds (0 = never)")
+        p.add_argument("--parse-mem-mb", type=int, default=0,
+                       help="Address-space headroom per parse worker in MiB (RLIMIT_AS); one runaway PDF fails alone (0 = no cap)")
+        p.add_argument("--queue-depth", type=int, default=64, help="Bounded queue size between ingest stages")
+        p.add_argument("--commit-every", type=int, default=200, help="Commit the manifest every N indexed files")
+        p.add_argument("--checkpoint-seconds", type=float, default=60,
+                       help="Also commit the manifest at least this often, so slow files don't delay checkpoints (0 = off)")
+        p.add_argument("--write-batch", type=int, default=512, help="Chunks per grouped Chroma add")
+        p.add_argument("--code-chunker", choices=["syntax", "lines"], default="syntax",
+                       help="C/C++: one chunk per function/class/namespace (syntax) or fixed line windows (lines)")
+        p.add_argument("--code-lines", type=int, default=120, help="Max lines per code chunk")
+        p.add_argument("--code-overlap", type=int, default=20, help="Overlapped lines between line-window chunks")
         p.add_argument("--doc-chars", type=int, default=1200, help="Chars per prose chunk (README etc.)")
         p.add_argument("--doc-overlap", type=int, default=200, help="Overlap for prose chunks")
+        p.add_argument("--max-file-mb", type=float, default=64,
+                       help="Skip code/text files larger than this (generated sources, dumps); 0 = no limit. "
+                            "PDF/DOCX/HTML are never capped. Text files over "
+                            f"{STREAM_SEGMENT_BYTES >> 20} MiB are read in segments either way")
+        p.add_argument("--max-file-chunks", type=int, default=20000,
+                       help="Stop indexing a file after this many chunks (0 = no cap)")
+        p.add_argument("--no-filter", action="store_true",
+                       help="Embed everything: keep generated files, repeated license banners and data-only chunks")
         p.add_argument("--ignore", nargs="*", default=[], help="Extra ignore globs (additive to .gitignore/defaults)")
         p.add_argument("--extra-ext", nargs="*", default=[], help="Extra file extensions to include (e.g. .proto .json)")
+        p.add_argument("--metrics-port", type=int, default=0, help="Expose Prometheus metrics on 127.0.0.1:PORT/metrics while running (0 = off)")
+        p.add_argument("--metrics-json", default=None, help="Append a JSON line with this run's stage timers and counters to this file")
+
+    def add_filter_args(p):
+        p.add_argument("--path-prefix", default=None, help="Only search files under this path (e.g. src/net/)")
+        p.add_argument("--ext", action="append", default=None, help="Only search these file extensions (repeatable or comma-separated: .h,.cpp)")
+        p.add_argument("--repo", action="append", default=None, help="Only search these git repositories, by directory name (repeatable)")
+        p.add_argument("--pages", default=None, help="PDF page range, e.g. 3-7, 5 or 10- (only chunks with a page)")
+
+    def add_answer_args(p):
+        p.add_argument("--ctx-tokens", type=int, default=3000, help="Token budget for retrieved context in the prompt")
+        p.add_argument("--num-ctx", type=int, default=None,
+                       help="Model context window: sent as Ollama num_ctx, caps --ctx-tokens (default: the model's own)")
+        p.add_argument("--answer-cache", action="store_true",
+                       help="Reuse answers for repeated questions (same retrieved chunks, similar question embedding)")
+        p.add_argument("--answer-cache-sim", type=float, default=0.97, help="Min cosine similarity for an answer-cache hit")
+        p.add_argument("--rerank-model", default=None,
+                       help="Cross-encoder to rerank candidates with (sentence-transformers), e.g. BAAI/bge-reranker-base")
+        p.add_argument("--rerank-candidates", type=int, default=50, help="First-stage candidates fetched for reranking")
+        p.add_argument("--rerank-batch", type=int, default=32, help="Cross-encoder batch size")
+        p.add_argument("--retrieval", choices=["hybrid", "vector", "keyword"], default="hybrid",
+                       help="hybrid = BM25 keyword index + ANN fused with RRF (exact symbols skip the embedding call)")
 
     p_ing = sub.add_parser("ingest", help="Full scan + index")
     p_ing.add_argument("--dir", required=True, help="Repo root to scan")
@@ -810,6 +5618,15 @@ def main():
     p_upd.add_argument("--dir", required=True, help="Repo root")
     add_shared(p_upd)
 
+    p_watch = sub.add_parser("watch", help="Watch the tree with inotify and index changes as they happen")
+    p_watch.add_argument("--dir", required=True, help="Repo root")
+    add_shared(p_watch)
+    p_watch.add_argument("--debounce", type=float, default=2.0, help="Seconds of quiet before a batch of changes is indexed")
+    p_watch.add_argument("--max-delay", type=float, default=30.0, help="Index pending changes after this long even if churn continues")
+    p_watch.add_argument("--rescan-minutes", type=float, default=0,
+                         help="Also do a full scan this often (for changes inotify can't see, e.g. other NFS clients); 0 = never")
+    p_watch.add_argument("--no-initial-scan", action="store_true", help="Skip the catch-up scan at start-up")
+
     p_git = sub.add_parser("update-git", help="Reindex files changed in a git range (e.g., HEAD~1..HEAD)")
     p_git.add_argument("--dir", required=True, help="Repo root (must be a git repo)")
     p_git.add_argument("--git-range", default="HEAD~1..HEAD", help="Git range for diff (A..B)")
@@ -819,29 +5636,109 @@ def main():
     p_rf.add_argument("--path", required=True, help="Path to file")
     add_shared(p_rf)
 
-    p_vac = sub.add_parser("vacuum", help="Remove vectors for deleted files (and clean manifest)")
+    p_rtf = sub.add_parser("retry-failed", help="Re-embed chunks that failed after retries during ingest/update")
+    add_shared(p_rtf)
+    p_rtf.add_argument("--list", action="store_true", help="Only list the failed chunks and their last error")
+    p_rtf.add_argument("--limit", type=int, default=0, help="Retry at most N chunks, oldest attempt first (0 = all)")
+
+    p_vac = sub.add_parser("vacuum", help="Remove vectors for deleted files and orphaned vectors (and clean manifest)")
     p_vac.add_argument("--dir", required=True, help="Repo root")
+    p_vac.add_argument("--dry-run", action="store_true", help="Only report orphaned vectors, don't delete anything")
     add_shared(p_vac)
 
     p_q = sub.add_parser("query", help="Ask a question against the collection")
     p_q.add_argument("question", help="Your question")
     add_shared(p_q)
     p_q.add_argument("--top-k", type=int, default=6)
+    p_q.add_argument("--stream", action="store_true", help="Print the answer token by token as it is generated")
+    add_answer_args(p_q)
+    add_filter_args(p_q)
+
+    p_qb = sub.add_parser("query-batch", help="Answer a JSONL file of questions in one process; writes JSONL results")
+    p_qb.add_argument("input", help="JSONL questions: {\"question\", \"id\"?, \"top_k\"?, \"filter\"?} per line ('-' = stdin)")
+    add_shared(p_qb)
+    p_qb.add_argument("--output", default="-", help="JSONL results, in input order ('-' = stdout)")
+    p_qb.add_argument("--concurrency", type=int, default=4, help="Questions retrieved/generated at the same time")
+    p_qb.add_argument("--no-generate", action="store_true", help="Retrieval only: write hits instead of answers")
+    p_qb.add_argument("--top-k", type=int, default=6)
+    add_answer_args(p_qb)
+    add_filter_args(p_qb)
+
+    p_srv = sub.add_parser("serve", help="Keep store + models warm and answer query/search over local HTTP")
+    add_shared(p_srv)
+    p_srv.add_argument("--host", default="127.0.0.1", help="Bind address (keep it local; put the VPN in front)")
+    p_srv.add_argument("--port", type=int, default=8765)
+    p_srv.add_argument("--top-k", type=int, default=6)
+    add_answer_args(p_srv)
+    p_srv.add_argument("--keep-alive", default="30m", help="Ollama keep_alive for the pinned models (-1 = forever)")
+
+    p_bench = sub.add_parser("bench", help="Benchmark discovery, chunking, embedding, store writes and queries; prints JSON")
+    add_shared(p_bench)
+    p_bench.add_argument("--dir", default=None, help="Benchmark an existing tree instead of generating one")
+    p_bench.add_argument("--synthetic-files", type=int, default=2000, help="Size of the generated repo")
+    p_bench.add_argument("--seed", type=int, default=7)
+    p_bench.add_argument("--work-dir", default=None,
+                         help="Where to generate the repo, and the db unless --db is given (default: a temp dir, "
+                              "removed afterwards)")
+    p_bench.set_defaults(db=None)  # bench writes a throwaway db under --work-dir unless pointed at a real one
+    p_bench.add_argument("--chunk-sample", type=int, default=0, help="Chunk only the first N files (0 = all)")
+    p_bench.add_argument("--embed-chunks", type=int, default=512, help="Chunks to embed for the embedding rate")
+    p_bench.add_argument("--write-rows", type=int, default=5000, help="Rows to write for the store write rate")
+    p_bench.add_argument("--queries", type=int, default=20)
+    p_bench.add_argument("--top-k", type=int, default=6)
+    p_bench.add_argument("--retrieval", choices=["hybrid", "vector", "keyword"], default="hybrid")
+    p_bench.add_argument("--no-generate", action="store_true", help="Time retrieval only (no LLM calls)")
+    p_bench.add_argument("--out", default=None, help="Also write the JSON report here")
+
+    p_llq = sub.add_parser("llm-queue", help="Priority-aware proxy in front of Ollama (interactive queries before bulk ingest)")
+    p_llq.add_argument("--ollama-url", default="http://localhost:11434", help="Upstream Ollama URL(s), comma-separated")
+    p_llq.add_argument("--connect-timeout", type=float, default=5.0)
+    p_llq.add_argument("--read-timeout", type=float, default=None, help="Upstream read timeout (default 600s)")
+    p_llq.add_argument("--host", default="127.0.0.1")
+    p_llq.add_argument("--port", type=int, default=11435)
+    p_llq.add_argument("--default-limit", type=int, default=2, help="Concurrent requests per model (match OLLAMA_NUM_PARALLEL)")
+    p_llq.add_argument("--limit", action="append", metavar="MODEL=N", help="Per-model concurrency limit (repeatable)")
+    p_llq.add_argument("--interactive-reserve", type=int, default=1, help="Slots per model that batch requests never take")
+    p_llq.add_argument("--max-total", type=int, default=0, help="Cap on concurrent requests across all models (0 = none)")
 
     args = parser.parse_args()
 
-    if args.cmd == "ingest":
-        cmd_ingest(args)
-    elif args.cmd == "update":
-        cmd_update(args)
-    elif args.cmd == "update-git":
-        cmd_update_git(args)
-    elif args.cmd == "reindex-file":
-        cmd_reindex_file(args)
-    elif args.cmd == "vacuum":
-        cmd_vacuum(args)
-    elif args.cmd == "query":
-        cmd_query(args)
+    if getattr(args, "metrics_port", 0):
+        start_metrics_server("127.0.0.1", args.metrics_port)
+        print(f"[INFO] Metrics on http://127.0.0.1:{args.metrics_port}/metrics", file=sys.stderr)
+    status = "error"
+    try:
+        if args.cmd == "ingest":
+            cmd_ingest(args)
+        elif args.cmd == "update":
+            cmd_update(args)
+        elif args.cmd == "update-git":
+            cmd_update_git(args)
+        elif args.cmd == "watch":
+            cmd_watch(args)
+        elif args.cmd == "reindex-file":
+            cmd_reindex_file(args)
+        elif args.cmd == "retry-failed":
+            cmd_retry_failed(args)
+        elif args.cmd == "vacuum":
+            cmd_vacuum(args)
+        elif args.cmd == "query":
+            cmd_query(args)
+        elif args.cmd == "query-batch":
+            cmd_query_batch(args)
+        elif args.cmd == "serve":
+            cmd_serve(args)
+        elif args.cmd == "llm-queue":
+            cmd_llm_queue(args)
+        elif args.cmd == "bench":
+            cmd_bench(args)
+        status = "ok"
+    except KeyboardInterrupt:
+        status = "interrupted"
+        raise
+    finally:
+        if getattr(args, "metrics_json", None):
+            write_metrics_json(args.metrics_json, args.cmd, args, status)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,2 @@
+# Unit tests for Rag.py's deterministic pieces (no Ollama or vector DB needed).
+# Run from the repo root: python -m unittest
@@ -0,0 +1,119 @@
+import tempfile
+import unittest
+from pathlib import Path
+
+from Rag import Chunk, ChunkFilter, Manifest, build_chunks_for_file, chunk_content_hash
+
+LICENSE = """/*
+ * Copyright (c) 2019 Example Corp.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ */
+"""
+
+
+def _chunks(root: Path, name: str, text: str):
+    path = root / name
+    path.write_text(text)
+    return build_chunks_for_file(path, "sha", 120, 20, 1200, 200, "syntax")
+
+
+def _run(flt: ChunkFilter, chunks):
+    return flt.apply(flt.begin(), chunks)
+
+
+class ChunkFilterTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.root = Path(self._tmp.name)
+
+    def tearDown(self):
+        self._tmp.cleanup()
+
+    def test_generated_by_name_and_marker(self):
+        flt = ChunkFilter()
+        self.assertEqual(_run(flt, _chunks(self.root, "msg.pb.cc", "int f() { return 1; }\n")), [])
+        self.assertEqual(_run(flt, _chunks(self.root, "t.h", "// Code generated by stringer. DO NOT EDIT.\nint x;\n")), [])
+        self.assertEqual(flt.counts["generated_files"], 2)
+        doc = _chunks(self.root, "notes.md", "This page is auto-generated from the schema.\n")
+        self.assertEqual(len(_run(flt, doc)), 1)  # only code files are treated as generated
+
+    def test_repeated_license_banner_is_stripped_and_rekeyed(self):
+        flt = ChunkFilter()
+        first = _run(flt, _chunks(self.root, "a.cpp", LICENSE + "int a() { return 1; }\n"))
+        self.assertIn("Copyright", first[0].text)
+        body = "int b() { return 2; }\n"
+        kept = _run(flt, _chunks(self.root, "b.cpp", LICENSE.replace("2019", "2023") + body))
+        self.assertEqual(flt.counts["banner"], 1)
+        self.assertNotIn("Copyright", kept[0].text)
+        self.assertEqual(kept[0].metadata["start_line"], 6)
+        chash = chunk_content_hash(kept[0].text)
+        self.assertEqual(kept[0].metadata["chunk_hash"], chash)
+        self.assertTrue(kept[0].id.endswith(":" + chash[:20]))
+
+    def test_comment_mentioning_license_is_not_a_banner(self):
+        flt = ChunkFilter()
+        comment = ("/*\n * Parses the license field of the package manifest and checks\n"
+                   " * the copyright holder list against the allow-list in config.\n */\n")
+        for name in ("a.cpp", "b.cpp"):
+            out = _run(flt, _chunks(self.root, name, comment + f"int {name[0]}() {{ return 0; }}\n"))
+            self.assertIn("license field", out[0].text)
+        self.assertEqual(flt.counts["banner"], 0)
+
+    def test_numeric_table_is_data(self):
+        table = "static const int kTable[] = {\n" + "".join(
+            "  " + ", ".join(f"0x{i * 16 + j:04x}" for j in range(16)) + ",\n" for i in range(16)) + "};\n"
+        flt = ChunkFilter()
+        self.assertEqual(_run(flt, [Chunk("p:1", table, {"filename": "t.cpp"})]), [])
+        self.assertEqual(flt.counts["data"], 1)
+
+    def test_low_entropy_padding(self):
+        flt = ChunkFilter()
+        chunks = [Chunk("p:1", "=" * 400, {"filename": "a.md"}),
+                  Chunk("p:2", "=" * 80 + "\nSection one explains how reconnection works after a timeout.\n" * 5,
+                        {"filename": "a.md"})]
+        out = _run(flt, chunks)
+        self.assertEqual([c.id for c in out], ["p:2"])
+        self.assertEqual(flt.counts["low_entropy"], 1)
+
+    def test_worker_half_defers_the_banner_chunk(self):
+        worker, parent = ChunkFilter(), ChunkFilter()
+        for name in ("a.cpp", "b.cpp"):
+            worker_state, parent_state = ChunkFilter.begin(), ChunkFilter.begin()
+            out = worker.prefilter(worker_state, _chunks(self.root, name, LICENSE + f"int {name[0]}() {{ return 1; }}\n"))
+            self.assertIn("Copyright", out[0].text)  # left whole for the parent
+            parent_state["banner"] = worker_state["banner"]
+            kept = parent.dedup(parent_state, out)
+        self.assertNotIn("Copyright", kept[0].text)
+        self.assertEqual(parent.counts["banner"], 1)
+
+    def test_banner_owner_persists_across_runs(self):
+        m = Manifest.open(str(self.root / "db"), "c")
+        self.addCleanup(m.close)
+        a = LICENSE + "int a() { return 1; }\n"
+        b = LICENSE + "int b() { return 2; }\n"
+        _run(ChunkFilter(owners=m), _chunks(self.root, "a.cpp", a))
+        # A later run that reaches b.cpp first still strips it, and a.cpp keeps the license text.
+        flt = ChunkFilter(owners=m)
+        self.assertNotIn("Copyright", _run(flt, _chunks(self.root, "b.cpp", b))[0].text)
+        self.assertIn("Copyright", _run(flt, _chunks(self.root, "a.cpp", a))[0].text)
+
+    def test_owner_that_drops_its_banner_releases_it(self):
+        m = Manifest.open(str(self.root / "db"), "c")
+        self.addCleanup(m.close)
+        flt = ChunkFilter(owners=m)
+        _run(flt, _chunks(self.root, "a.cpp", LICENSE + "int a() { return 1; }\n"))
+        state = flt.begin()
+        out = flt.apply(state, _chunks(self.root, "a.cpp", "int a() { return 1; }\n"))
+        flt.finish(state, str((self.root / "a.cpp").resolve()))
+        self.assertEqual(len(out), 1)
+        self.assertIn("Copyright", _run(flt, _chunks(self.root, "b.cpp", LICENSE + "int b() { return 2; }\n"))[0].text)
+
+    def test_summary(self):
+        flt = ChunkFilter()
+        _run(flt, _chunks(self.root, "x.pb.h", "int f();\n"))
+        self.assertEqual(flt.summary(), "generated=1 files/1 chunks")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,95 @@
+import unittest
+
+from Rag import _cpp_units, chunk_code_syntax
+
+
+def _covered(parts):
+    lines = set()
+    for _, meta in parts:
+        lines |= set(range(meta["start_line"], meta["end_line"] + 1))
+    return lines
+
+
+def _functions(n: int, prefix: str = "f") -> str:
+    return "".join(f"int {prefix}{i}(int a) {{\n  return a + {i};\n}}\n" for i in range(n))
+
+
+class CppChunkerTest(unittest.TestCase):
+    def assertCoversEveryLine(self, text: str, parts):
+        missing = [n for n, ln in enumerate(text.splitlines(), start=1) if ln.strip() and n not in _covered(parts)]
+        self.assertEqual(missing, [])
+
+    def test_units_split_declarations_blocks_and_preprocessor(self):
+        text = '#include <a.h>\n// doc\nint x = 1;\nstruct S { int y; };\nvoid f() { if (x) { g("}"); } }\n'
+        units = _cpp_units(text, 0, len(text))
+        self.assertEqual([text[u.start : u.end].split("\n")[0] for u in units],
+                         ["#include <a.h>", "// doc", "struct S { int y; };", 'void f() { if (x) { g("}"); } }'])
+        self.assertEqual(units[0].kind, "preproc")
+
+    def test_small_file_is_one_chunk_with_symbols(self):
+        text = "namespace net {\nclass Socket {\n public:\n  void close();\n};\nint Socket::fd() const { return 3; }\n}\n"
+        parts = chunk_code_syntax(text, max_lines=40)
+        self.assertEqual(len(parts), 1)
+        self.assertEqual(parts[0][1]["symbol"], "net")
+        self.assertCoversEveryLine(text, parts)
+
+    def test_split_namespace_keeps_its_opening_and_closing_lines(self):
+        text = "// header\n#include <x>\nnamespace net {\n" + _functions(30) + "/* } */\n}  // namespace net\n// eof\n"
+        parts = chunk_code_syntax(text, max_lines=20, overlap=2)
+        self.assertGreater(len(parts), 1)
+        self.assertCoversEveryLine(text, parts)
+        self.assertEqual(parts[0][1]["start_line"], 1)
+        self.assertTrue(parts[0][1]["symbol"].startswith("net::f0"))
+        self.assertIn("}  // namespace net", parts[-1][0])
+        self.assertIn("// eof", parts[-1][0])
+
+    def test_split_class_qualifies_members(self):
+        body = "".join(f"  int get{i}() const {{\n    return v{i};\n  }}\n" for i in range(20))
+        text = f"class Widget : public Base {{\n public:\n{body}}};\n"
+        parts = chunk_code_syntax(text, max_lines=15)
+        self.assertCoversEveryLine(text, parts)
+        symbols = ", ".join(meta["symbol"] for _, meta in parts)
+        self.assertIn("Widget::get0", symbols)
+        self.assertIn("Widget::get19", symbols)
+
+    def test_nested_namespaces(self):
+        text = "namespace a {\nnamespace {\n" + _functions(12, "g") + "}  // namespace\n}  // namespace a\n"
+        parts = chunk_code_syntax(text, max_lines=10)
+        self.assertCoversEveryLine(text, parts)
+        self.assertTrue(parts[0][1]["symbol"].startswith("a::(anonymous)::g0"))
+        self.assertIn("}  // namespace a", parts[-1][0])
+
+    def test_extern_c_members_are_not_prefixed(self):
+        text = 'extern "C" {\n' + _functions(12, "c_api") + "}\n"
+        parts = chunk_code_syntax(text, max_lines=10)
+        self.assertCoversEveryLine(text, parts)
+        self.assertTrue(parts[0][1]["symbol"].startswith("c_api0"))
+
+    def test_oversized_function_falls_back_to_windows(self):
+        text = "void big() {\n" + "".join(f"  step({i});\n" for i in range(100)) + "}\n"
+        parts = chunk_code_syntax(text, max_lines=30, overlap=5)
+        self.assertGreater(len(parts), 3)
+        self.assertTrue(all(meta["symbol"] == "big" for _, meta in parts))
+        self.assertCoversEveryLine(text, parts)
+
+    def test_symbol_names(self):
+        cases = {
+            "template <typename T>\nT Box<T>::get() const { return v; }\n": "Box<T>::get",
+            "bool operator==(const A& a, const B& b) { return true; }\n": "operator==",
+            "Socket::~Socket() { close(); }\n": "Socket::~Socket",
+            "enum class Color : int { Red, Green };\n": "Color",
+        }
+        for text, symbol in cases.items():
+            with self.subTest(symbol=symbol):
+                self.assertEqual(chunk_code_syntax(text)[0][1]["symbol"], symbol)
+
+    def test_braces_in_literals_and_comments(self):
+        text = ('const char* s = R"x({ not a block })x";\n'
+                "int f() {\n  // }\n  char c = '}';\n  return 0;\n}\n"
+                "int g() { return 1; }\n")
+        units = _cpp_units(text, 0, len(text))
+        self.assertEqual(len(units), 3)
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,90 @@
+import contextlib
+import io
+import shutil
+import subprocess
+import tempfile
+import unittest
+from pathlib import Path
+
+from Rag import Indexer, _git_dirty_paths, _iter_git_changes, sha1_file
+
+BODY = "".join(f"int function_{i}(int a) {{ return a * {i}; }}\n" for i in range(40))
+
+
+@unittest.skipIf(shutil.which("git") is None, "git not installed")
+class GitChangesTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.root = Path(self._tmp.name).resolve()
+        self.git("init", "-q")
+        self.git("config", "user.email", "t@example.com")
+        self.git("config", "user.name", "t")
+        self.write("src/keep.cpp", "int keep();\n")
+        self.write("src/old name.cpp", BODY)
+        self.write("src/gone.h", "#pragma once\n")
+        self.commit("base")
+
+    def tearDown(self):
+        self._tmp.cleanup()
+
+    def git(self, *argv: str) -> str:
+        return subprocess.check_output(["git", "-C", str(self.root), *argv], text=True)
+
+    def write(self, rel: str, text: str):
+        p = self.root / rel
+        p.parent.mkdir(parents=True, exist_ok=True)
+        p.write_text(text)
+
+    def commit(self, msg: str):
+        self.git("add", "-A")
+        self.git("commit", "-q", "-m", msg)
+
+    def test_rename_delete_modify_add(self):
+        self.git("mv", "src/old name.cpp", "src/new name.cpp")
+        self.write("src/new name.cpp", BODY + "int extra();\n")
+        self.git("rm", "-q", "src/gone.h")
+        self.write("src/keep.cpp", "int keep(int);\n")
+        self.write("src/added.cpp", "int added();\n")
+        self.commit("change")
+
+        changes = {c.status: c for c in _iter_git_changes(self.root, "HEAD~1..HEAD")}
+        self.assertEqual(sorted(changes), ["A", "D", "M", "R"])
+        ren = changes["R"]
+        self.assertEqual((ren.old_path, ren.path), (self.root / "src/old name.cpp", self.root / "src/new name.cpp"))
+        self.assertLess(ren.score, 100)
+        self.assertEqual(ren.blob, sha1_file(ren.path))  # blob ids are content keys, same as the manifest's
+        self.assertEqual(changes["D"].path, self.root / "src/gone.h")
+        self.assertIsNone(changes["D"].blob)
+        self.assertEqual(changes["M"].blob, sha1_file(self.root / "src/keep.cpp"))
+        self.assertEqual(changes["A"].path, self.root / "src/added.cpp")
+
+    def test_worktree_side_has_no_blob(self):
+        self.write("src/keep.cpp", "int keep(long);\n")
+        changes = _iter_git_changes(self.root, "HEAD")
+        self.assertEqual([(c.status, c.path, c.blob) for c in changes], [("M", self.root / "src/keep.cpp", None)])
+
+    def test_dirty_paths_only_when_range_ends_at_head(self):
+        self.write("src/keep.cpp", "int keep(long);\n")
+        self.assertEqual(_git_dirty_paths(self.root, "HEAD~0..HEAD"), {str(self.root / "src/keep.cpp")})
+        self.write("src/x.cpp", "int x();\n")
+        self.commit("second")
+        self.assertIsNone(_git_dirty_paths(self.root, "HEAD~1"))
+
+    def test_bad_range_returns_none(self):
+        with contextlib.redirect_stdout(io.StringIO()):
+            self.assertIsNone(_iter_git_changes(self.root, "no-such-rev..HEAD"))
+
+
+class CanMoveTest(unittest.TestCase):
+    def test_same_chunker_moves(self):
+        for old, new in (("a.cpp", "b/a.h"), ("a.cmake", "a.mk"), ("a.md", "a.txt"), ("a.htm", "a.html")):
+            self.assertTrue(Indexer.can_move(Path(old), Path(new)), (old, new))
+
+    def test_other_chunker_or_filter_reindexes(self):
+        for old, new in (("a.txt", "a.cpp"), ("CMakeLists.txt", "cmake.txt"), ("a.cmake", "CMakeLists.txt"),
+                         ("a.cpp", "a.cmake"), ("a.md", "a.pdf"), ("msg.cc", "msg.pb.cc")):
+            self.assertFalse(Indexer.can_move(Path(old), Path(new)), (old, new))
+
+
+if __name__ == "__main__":
+    unittest.main()
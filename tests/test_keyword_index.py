@@ -0,0 +1,90 @@
+import tempfile
+import unittest
+from pathlib import Path
+
+from Rag import Hit, KeywordIndex, code_terms, looks_like_symbol, rrf_fuse, split_identifier
+
+
+def _hit(cid: str, score: float = 0.0) -> Hit:
+    return Hit(cid, f"text of {cid}", {"source_path": f"/r/{cid}.cpp"}, score)
+
+
+class IdentifierTest(unittest.TestCase):
+    def test_split_identifier(self):
+        self.assertEqual(split_identifier("upsert_file"), ["upsert", "file"])
+        self.assertEqual(split_identifier("HttpClientPool"), ["http", "client", "pool"])
+        self.assertEqual(split_identifier("~HTTPServer2"), ["http", "server"])
+
+    def test_code_terms_keep_qualified_names_in_order(self):
+        idents, parts = code_terms("void Indexer::upsert_file(Path p);")
+        self.assertEqual(idents, "void indexer upsert_file path")
+        self.assertEqual(parts, "upsert file")
+
+    def test_looks_like_symbol(self):
+        for q in ("Indexer::upsert_file", "chunk_code_lines", "OllamaClient", "`reset()`"):
+            self.assertTrue(looks_like_symbol(q), q)
+        for q in ("how does reconnect work", "socket", "_"):
+            self.assertFalse(looks_like_symbol(q), q)
+
+
+class BuildQueryTest(unittest.TestCase):
+    def test_qualified_name_becomes_phrase_plus_terms(self):
+        self.assertEqual(KeywordIndex.build_query("Indexer::upsert_file"),
+                         'idents : "indexer upsert_file" OR "indexer" OR "upsert_file" OR "upsert" OR "file"')
+
+    def test_stopwords_and_duplicates_are_dropped(self):
+        self.assertEqual(KeywordIndex.build_query("how does the socket reconnect the socket"), '"socket" OR "reconnect"')
+
+    def test_nothing_searchable(self):
+        self.assertEqual(KeywordIndex.build_query("how is it?"), "")
+
+    def test_quotes_cannot_break_the_expression(self):
+        expr = KeywordIndex.build_query('foo" OR bar')
+        self.assertEqual(expr, '"foo" OR "bar"')
+
+
+class KeywordIndexTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.idx = KeywordIndex(Path(self._tmp.name) / "kw.sqlite")
+        self.idx.add(["a:1", "b:1", "c:1"],
+                     ["void Indexer::upsert_file() {}", "int upsert_row(); // file", "void reconnect_socket();"],
+                     ["/r/src/indexer.cpp", "/r/src/db.h", "/r/net/socket.cpp"])
+
+    def tearDown(self):
+        self.idx._db.close()
+        self._tmp.cleanup()
+
+    def test_exact_symbol_ranks_first(self):
+        ranked = self.idx.search("Indexer::upsert_file", 3)
+        self.assertEqual(ranked[0][0], "a:1")
+        self.assertGreater(ranked[0][1], ranked[-1][1])
+
+    def test_re_adding_an_id_replaces_it(self):
+        self.idx.add(["c:1"], ["void close_socket();"], ["/r/net/socket.cpp"])
+        self.assertEqual(self.idx.count(), 3)
+        self.assertEqual(self.idx.search("reconnect", 3), [])
+        self.assertEqual([cid for cid, _ in self.idx.search("close_socket", 3)], ["c:1"])
+
+    def test_delete_by_source_path(self):
+        self.idx.delete_by_source_paths(["/r/src/indexer.cpp"])
+        self.assertNotIn("a:1", [cid for cid, _ in self.idx.search("upsert_file", 3)])
+        self.assertEqual(self.idx.count(), 2)
+
+
+class RrfFuseTest(unittest.TestCase):
+    def test_documents_in_both_rankings_win(self):
+        vector = [_hit("a", 0.9), _hit("b", 0.8), _hit("c", 0.7)]
+        keyword = [_hit("c", 12.0), _hit("d", 9.0), _hit("a", 3.0)]
+        fused = rrf_fuse([vector, keyword], top_k=3)
+        self.assertEqual([h.id for h in fused], ["a", "c", "b"])
+        self.assertAlmostEqual(fused[0].score, 1 / 61 + 1 / 63)
+        self.assertEqual(fused[0].text, "text of a")
+
+    def test_top_k_and_empty_rankings(self):
+        self.assertEqual([h.id for h in rrf_fuse([[], [_hit("x"), _hit("y")]], top_k=1)], ["x"])
+        self.assertEqual(rrf_fuse([[], []], top_k=5), [])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,158 @@
+import contextlib
+import http.client
+import json
+import threading
+import time
+import unittest
+from http.server import ThreadingHTTPServer
+
+from Rag import LLMQueueProxy, LLMScheduler
+
+
+class _Holder:
+    """Runs `scheduler.slot(model, priority)` in a thread and keeps the slot until released."""
+
+    def __init__(self, scheduler: LLMScheduler, model: str, priority: str):
+        self.admitted = threading.Event()
+        self.release = threading.Event()
+        self.thread = threading.Thread(target=self._run, args=(scheduler, model, priority), daemon=True)
+        self.thread.start()
+
+    def _run(self, scheduler, model, priority):
+        with scheduler.slot(model, priority):
+            self.admitted.set()
+            self.release.wait(5)
+
+
+def _finish(*holders: _Holder):
+    for h in holders:
+        h.release.set()
+    for h in holders:
+        h.thread.join(5)
+
+
+def _wait_queued(scheduler: LLMScheduler, priority: str, n: int):
+    for _ in range(500):
+        if scheduler.stats()["waiting"][priority] >= n:
+            return
+        time.sleep(0.01)
+    raise AssertionError(f"expected {n} {priority} waiter(s)")
+
+
+class LLMSchedulerTest(unittest.TestCase):
+    def test_interactive_waiter_does_not_block_other_models(self):
+        s = LLMScheduler(default_limit=1, interactive_reserve=0)
+        running = _Holder(s, "llama3", "interactive")
+        self.assertTrue(running.admitted.wait(5))
+        queued = _Holder(s, "llama3", "interactive")
+        _wait_queued(s, "interactive", 1)
+        batch = _Holder(s, "nomic-embed-text", "batch")
+        try:
+            self.assertTrue(batch.admitted.wait(5), s.stats())
+            self.assertFalse(queued.admitted.is_set())
+        finally:
+            _finish(running, queued, batch)
+
+    def test_interactive_waiter_blocks_batch_for_same_model(self):
+        s = LLMScheduler(default_limit=2, interactive_reserve=0)
+        first = _Holder(s, "llama3", "interactive")
+        second = _Holder(s, "llama3", "interactive")
+        self.assertTrue(first.admitted.wait(5) and second.admitted.wait(5))
+        queued = _Holder(s, "llama3", "interactive")
+        _wait_queued(s, "interactive", 1)
+        batch = _Holder(s, "llama3", "batch")
+        _wait_queued(s, "batch", 1)
+        try:
+            first.release.set()
+            self.assertTrue(queued.admitted.wait(5))
+            self.assertFalse(batch.admitted.wait(0.2))
+        finally:
+            _finish(first, second, queued, batch)
+
+    def test_max_total_blocks_batch_across_models(self):
+        s = LLMScheduler(default_limit=1, interactive_reserve=0, max_total=2)
+        running = _Holder(s, "llama3", "interactive")
+        self.assertTrue(running.admitted.wait(5))
+        queued = _Holder(s, "llama3", "interactive")
+        _wait_queued(s, "interactive", 1)
+        batch = _Holder(s, "nomic-embed-text", "batch")
+        try:
+            self.assertFalse(batch.admitted.wait(0.2))
+        finally:
+            _finish(running, queued, batch)
+
+    def test_batch_leaves_interactive_reserve(self):
+        s = LLMScheduler(default_limit=2, interactive_reserve=1)
+        batch = _Holder(s, "llama3", "batch")
+        self.assertTrue(batch.admitted.wait(5))
+        second = _Holder(s, "llama3", "batch")
+        interactive = _Holder(s, "llama3", "interactive")
+        try:
+            self.assertTrue(interactive.admitted.wait(5))
+            self.assertFalse(second.admitted.is_set())
+        finally:
+            _finish(batch, second, interactive)
+
+    def test_limit_falls_back_to_model_family(self):
+        s = LLMScheduler(default_limit=2, limits={"llama3": 4})
+        self.assertEqual(s.limit("llama3:8b"), 4)
+        self.assertEqual(s.limit("mistral"), 2)
+
+
+class _Upstream:
+    """Fake OllamaClient: a streaming 200 that yields `lines`, then raises `fail` (if set)."""
+
+    def __init__(self, lines, fail=None):
+        self.lines, self.fail = lines, fail
+
+    @contextlib.contextmanager
+    def _call(self, path, body, method="POST", stream=False):
+        up = self
+
+        class Response:
+            status_code = 200
+            headers = {"Content-Type": "application/x-ndjson"}
+            content = b"{}"
+
+            def iter_lines(self):
+                yield from up.lines
+                if up.fail:
+                    raise up.fail
+
+        yield None, Response()
+
+
+class LLMQueueProxyTest(unittest.TestCase):
+    def _chat(self, upstream):
+        httpd = ThreadingHTTPServer(("127.0.0.1", 0), LLMQueueProxy(upstream, LLMScheduler()).make_handler())
+        threading.Thread(target=httpd.serve_forever, daemon=True).start()
+        try:
+            conn = http.client.HTTPConnection("127.0.0.1", httpd.server_address[1], timeout=5)
+            conn.request("POST", "/api/chat", json.dumps({"model": "m", "stream": True}))
+            resp = conn.getresponse()
+            lines = [json.loads(ln) for ln in resp.read().splitlines() if ln]
+            conn.close()
+            return resp.status, lines
+        finally:
+            httpd.shutdown()
+            httpd.server_close()
+
+    def test_relays_stream(self):
+        self.assertEqual(self._chat(_Upstream([b'{"a": 1}', b'{"done": true}'])), (200, [{"a": 1}, {"done": True}]))
+
+    def test_upstream_error_mid_stream_ends_the_body(self):
+        status, lines = self._chat(_Upstream([b'{"a": 1}'], fail=OSError("reset by peer")))
+        self.assertEqual(status, 200)
+        self.assertEqual(lines, [{"a": 1}, {"error": "llm-queue: OSError: reset by peer"}])
+
+    def test_upstream_error_before_stream_is_502(self):
+        class Down(_Upstream):
+            def _call(self, *a, **kw):
+                raise OSError("connection refused")
+
+        status, lines = self._chat(Down([]))
+        self.assertEqual((status, lines), (502, [{"error": "llm-queue: OSError: connection refused"}]))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,144 @@
+import tempfile
+import time
+import unittest
+from unittest import mock
+from collections import Counter
+from pathlib import Path
+
+from Rag import Chunk, FileRecord, Indexer, Manifest, _jobs_needing_update, fast_sig
+
+
+def _chunk(cid: str, path: str, line: int) -> Chunk:
+    return Chunk(cid, f"int f{line}();", {"source_path": path, "start_line": line, "end_line": line + 2,
+                                          "symbol": "ns::f", "page": None, "entry_index": 0})
+
+
+class ManifestTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.db = self._tmp.name
+        self.m = Manifest.open(self.db, "c")
+
+    def tearDown(self):
+        self.m.close()
+        self._tmp.cleanup()
+
+    def reopen(self):
+        self.m.close()
+        self.m = Manifest.open(self.db, "c")
+
+    def test_records_round_trip(self):
+        self.m.upsert(FileRecord("/r/a.cpp", 10, 1.5, "abc", 3))
+        self.m.commit()
+        self.reopen()
+        self.assertEqual(self.m.get("/r/a.cpp"), FileRecord("/r/a.cpp", 10, 1.5, "abc", 3))
+        self.assertEqual(self.m.paths_with_sha("abc"), ["/r/a.cpp"])
+        self.assertEqual(len(self.m), 1)
+
+    def test_failed_chunks_round_trip(self):
+        chunks = [_chunk("k:1", "/r/a.cpp", 1), _chunk("k:2", "/r/a.cpp", 10)]
+        self.m.upsert(FileRecord("/r/a.cpp", 10, 1.5, "abc", 0))
+        self.m.set_failed("/r/a.cpp", [(chunks[0], "HTTP 500"), (chunks[1], "ReadTimeout: read timed out")])
+        self.m.commit()
+        self.reopen()
+        got = self.m.failed_chunks()
+        self.assertEqual(sorted(c.id for _, c, _, _ in got), ["k:1", "k:2"])
+        errors = {c.id: e for _, c, _, e in got}
+        self.assertEqual(errors, {"k:1": "HTTP 500", "k:2": "ReadTimeout: read timed out"})
+        for path, ch, attempts, _ in got:
+            self.assertEqual((path, attempts), ("/r/a.cpp", 1))
+            self.assertEqual(ch, next(c for c in chunks if c.id == ch.id))
+        self.assertEqual(self.m.failed_count("/r/a.cpp"), 2)
+        self.assertEqual(len(self.m.failed_chunks(limit=1)), 1)
+
+    def test_set_failed_replaces_a_files_entries(self):
+        self.m.set_failed("/r/a.cpp", [(_chunk("k:1", "/r/a.cpp", 1), None), (_chunk("k:2", "/r/a.cpp", 10), None)])
+        self.m.set_failed("/r/b.cpp", [(_chunk("b:1", "/r/b.cpp", 1), None)])
+        self.m.set_failed("/r/a.cpp", [(_chunk("k:3", "/r/a.cpp", 20), None)])
+        self.assertEqual(sorted(c.id for _, c, _, _ in self.m.failed_chunks()), ["b:1", "k:3"])
+        self.m.set_failed("/r/a.cpp", [])
+        self.assertEqual(self.m.failed_count("/r/a.cpp"), 0)
+
+    def test_resolve_failed(self):
+        self.m.set_failed("/r/a.cpp", [(_chunk("k:1", "/r/a.cpp", 1), "timeout"), (_chunk("k:2", "/r/a.cpp", 10), "timeout")])
+        time.sleep(0.01)
+        self.m.resolve_failed(["k:1"], [("k:2", None)])
+        self.m.commit()
+        self.reopen()
+        [(_, ch, attempts, err)] = self.m.failed_chunks()
+        self.assertEqual((ch.id, attempts, err), ("k:2", 2, "timeout"))  # no new error keeps the old one
+        self.m.resolve_failed([], [("k:2", "HTTP 503")])
+        self.assertEqual(self.m.failed_chunks()[0][2:], (3, "HTTP 503"))
+
+    def test_oldest_attempt_first(self):
+        self.m.set_failed("/r/a.cpp", [(_chunk("a:1", "/r/a.cpp", 1), None)])
+        time.sleep(0.01)
+        self.m.set_failed("/r/b.cpp", [(_chunk("b:1", "/r/b.cpp", 1), None)])
+        time.sleep(0.01)
+        self.m.resolve_failed([], [("a:1", None)])
+        self.assertEqual([c.id for _, c, _, _ in self.m.failed_chunks()], ["b:1", "a:1"])
+
+    def test_remove_and_clear_drop_failures(self):
+        self.m.upsert(FileRecord("/r/a.cpp", 1, 1.0, "s", 0))
+        self.m.set_failed("/r/a.cpp", [(_chunk("k:1", "/r/a.cpp", 1), None)])
+        self.m.set_failed("/r/b.cpp", [(_chunk("b:1", "/r/b.cpp", 1), None)])
+        self.m.remove("/r/a.cpp")
+        self.assertIsNone(self.m.get("/r/a.cpp"))
+        self.assertEqual(self.m.failed_count(), 1)
+        self.m.clear()
+        self.assertEqual(self.m.failed_count(), 0)
+
+
+
+class EmbedErrorsTest(unittest.TestCase):
+    def test_each_failed_text_keeps_its_own_error(self):
+        def embed_texts(texts):
+            if len(texts) > 1:
+                raise RuntimeError("batch rejected")
+            if texts[0] == "bad":
+                raise ValueError("input too long")
+            if texts[0] == "worse":
+                raise TimeoutError("read timed out")
+            return [[1.0]]
+
+        ix = Indexer.__new__(Indexer)
+        ix._embed_texts = embed_texts
+        with mock.patch("Rag.time.sleep"):
+            vecs, errors = ix._embed_uncached(["ok", "bad", "worse"])
+        self.assertEqual(vecs, [[1.0], None, None])
+        self.assertEqual(errors, [None, "ValueError: input too long", "TimeoutError: read timed out"])
+
+class JobsNeedingUpdateTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.root = Path(self._tmp.name)
+        self.m = Manifest.open(str(self.root / "db"), "c")
+
+    def tearDown(self):
+        self.m.close()
+        self._tmp.cleanup()
+
+    def write(self, name: str, size: int) -> Path:
+        p = self.root / name
+        p.write_bytes(b"x" * size)
+        return p
+
+    def test_size_cap_skips_code_but_not_documents(self):
+        big_cpp, big_pdf, small = self.write("gen.cpp", 200), self.write("manual.pdf", 200), self.write("a.h", 10)
+        stats = Counter()
+        jobs = list(_jobs_needing_update([big_cpp, big_pdf, small], self.m, 100, stats))
+        self.assertEqual([j.path for j in jobs], [big_pdf, small])
+        self.assertEqual(stats["too_big"], 1)
+
+    def test_known_file_that_outgrew_the_cap_is_dropped(self):
+        p = self.write("gen.cpp", 10)
+        size, mtime = fast_sig(p)
+        self.m.upsert(FileRecord(str(p), size, mtime, "s", 2))
+        self.write("gen.cpp", 200)
+        dropped = []
+        self.assertEqual(list(_jobs_needing_update([p], self.m, 100, dropped=dropped)), [])
+        self.assertEqual(dropped, [str(p)])
+
+
+if __name__ == "__main__":
+    unittest.main()
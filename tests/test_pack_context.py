@@ -0,0 +1,65 @@
+import unittest
+
+from Rag import Hit, approx_tokens, pack_context
+
+
+def _hit(cid: str, path: str, start: int, lines, score: float = 1.0, **meta) -> Hit:
+    text = "\n".join(lines)
+    return Hit(cid, text, {"source_path": path, "filename": path.rsplit("/", 1)[-1], "start_line": start,
+                           "end_line": start + len(lines) - 1, **meta}, score)
+
+
+def _lines(a: int, b: int, tag: str = "x"):
+    return [f"int {tag}{i} = compute_{tag}({i}, other_value_{i});" for i in range(a, b + 1)]
+
+
+class PackContextTest(unittest.TestCase):
+    def test_overlapping_chunks_of_one_file_merge(self):
+        hits = [_hit("b", "/r/a.cpp", 11, _lines(11, 30), 0.9), _hit("a", "/r/a.cpp", 1, _lines(1, 15), 0.5)]
+        out = pack_context(hits)
+        self.assertEqual(len(out), 1)
+        self.assertEqual((out[0].metadata["start_line"], out[0].metadata["end_line"]), (1, 30))
+        self.assertEqual(out[0].text, "\n".join(_lines(1, 30)))
+        self.assertEqual(out[0].score, 0.9)
+
+    def test_adjacent_chunks_merge_and_gaps_do_not(self):
+        hits = [_hit("a", "/r/a.cpp", 1, _lines(1, 10)), _hit("b", "/r/a.cpp", 11, _lines(11, 20)),
+                _hit("c", "/r/a.cpp", 40, _lines(40, 50))]
+        out = pack_context(hits)
+        self.assertEqual([(h.metadata["start_line"], h.metadata["end_line"]) for h in out], [(1, 20), (40, 50)])
+
+    def test_merged_block_keeps_rank_of_best_member(self):
+        hits = [_hit("o", "/r/other.cpp", 1, _lines(1, 5, "o")), _hit("b", "/r/a.cpp", 6, _lines(6, 10)),
+                _hit("a", "/r/a.cpp", 1, _lines(1, 5))]
+        self.assertEqual([h.metadata["filename"] for h in pack_context(hits)], ["other.cpp", "a.cpp"])
+
+    def test_pages_are_not_merged(self):
+        hits = [_hit("a", "/r/d.pdf", 1, ["alpha beta"], page=1), _hit("b", "/r/d.pdf", 2, ["gamma delta"], page=2)]
+        self.assertEqual(len(pack_context(hits)), 2)
+
+    def test_near_duplicate_of_better_hit_is_dropped(self):
+        body = _lines(1, 20, "v")
+        hits = [_hit("a", "/r/vendor1/x.cpp", 1, body), _hit("b", "/r/vendor2/x.cpp", 1, body[:-1] + ["int tail;"]),
+                _hit("c", "/r/y.cpp", 1, _lines(1, 20, "y"))]
+        self.assertEqual([h.id for h in pack_context(hits)], ["a", "c"])
+
+    def test_budget_cuts_the_first_block_that_does_not_fit(self):
+        hits = [_hit("a", "/r/a.cpp", 1, _lines(1, 40, "a")), _hit("b", "/r/b.cpp", 1, _lines(1, 40, "b")),
+                _hit("c", "/r/c.cpp", 1, _lines(1, 40, "c"))]
+        budget = approx_tokens(hits[0].text) + 24 + 300
+        out = pack_context(hits, token_budget=budget)
+        self.assertEqual([h.id for h in out], ["a", "b"])
+        self.assertEqual(out[0].text, hits[0].text)
+        self.assertTrue(out[1].text.endswith("…[truncated]"))
+        kept = out[1].text.splitlines()[:-1]
+        self.assertEqual(out[1].metadata["end_line"], len(kept))
+        self.assertLessEqual(sum(approx_tokens(h.text) + 24 for h in out), budget + 24)
+
+    def test_small_remainder_is_not_used(self):
+        hits = [_hit("a", "/r/a.cpp", 1, _lines(1, 40, "a")), _hit("b", "/r/b.cpp", 1, _lines(1, 40, "b"))]
+        out = pack_context(hits, token_budget=approx_tokens(hits[0].text) + 24 + 100)
+        self.assertEqual([h.id for h in out], ["a"])
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,70 @@
+import tempfile
+import unittest
+
+from Rag import QdrantStore, open_store
+
+
+class _Response:
+    def __init__(self, status: int, result=None):
+        self.status_code = status
+        self.text = ""
+        self._result = result
+
+    def json(self):
+        return {"result": self._result}
+
+
+class _Session:
+    """Records requests; the collection doesn't exist until it is PUT."""
+
+    def __init__(self):
+        self.calls = []
+        self.created = False
+
+    def request(self, method, url, json=None, timeout=None):
+        self.calls.append((method, url.rsplit("/collections/c", 1)[1], json))
+        if method == "GET" and not self.created:
+            return _Response(404)
+        if method == "PUT" and url.endswith("/collections/c"):
+            self.created = True
+        return _Response(200, [] if url.endswith("/points/search") else True)
+
+
+def _store(dtype: str) -> QdrantStore:
+    store = QdrantStore("http://qdrant", "c", dtype=dtype)
+    store.session = _Session()
+    return store
+
+
+class QdrantStoreTest(unittest.TestCase):
+    def created_with(self, store: QdrantStore):
+        store.add(["a:1"], [[0.6, 0.8]], ["int f();"], [{"source_path": "/r/a.cpp"}])
+        return next(body for method, path, body in store.session.calls if method == "PUT" and path == "")
+
+    def search_body(self, store: QdrantStore):
+        store.query(query_embedding=[1.0, 0.0], n_results=3)
+        return store.session.calls[-1][2]
+
+    def test_float32_is_plain(self):
+        store = _store("float32")
+        self.assertEqual(self.created_with(store), {"vectors": {"size": 2, "distance": "Cosine"}})
+        self.assertNotIn("params", self.search_body(store))
+
+    def test_float16_sets_the_vector_datatype(self):
+        store = _store("float16")
+        self.assertEqual(self.created_with(store)["vectors"]["datatype"], "float16")
+
+    def test_int8_quantises_in_ram_and_rescores(self):
+        store = _store("int8")
+        body = self.created_with(store)
+        self.assertEqual(body["quantization_config"], {"scalar": {"type": "int8", "quantile": 0.99, "always_ram": True}})
+        self.assertTrue(body["vectors"]["on_disk"])
+        self.assertTrue(self.search_body(store)["params"]["quantization"]["rescore"])
+
+    def test_chroma_refuses_a_quantised_index(self):
+        with tempfile.TemporaryDirectory() as db, self.assertRaises(SystemExit):
+            open_store(db, "c", index_dtype="int8")
+
+
+if __name__ == "__main__":
+    unittest.main()
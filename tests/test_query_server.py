@@ -0,0 +1,77 @@
+import http.client
+import json
+import threading
+import unittest
+from http.server import ThreadingHTTPServer
+
+from Rag import QueryServer
+
+
+class _FakeServer:
+    """Stands in for QueryServer: stream_query yields `events`, raising `fail` after them if set."""
+
+    def __init__(self, events, fail=None):
+        self.events, self.fail = events, fail
+
+    def stream_query(self, body):
+        yield from self.events
+        if self.fail:
+            raise self.fail
+
+    def handle(self, path, body):
+        raise KeyError(path)
+
+
+def _serve(fake):
+    httpd = ThreadingHTTPServer(("127.0.0.1", 0), QueryServer.make_handler(fake))
+    threading.Thread(target=httpd.serve_forever, daemon=True).start()
+    return httpd
+
+
+def _post_stream(port: int):
+    conn = http.client.HTTPConnection("127.0.0.1", port, timeout=5)
+    conn.request("POST", "/query", json.dumps({"question": "q", "stream": True}), {"Content-Type": "application/json"})
+    resp = conn.getresponse()
+    lines = [json.loads(ln) for ln in resp.read().splitlines() if ln]
+    conn.close()
+    return resp.status, lines
+
+
+class QueryServerStreamTest(unittest.TestCase):
+    def test_stream_ends_cleanly(self):
+        httpd = _serve(_FakeServer([{"sources": []}, {"token": "a"}, {"done": True}]))
+        try:
+            status, lines = _post_stream(httpd.server_address[1])
+        finally:
+            httpd.shutdown()
+            httpd.server_close()
+        self.assertEqual(status, 200)
+        self.assertEqual(lines, [{"sources": []}, {"token": "a"}, {"done": True}])
+
+    def test_error_after_headers_is_a_final_event(self):
+        httpd = _serve(_FakeServer([{"sources": []}, {"token": "a"}], fail=RuntimeError("ollama went away")))
+        try:
+            status, lines = _post_stream(httpd.server_address[1])
+        finally:
+            httpd.shutdown()
+            httpd.server_close()
+        self.assertEqual(status, 200)
+        self.assertEqual(lines[:2], [{"sources": []}, {"token": "a"}])
+        self.assertEqual(lines[2], {"error": "RuntimeError: ollama went away", "done": True})
+        self.assertEqual(len(lines), 3)
+
+    def test_error_before_headers_is_a_status(self):
+        httpd = _serve(_FakeServer([], fail=ValueError("bad page range")))
+        try:
+            conn = http.client.HTTPConnection("127.0.0.1", httpd.server_address[1], timeout=5)
+            conn.request("POST", "/query", json.dumps({"stream": True}))
+            resp = conn.getresponse()
+            self.assertEqual((resp.status, json.loads(resp.read())), (400, {"error": "bad page range"}))
+            conn.close()
+        finally:
+            httpd.shutdown()
+            httpd.server_close()
+
+
+if __name__ == "__main__":
+    unittest.main()
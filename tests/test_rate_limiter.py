@@ -0,0 +1,101 @@
+import unittest
+
+from Rag import AdaptiveConcurrency, LatencyBaseline, RateLimiter
+
+
+class LatencyBaselineTest(unittest.TestCase):
+    def test_sizes_are_compared_within_their_class(self):
+        b = LatencyBaseline()
+        self.assertAlmostEqual(b.ratio(0.02, 1), 1.0)
+        self.assertAlmostEqual(b.ratio(0.30, 64), 1.0)
+        self.assertAlmostEqual(b.ratio(0.60, 64), 2.0)
+        self.assertAlmostEqual(b.ratio(0.60, 100), 2.0)  # same power-of-two class as 64
+        self.assertAlmostEqual(b.ratio(0.04, 1), 2.0)
+
+    def test_window_forgets_old_best(self):
+        b = LatencyBaseline(window=2)
+        b.ratio(0.1, 8)
+        b.ratio(0.5, 8)
+        self.assertAlmostEqual(b.ratio(0.5, 8), 1.0)
+
+
+class RateLimiterTest(unittest.TestCase):
+    def test_small_request_does_not_throttle_full_batches(self):
+        rl = RateLimiter(10.0)
+        rl._on_success(0.02, 1)
+        for _ in range(20):
+            rl._on_success(0.30, 64)
+        self.assertEqual(rl.rate, 10.0)
+
+    def test_slow_response_halves_then_recovers(self):
+        rl = RateLimiter(10.0)
+        rl._on_success(0.30, 64)
+        rl._on_success(1.50, 64)
+        self.assertEqual(rl.rate, 5.0)
+        for _ in range(5):
+            rl._on_success(0.30, 64)
+        self.assertEqual(rl.rate, 10.0)
+
+    def test_backoff_floor(self):
+        rl = RateLimiter(1.0)
+        for _ in range(10):
+            rl._backoff()
+        self.assertEqual(rl.rate, 0.1)
+
+    def test_unlimited_ignores_feedback(self):
+        rl = RateLimiter(0)
+        rl._on_success(0.01, 1)
+        rl._on_success(5.0, 1)
+        rl._backoff()
+        self.assertTrue(rl.unlimited)
+        self.assertEqual(rl.rate, 0.0)
+        with rl.slot(4):
+            pass
+
+
+def _latency(items: int) -> float:
+    return 0.2 + 0.001 * items  # fixed per-request overhead dominates small batches
+
+
+class AdaptiveConcurrencyTest(unittest.TestCase):
+    def _overload(self, ctl: AdaptiveConcurrency):
+        ctl._since_cut = ctl.limit  # as if a round of responses had passed since the last cut
+        ctl.on_overload()
+
+    def test_clean_rounds_grow_limit_and_batch(self):
+        ctl = AdaptiveConcurrency(max_limit=8, max_batch=64, start=2)
+        ctl.batch = 8
+        for _ in range(40):
+            ctl.on_success(_latency(ctl.batch), ctl.batch)
+        self.assertEqual(ctl.limit, 8)
+        self.assertEqual(ctl.batch, 64)
+
+    def test_overload_halves_limit_and_batch(self):
+        ctl = AdaptiveConcurrency(max_limit=8, max_batch=64, start=8)
+        self._overload(ctl)
+        self.assertEqual((ctl.limit, ctl.batch), (4, 32))
+        ctl.on_overload()  # same round: no second cut
+        self.assertEqual((ctl.limit, ctl.batch), (4, 32))
+
+    def test_recovers_after_batch_shrinks(self):
+        ctl = AdaptiveConcurrency(max_limit=8, max_batch=64, start=8)
+        for _ in range(16):
+            ctl.on_success(_latency(64), 64)
+        self._overload(ctl)
+        self._overload(ctl)
+        self.assertEqual((ctl.limit, ctl.batch), (2, 16))
+        for _ in range(60):
+            ctl.on_success(_latency(ctl.batch), ctl.batch)
+        self.assertEqual(ctl.limit, 8)
+        self.assertEqual(ctl.batch, 64)
+
+    def test_slow_responses_cut_limit(self):
+        ctl = AdaptiveConcurrency(max_limit=8, max_batch=64, start=8)
+        for _ in range(8):
+            ctl.on_success(0.3, 64)
+        ctl.on_success(1.0, 64)
+        self.assertEqual(ctl.limit, 6)
+
+
+if __name__ == "__main__":
+    unittest.main()
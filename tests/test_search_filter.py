@@ -0,0 +1,79 @@
+import os
+import unittest
+
+from Rag import ChromaStore, QdrantStore, SearchFilter
+
+
+class ParseTest(unittest.TestCase):
+    def test_nothing_set_is_none(self):
+        self.assertIsNone(SearchFilter.parse())
+        self.assertIsNone(SearchFilter.parse(exts=[" , "], pages=""))
+
+    def test_lists_and_comma_separated_values(self):
+        flt = SearchFilter.parse(exts=["h,.CPP", "h"], repos="netlib, core")
+        self.assertEqual(flt.exts, (".h", ".cpp"))
+        self.assertEqual(flt.repos, ("netlib", "core"))
+
+    def test_path_prefix_is_absolute_and_keeps_trailing_slash(self):
+        self.assertEqual(SearchFilter.parse(path_prefix="src/net/").path_prefix, os.path.abspath("src/net") + "/")
+        self.assertEqual(SearchFilter.parse(path_prefix="src/net").path_prefix, os.path.abspath("src/net"))
+
+    def test_page_ranges(self):
+        self.assertEqual(SearchFilter.parse(pages="3").pages, (3, 3))
+        self.assertEqual(SearchFilter.parse(pages="3-7").pages, (3, 7))
+        self.assertEqual(SearchFilter.parse(pages=" 3 - ").pages, (3, None))
+        for bad in ("x", "7-3", "-3", "1-2-3"):
+            with self.subTest(pages=bad), self.assertRaises(ValueError):
+                SearchFilter.parse(pages=bad)
+
+    def test_from_request(self):
+        flt = SearchFilter.from_request({"filter": {"ext": ["cpp"], "repo": "netlib", "pages": [2, 4]}})
+        self.assertEqual((flt.exts, flt.repos, flt.pages), ((".cpp",), ("netlib",), (2, 4)))
+        self.assertIsNone(SearchFilter.from_request({}))
+        with self.assertRaises(ValueError):
+            SearchFilter.from_request({"filter": "cpp"})
+
+
+class MatchTest(unittest.TestCase):
+    def test_matches(self):
+        flt = SearchFilter(path_prefix="/pool/net/", exts=(".cpp",), repos=("net",), pages=None)
+        self.assertTrue(flt.matches({"source_path": "/pool/net/a.cpp", "ext": ".cpp", "repo": "net"}))
+        self.assertFalse(flt.matches({"source_path": "/pool/network/a.cpp", "ext": ".cpp", "repo": "net"}))
+        self.assertFalse(flt.matches({"source_path": "/pool/net/a.h", "ext": ".h", "repo": "net"}))
+        self.assertFalse(flt.matches({"source_path": "/pool/net/a.cpp", "ext": ".cpp", "repo": "core"}))
+
+    def test_ext_falls_back_to_the_path_for_old_rows(self):
+        self.assertTrue(SearchFilter(exts=(".h",)).matches({"source_path": "/r/A.H"}))
+
+    def test_pages(self):
+        flt = SearchFilter(pages=(2, None))
+        self.assertTrue(flt.matches({"source_path": "/d.pdf", "page": 9}))
+        self.assertFalse(flt.matches({"source_path": "/d.pdf", "page": 1}))
+        self.assertFalse(flt.matches({"source_path": "/a.cpp"}))
+
+    def test_pushdown(self):
+        flt = SearchFilter(path_prefix="/r/src/", exts=(".h",))
+        self.assertFalse(flt.pushed_down)
+        self.assertEqual(flt.conditions(), [("ext", "in", [".h"])])
+        resolved = SearchFilter(path_prefix="/r/src/", exts=(".h",), paths=("/r/src/a.h",))
+        self.assertTrue(resolved.pushed_down)
+        self.assertEqual(resolved.conditions()[0], ("source_path", "in", ["/r/src/a.h"]))
+
+    def test_describe(self):
+        flt = SearchFilter(path_prefix="/r/", exts=(".h", ".cpp"), pages=(3, None))
+        self.assertEqual(flt.describe(), "path=/r/ ext=.h,.cpp pages=3-")
+
+
+class StoreTranslationTest(unittest.TestCase):
+    def test_chroma_where(self):
+        self.assertEqual(ChromaStore._where(SearchFilter(exts=(".h",))), {"ext": ".h"})
+        self.assertEqual(ChromaStore._where(SearchFilter(repos=("a", "b"), pages=(2, 5))),
+                         {"$and": [{"repo": {"$in": ["a", "b"]}}, {"page": {"$gte": 2}}, {"page": {"$lte": 5}}]})
+
+    def test_qdrant_filter(self):
+        self.assertEqual(QdrantStore._filter(SearchFilter(exts=(".h", ".cpp"), pages=(2, None))),
+                         {"must": [{"key": "ext", "match": {"any": [".h", ".cpp"]}}, {"key": "page", "range": {"gte": 2}}]})
+
+
+if __name__ == "__main__":
+    unittest.main()
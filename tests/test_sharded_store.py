@@ -0,0 +1,57 @@
+import os
+import tempfile
+import unittest
+from pathlib import Path
+
+from Rag import ShardedStore, StoreConfig
+
+
+class _Shard:
+    def __init__(self, name: str):
+        self.name = name
+        self.deleted = []
+
+    def delete_by_source_paths(self, paths, batch=500):
+        self.deleted.extend(paths)
+
+
+class ShardedDeleteTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        self.root = Path(self._tmp.name) / "src"
+        for repo in ("alpha", "beta"):
+            (self.root / repo / ".git").mkdir(parents=True)
+            (self.root / repo / "a.cpp").write_text("int a;\n")
+        self.made = {}
+
+    def tearDown(self):
+        self._tmp.cleanup()
+
+    def store(self, shard_by: str) -> ShardedStore:
+        cfg = StoreConfig(os.path.join(self._tmp.name, "db"), "c")
+        cfg.data.update(shard_by=shard_by, root=str(self.root), shards=["alpha", "beta"])
+        cfg.save()
+        return ShardedStore(cfg, lambda name: self.made.setdefault(name, _Shard(name)))
+
+    def deleted(self):
+        return {name.split("--")[1]: sorted(st.deleted) for name, st in self.made.items() if st.deleted}
+
+    def test_existing_files_go_to_their_shard(self):
+        st = self.store("repo")
+        st.delete_by_source_paths([str(self.root / "alpha" / "a.cpp")])
+        self.assertEqual(self.deleted(), {"alpha": [str(self.root / "alpha" / "a.cpp")]})
+
+    def test_vanished_files_fan_out(self):
+        st = self.store("repo")
+        gone = str(self.root / "gamma" / "b.cpp")
+        st.delete_by_source_paths([str(self.root / "beta" / "a.cpp"), gone])
+        self.assertEqual(self.deleted(), {"alpha": [gone], "beta": sorted([str(self.root / "beta" / "a.cpp"), gone])})
+
+    def test_top_routes_vanished_files_by_path(self):
+        st = self.store("top")
+        st.delete_by_source_paths([str(self.root / "beta" / "gone.cpp"), str(self.root / "gamma" / "x.cpp")])
+        self.assertEqual(self.deleted(), {"beta": [str(self.root / "beta" / "gone.cpp")]})
+
+
+if __name__ == "__main__":
+    unittest.main()
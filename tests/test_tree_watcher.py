@@ -0,0 +1,65 @@
+import os
+import sys
+import tempfile
+import unittest
+from pathlib import Path
+
+from Rag import TreeWatcher, build_ignore_spec
+
+
+@unittest.skipUnless(sys.platform.startswith("linux"), "inotify is Linux-only")
+class TreeWatcherTest(unittest.TestCase):
+    def setUp(self):
+        self._tmp = tempfile.TemporaryDirectory()
+        base = Path(self._tmp.name).resolve()
+        self.root = base / "src"
+        self.outside = base / "elsewhere"
+        for d in ("net", "gen/sub"):
+            (self.root / d).mkdir(parents=True)
+        self.outside.mkdir()
+        self.w = TreeWatcher(self.root, build_ignore_spec(self.root, []), [".cpp", ".h"], debounce=0, max_delay=0)
+
+    def tearDown(self):
+        self.w.close()
+        self._tmp.cleanup()
+
+    def drain(self):
+        batches = []
+        while True:
+            batch = self.w.poll(timeout=0.2)
+            if batch is None:
+                return batches
+            batches.append(batch)
+
+    def kernel_watches(self) -> int:
+        with open(f"/proc/self/fdinfo/{self.w.ino.fd}") as f:
+            return sum(line.startswith("inotify wd:") for line in f)
+
+    def test_directory_moved_out_is_unwatched(self):
+        self.assertEqual(self.w.watch_count, 4)  # root, net, gen, gen/sub
+        os.rename(self.root / "gen", self.outside / "gen")
+        self.assertEqual([b[1] for b in self.drain()], [["gen"]])
+        self.assertEqual(self.w.watch_count, 2)
+        self.assertEqual(self.kernel_watches(), 2)
+        (self.outside / "gen" / "sub" / "x.cpp").write_text("int x;\n")
+        self.assertEqual(self.drain(), [])  # nothing from the tree that moved away
+
+    def test_deleted_directory_drops_its_watch(self):
+        (self.root / "gen" / "sub").rmdir()
+        self.drain()
+        self.assertEqual(self.w.watch_count, 3)
+
+    def test_gitignore_change_rewatches_and_rescans(self):
+        (self.root / ".gitignore").write_text("gen/\n")
+        batches = self.drain()
+        self.assertEqual([b[2] for b in batches], [[""]])
+        self.assertEqual(self.w.watch_count, 2)
+        (self.root / ".gitignore").unlink()
+        self.drain()
+        self.assertEqual(self.w.watch_count, 4)
+        (self.root / "gen" / "a.cpp").write_text("int a;\n")
+        self.assertEqual([b[0] for b in self.drain()], [["gen/a.cpp"]])
+
+
+if __name__ == "__main__":
+    unittest.main()